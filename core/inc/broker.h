@@ -24,21 +24,87 @@ typedef struct BROKER_HANDLE_DATA_TAG* BROKER_HANDLE;
 
 #ifdef __cplusplus
 #include <cstddef>
+#include <cstdint>
 extern "C"
 {
 #else
 #include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
 #endif
 
 #define BROKER_LINK_MESSAGE_TYPE_VALUES \
     BROKER_LINK_MESSAGE_TYPE_DEFAULT, \
-    BROKER_LINK_MESSAGE_TYPE_THREAD
+    BROKER_LINK_MESSAGE_TYPE_THREAD, \
+    BROKER_LINK_MESSAGE_TYPE_DIRECT
 
 /** @brief      Enumeration describing the value of : GATEWA_LINK_ENTRY.message_type
 */
 DEFINE_ENUM(BROKER_LINK_MESSAGE_TYPE, BROKER_LINK_MESSAGE_TYPE_VALUES);
 
 
+#define BROKER_LINK_QUEUE_POLICY_VALUES \
+    BROKER_LINK_QUEUE_POLICY_BLOCK, \
+    BROKER_LINK_QUEUE_POLICY_DROP_OLDEST, \
+    BROKER_LINK_QUEUE_POLICY_DROP_NEWEST, \
+    BROKER_LINK_QUEUE_POLICY_FAIL, \
+    BROKER_LINK_QUEUE_POLICY_SPILL
+
+/** @brief      Enumeration describing what a publish does when the queue of a
+*               bounded thread-message link is full: wait for the sink, discard
+*               the oldest queued message, discard the new message, return
+*               #BROKER_QUEUE_FULL, or append the message to a file on disk
+*               that the sink reads back in order once it has caught up.
+*
+*               A publish waiting under #BROKER_LINK_QUEUE_POLICY_BLOCK has
+*               already handed the message to every other sink, and does not
+*               hold up link or module changes. It gives up and discards the
+*               message when the link is removed or the sink shuts down.
+*               Publishes from a #BROKER_SCHEDULER_POOL worker never wait and
+*               discard the message instead.
+*/
+DEFINE_ENUM(BROKER_LINK_QUEUE_POLICY, BROKER_LINK_QUEUE_POLICY_VALUES);
+
+#define BROKER_LINK_BALANCE_VALUES \
+    BROKER_LINK_BALANCE_ROUND_ROBIN, \
+    BROKER_LINK_BALANCE_SHORTEST_QUEUE, \
+    BROKER_LINK_BALANCE_PARTITION
+
+/** @brief      Enumeration describing how a message published to a group of
+*               thread-message links picks the one link it is queued on: in
+*               turn, the link with the fewest queued messages, or the link
+*               at the hash of its partition key modulo the group size, which
+*               keeps the messages of one key in order on one sink.
+*/
+DEFINE_ENUM(BROKER_LINK_BALANCE, BROKER_LINK_BALANCE_VALUES);
+
+#define BROKER_MESSAGE_PRIORITY_VALUES \
+    BROKER_MESSAGE_PRIORITY_LOW, \
+    BROKER_MESSAGE_PRIORITY_NORMAL, \
+    BROKER_MESSAGE_PRIORITY_HIGH
+
+/** @brief      Enumeration describing the priority class of a message. A
+*               thread-message sink takes higher classes first; a message
+*               that has waited longer than the aging limit is taken before
+*               any class.
+*/
+DEFINE_ENUM(BROKER_MESSAGE_PRIORITY, BROKER_MESSAGE_PRIORITY_VALUES);
+
+/** @brief      Message property giving the priority class of a message
+*               published with ::Broker_Publish: "high", "normal" or "low".
+*               Messages without it are #BROKER_MESSAGE_PRIORITY_NORMAL.
+*/
+#define BROKER_PRIORITY_PROPERTY "broker.priority"
+
+/** @brief      Message property giving, in decimal milliseconds, how long a
+*               message stays worth delivering after it is published. The
+*               sinks of thread-message and default links discard it unread
+*               once it is older; the ttl_ms of the link applies as well, the
+*               shorter one winning. Messages without it, or with 0, do not
+*               expire on their own.
+*/
+#define BROKER_TTL_PROPERTY "broker.ttl-ms"
+
 /** @brief    Link Data with #MODULE_HANDLE for source and sink. 
 */
 typedef struct BROKER_LINK_DATA_TAG {
@@ -51,26 +117,302 @@ typedef struct BROKER_LINK_DATA_TAG {
     /** @brief    #message_type representing the message type between sink and source.
     */
     BROKER_LINK_MESSAGE_TYPE message_type;
+    /** @brief    Maximum number of messages queued on a thread-message link,
+    *             0 for no limit.
+    */
+    size_t queue_capacity;
+    /** @brief    #BROKER_LINK_QUEUE_POLICY applied when the queue is full.
+    *             Ignored when queue_capacity is 0.
+    */
+    BROKER_LINK_QUEUE_POLICY queue_policy;
+    /** @brief    Filter on the message properties, such as
+    *             <tt>type == "telemetry" && !debug</tt>. Only matching
+    *             messages are delivered over the link. NULL delivers all.
+    */
+    const char* predicate;
+    /** @brief    Name of a group of competing consumers. Thread-message links
+    *             from one source with the same group name share its messages:
+    *             each message goes to exactly one of their sinks whose
+    *             predicate takes it. NULL for a link of its own.
+    */
+    const char* group;
+    /** @brief    #BROKER_LINK_BALANCE of the group, taken from its first
+    *             link. Ignored when group is NULL.
+    */
+    BROKER_LINK_BALANCE group_balance;
+    /** @brief    Message property hashed by #BROKER_LINK_BALANCE_PARTITION.
+    *             Messages without it are balanced round robin.
+    */
+    const char* partition_key;
+    /** @brief    Comma separated message properties, such as
+    *             <tt>macAddress,characteristicUUID</tt>, that make up the
+    *             coalescing key of a thread-message link. The link then keeps
+    *             at most one queued message per key: a newer message replaces
+    *             the queued one in place. Messages without any of the
+    *             properties are queued as usual. NULL queues every message.
+    */
+    const char* coalesce;
+    /** @brief    Delivers one in every sample_every messages from the source
+    *             that the predicate takes, 0 or 1 delivers all of them.
+    */
+    size_t sample_every;
+    /** @brief    Delivers at most this many messages per second over the
+    *             link, 0 for no limit. Messages above the rate are skipped,
+    *             not delayed.
+    */
+    double max_rate_hz;
+    /** @brief    Milliseconds a message may wait between its publish and its
+    *             delivery over a thread-message or default link before the
+    *             sink discards it unread, 0 for no limit. Direct links
+    *             deliver at once and ignore it.
+    */
+    size_t ttl_ms;
+    /** @brief    Directory of the segment files of a link with
+    *             #BROKER_LINK_QUEUE_POLICY_SPILL, NULL for @c TMPDIR or
+    *             /tmp. The files are removed as soon as they are created
+    *             and do not survive the gateway.
+    */
+    const char* spill_directory;
 } BROKER_LINK_DATA;
 
+/** @brief    Queue counters of a thread-message link, see
+*             ::Broker_GetLinkQueueStatistics.
+*/
+typedef struct BROKER_LINK_QUEUE_STATISTICS_TAG {
+    /** @brief    Messages currently queued. */
+    size_t depth;
+    /** @brief    Configured capacity, 0 for no limit. */
+    size_t capacity;
+    /** @brief    Queued messages discarded to make room for new ones. */
+    size_t dropped_oldest;
+    /** @brief    New messages discarded because the queue was full. */
+    size_t dropped_newest;
+    /** @brief    Publishes that returned #BROKER_QUEUE_FULL. */
+    size_t rejected;
+    /** @brief    Messages written to disk because the queue was full. */
+    size_t spilled;
+    /** @brief    Messages currently on disk, not counted in @c depth. */
+    size_t spill_depth;
+} BROKER_LINK_QUEUE_STATISTICS;
+
+/** @brief    Number of buckets of a #BROKER_LATENCY_HISTOGRAM. */
+#define BROKER_LATENCY_HISTOGRAM_BUCKETS 96
+
+/** @brief    Log-linear histogram of durations in microseconds. Values
+*             below 4 have a bucket each, above that every power of two is
+*             split into 4 buckets, so a bucket is at most 25% wide. The last
+*             bucket also holds everything above its limit (about 33 s).
+*/
+typedef struct BROKER_LATENCY_HISTOGRAM_TAG {
+    /** @brief    Samples per bucket, see ::Broker_LatencyHistogramBucketLimit. */
+    size_t counts[BROKER_LATENCY_HISTOGRAM_BUCKETS];
+    /** @brief    Number of samples. */
+    size_t count;
+    /** @brief    Sum of the samples, in microseconds. */
+    uint64_t total_us;
+    /** @brief    Largest sample, in microseconds. */
+    uint64_t max_us;
+} BROKER_LATENCY_HISTOGRAM;
+
+/** @brief    Counters of one module, see ::Broker_GetStatistics.
+*/
+typedef struct BROKER_MODULE_STATISTICS_TAG {
+    /** @brief    The module. */
+    MODULE_HANDLE module;
+    /** @brief    Messages the module published. */
+    size_t published;
+    /** @brief    Messages handed to the module's Receive, over all links. */
+    size_t delivered;
+    /** @brief    Messages for the module dropped or rejected by its full
+    *             thread-message links.
+    */
+    size_t dropped;
+    /** @brief    Messages for the module discarded unread by its
+    *             thread-message and default links because they expired.
+    */
+    size_t expired;
+    /** @brief    Messages currently queued on its thread-message links. */
+    size_t queue_depth;
+    /** @brief    Content and property bytes of those messages. */
+    size_t queued_bytes;
+    /** @brief    Flagged by the watchdog as a slow consumer, see
+    *             #BROKER_CONFIG slow_receive_us.
+    */
+    bool slow;
+    /** @brief    Time from publish to the start of Receive. */
+    BROKER_LATENCY_HISTOGRAM receive_latency;
+    /** @brief    Time spent in Receive. */
+    BROKER_LATENCY_HISTOGRAM receive_duration;
+} BROKER_MODULE_STATISTICS;
+
+/** @brief    Counters of one thread-message link, see ::Broker_GetStatistics.
+*             Default links have no queue of their own in the broker; their
+*             traffic shows in the module counters of the sink.
+*/
+typedef struct BROKER_LINK_STATISTICS_TAG {
+    /** @brief    Source of the link. */
+    MODULE_HANDLE source;
+    /** @brief    Sink of the link. */
+    MODULE_HANDLE sink;
+    /** @brief    Messages queued on the link. */
+    size_t enqueued;
+    /** @brief    Messages taken off the link for the sink's Receive. */
+    size_t delivered;
+    /** @brief    Queued messages discarded to make room for new ones. */
+    size_t dropped_oldest;
+    /** @brief    New messages discarded because the queue was full. */
+    size_t dropped_newest;
+    /** @brief    Publishes that returned #BROKER_QUEUE_FULL. */
+    size_t rejected;
+    /** @brief    Queued messages replaced by a newer one with the same
+    *             coalescing key.
+    */
+    size_t coalesced;
+    /** @brief    Messages skipped by the sampling or rate limit of the link. */
+    size_t sampled_out;
+    /** @brief    Messages written to disk because the queue was full. */
+    size_t spilled;
+    /** @brief    Queued messages discarded unread because they outlived
+    *             their #BROKER_TTL_PROPERTY or the ttl_ms of the link.
+    */
+    size_t expired;
+    /** @brief    Messages currently queued. */
+    size_t depth;
+    /** @brief    Content and property bytes of the messages currently queued. */
+    size_t queued_bytes;
+    /** @brief    Messages currently on disk, not counted in @c depth. */
+    size_t spill_depth;
+    /** @brief    Highest depth seen since the link was added. */
+    size_t peak_depth;
+    /** @brief    Configured capacity, 0 for no limit. */
+    size_t capacity;
+    /** @brief    Time from publish until the sink takes the message off
+    *             the link.
+    */
+    BROKER_LATENCY_HISTOGRAM queue_latency;
+} BROKER_LINK_STATISTICS;
+
+/** @brief    Snapshot filled by ::Broker_GetStatistics and released with
+*             ::Broker_FreeStatistics.
+*/
+typedef struct BROKER_STATISTICS_TAG {
+    /** @brief    Number of entries in @c modules. */
+    size_t module_count;
+    /** @brief    One entry per module attached to the broker. */
+    BROKER_MODULE_STATISTICS* modules;
+    /** @brief    Number of entries in @c links. */
+    size_t link_count;
+    /** @brief    One entry per thread-message link. */
+    BROKER_LINK_STATISTICS* links;
+    /** @brief    Content and property bytes of the messages held for
+    *             thread-message links, queued or being received. A message
+    *             queued on several links counts once.
+    */
+    size_t held_bytes;
+    /** @brief    Configured #BROKER_CONFIG memory_budget, 0 for none. */
+    size_t memory_budget;
+    /** @brief    Messages dropped to free memory or refused to stay
+    *             within the budget.
+    */
+    size_t memory_shed;
+} BROKER_STATISTICS;
+
 #define BROKER_RESULT_VALUES \
     BROKER_OK, \
     BROKER_ERROR, \
     BROKER_ADD_LINK_ERROR, \
     BROKER_REMOVE_LINK_ERROR, \
-    BROKER_INVALIDARG
+    BROKER_INVALIDARG, \
+    BROKER_QUEUE_FULL
 
 /** @brief    Enumeration describing the result of ::Broker_Publish, 
 *            ::Broker_AddModule, ::Broker_AddLink, and ::Broker_RemoveModule.
 */
 DEFINE_ENUM(BROKER_RESULT, BROKER_RESULT_VALUES);
 
+#define BROKER_SCHEDULER_VALUES \
+    BROKER_SCHEDULER_THREAD_PER_MODULE, \
+    BROKER_SCHEDULER_POOL
+
+/** @brief      Enumeration describing how module Receive callbacks are run:
+*               one thread per module plus one per thread-message sink, or
+*               per-module actors on a fixed work-stealing worker pool. Either
+*               way a module never receives on two threads at once, so the
+*               per-sink message order is kept.
+*/
+DEFINE_ENUM(BROKER_SCHEDULER, BROKER_SCHEDULER_VALUES);
+
+#define BROKER_MEMORY_POLICY_VALUES \
+    BROKER_MEMORY_POLICY_DROP_NEWEST, \
+    BROKER_MEMORY_POLICY_SHED_LARGEST, \
+    BROKER_MEMORY_POLICY_FAIL
+
+/** @brief      Enumeration describing what a publish does when the messages
+*               held for thread-message links would exceed the memory budget:
+*               skip the thread-message sinks for the new message, drop the
+*               oldest messages of the sinks holding the most bytes until it
+*               fits, or skip them and return #BROKER_QUEUE_FULL. Shedding
+*               only drops messages that no other sink still holds, since
+*               dropping a shared message frees nothing.
+*/
+DEFINE_ENUM(BROKER_MEMORY_POLICY, BROKER_MEMORY_POLICY_VALUES);
+
+/** @brief    Called on the watchdog thread when a module becomes a slow
+*             consumer (@c slow true) or recovers (@c slow false).
+*             @c receive_us is the 99th percentile of its Receive durations
+*             over the last watchdog interval, or how long a Receive still
+*             running has taken if that is longer. The module may be removed
+*             from the broker by the time the callback runs; the callback
+*             must not destroy the broker.
+*/
+typedef void(*BROKER_SLOW_MODULE_CALLBACK)(BROKER_HANDLE broker, MODULE_HANDLE module, bool slow, uint64_t receive_us, void* context);
+
+/** @brief    Broker settings, see ::Broker_CreateWithConfig.
+*/
+typedef struct BROKER_CONFIG_TAG {
+    /** @brief    #BROKER_SCHEDULER used for every module of the broker. */
+    BROKER_SCHEDULER scheduler;
+    /** @brief    Worker threads of #BROKER_SCHEDULER_POOL, 0 for one per CPU. */
+    size_t worker_count;
+    /** @brief    Bytes of message content and properties the thread-message
+    *             links of the broker may hold at once, 0 for no limit.
+    *             Publishers running at the same time may each pass the check,
+    *             so the budget can be exceeded by about one message each.
+    */
+    size_t memory_budget;
+    /** @brief    #BROKER_MEMORY_POLICY applied when the budget is exceeded. */
+    BROKER_MEMORY_POLICY memory_policy;
+    /** @brief    Microseconds above which the 99th percentile of a module's
+    *             Receive durations, or a single Receive still running, makes
+    *             the watchdog flag the module as a slow consumer. 0 runs no
+    *             watchdog.
+    */
+    size_t slow_receive_us;
+    /** @brief    Milliseconds between two watchdog checks, 0 for 1000. */
+    size_t watchdog_interval_ms;
+    /** @brief    Optional #BROKER_SLOW_MODULE_CALLBACK; flagged modules are
+    *             logged either way.
+    */
+    BROKER_SLOW_MODULE_CALLBACK on_slow_module;
+    /** @brief    Passed to on_slow_module. */
+    void* on_slow_module_context;
+} BROKER_CONFIG;
+
 /** @brief        Creates a new message broker.
 *   
 *    @return        A valid #BROKER_HANDLE upon success, or @c NULL upon failure.
 */
 GATEWAY_EXPORT BROKER_HANDLE Broker_Create(void);
 
+/** @brief        Creates a new message broker with the given settings.
+*
+*    @param        config    The #BROKER_CONFIG to apply, or @c NULL for the
+*                        settings of ::Broker_Create.
+*
+*    @return        A valid #BROKER_HANDLE upon success, or @c NULL upon failure.
+*/
+GATEWAY_EXPORT BROKER_HANDLE Broker_CreateWithConfig(const BROKER_CONFIG* config);
+
 /** @brief        Increments the reference count of a message broker.
 *
 *    @details    This function will simply increment the internal reference
@@ -108,6 +450,46 @@ GATEWAY_EXPORT void Broker_DecRef(BROKER_HANDLE broker);
 */
 GATEWAY_EXPORT BROKER_RESULT Broker_Publish(BROKER_HANDLE broker, MODULE_HANDLE source, MESSAGE_HANDLE message);
 
+/** @brief        Publishes a message with an explicit priority class.
+*
+*    @details    Same as ::Broker_Publish except that @c priority is used
+*                instead of the #BROKER_PRIORITY_PROPERTY property. Priority
+*                classes only reorder messages queued on thread-message links;
+*                default links deliver in publish order.
+*
+*    @param        broker    The #BROKER_HANDLE onto which the message will be
+*                        published.
+*    @param        source    The #MODULE_HANDLE from which the message will be
+*                        published.
+*    @param        message    The #MESSAGE_HANDLE representing the message to be
+*                        published.
+*    @param        priority    The #BROKER_MESSAGE_PRIORITY of the message.
+*
+*    @return        A #BROKER_RESULT describing the result of the function.
+*/
+GATEWAY_EXPORT BROKER_RESULT Broker_PublishWithPriority(BROKER_HANDLE broker, MODULE_HANDLE source, MESSAGE_HANDLE message, BROKER_MESSAGE_PRIORITY priority);
+
+/** @brief        Publishes several messages from the same source in one call.
+*
+*    @details    Equivalent to calling ::Broker_Publish for each message in
+*                order, but the source route is looked up once, each
+*                thread-message sink gets one queue reservation and one
+*                wakeup, and default links receive the whole batch in a
+*                single nanomsg frame. Sinks see the messages in array order.
+*                The caller keeps ownership of the messages.
+*
+*    @param        broker    The #BROKER_HANDLE onto which the messages will be
+*                        published.
+*    @param        source    The #MODULE_HANDLE from which the messages will be
+*                        published.
+*    @param        messages    Array of @c count #MESSAGE_HANDLE values to be
+*                        published. None may be NULL.
+*    @param        count    Number of messages in @c messages, at least 1.
+*
+*    @return        A #BROKER_RESULT describing the result of the function.
+*/
+GATEWAY_EXPORT BROKER_RESULT Broker_PublishBatch(BROKER_HANDLE broker, MODULE_HANDLE source, MESSAGE_HANDLE* messages, size_t count);
+
 /** @brief        Adds a module to the message broker.
 *
 *    @details    For details about threading with regard to the message broker
@@ -156,6 +538,52 @@ GATEWAY_EXPORT BROKER_RESULT Broker_AddLink(BROKER_HANDLE broker, const BROKER_L
 */
 GATEWAY_EXPORT BROKER_RESULT Broker_RemoveLink(BROKER_HANDLE broker, const BROKER_LINK_DATA* link);
 
+/** @brief        Reads the queue counters of a thread-message link.
+*
+*    @details    Single-link shortcut of ::Broker_GetStatistics: the fields
+*                are the same counters as in #BROKER_LINK_STATISTICS.
+*
+*    @param        broker    The #BROKER_HANDLE holding the link.
+*    @param        link    The #BROKER_LINK_DATA identifying the link by source
+*                        and sink.
+*    @param        statistics    Receives the counters.
+*
+*    @return        #BROKER_OK, #BROKER_INVALIDARG, or #BROKER_ERROR when no
+*                thread-message link connects source and sink.
+*/
+GATEWAY_EXPORT BROKER_RESULT Broker_GetLinkQueueStatistics(BROKER_HANDLE broker, const BROKER_LINK_DATA* link, BROKER_LINK_QUEUE_STATISTICS* statistics);
+
+/** @brief        Takes a snapshot of the per-module and per-link counters.
+*
+*    @details    Counters are updated without locks by the publishing and
+*                receiving threads, so a snapshot taken under load is only
+*                approximately consistent between fields.
+*
+*    @param        broker    The #BROKER_HANDLE to inspect.
+*    @param        statistics    Receives the snapshot; release it with
+*                        ::Broker_FreeStatistics.
+*
+*    @return        A #BROKER_RESULT describing the result of the function.
+*/
+GATEWAY_EXPORT BROKER_RESULT Broker_GetStatistics(BROKER_HANDLE broker, BROKER_STATISTICS* statistics);
+
+/** @brief        Frees the arrays of a snapshot filled by ::Broker_GetStatistics.
+*
+*    @param        statistics    The snapshot, may be @c NULL.
+*/
+GATEWAY_EXPORT void Broker_FreeStatistics(BROKER_STATISTICS* statistics);
+
+/** @brief        Largest value, in microseconds, counted in bucket @c bucket of
+*                a #BROKER_LATENCY_HISTOGRAM.
+*/
+GATEWAY_EXPORT uint64_t Broker_LatencyHistogramBucketLimit(size_t bucket);
+
+/** @brief        Value, in microseconds, below which @c percentile percent of the
+*                samples fall, rounded up to a bucket limit. Returns 0 for an
+*                empty histogram.
+*/
+GATEWAY_EXPORT uint64_t Broker_LatencyHistogramPercentile(const BROKER_LATENCY_HISTOGRAM* histogram, double percentile);
+
 /** @brief      Disposes of resources allocated by a message broker.
 *
 *    @param      broker  The #BROKER_HANDLE to be destroyed.
@@ -66,12 +66,50 @@ DEFINE_ENUM(GATEWAY_UPDATE_FROM_JSON_RESULT, GATEWAY_UPDATE_FROM_JSON_RESULT_VAL
 
 #define GATEWAY_LINK_ENTRY_MESSAGE_TYPE_VALUES \
     GATEWAY_LINK_ENTRY_MESSAGE_TYPE_DEFAULT, \
-    GATEWAY_LINK_ENTRY_MESSAGE_TYPE_THREAD
+    GATEWAY_LINK_ENTRY_MESSAGE_TYPE_THREAD, \
+    GATEWAY_LINK_ENTRY_MESSAGE_TYPE_DIRECT
 
 /** @brief      Enumeration describing the value of : GATEWA_LINK_ENTRY.message_type
 */
 DEFINE_ENUM(GATEWAY_LINK_ENTRY_MESSAGE_TYPE, GATEWAY_LINK_ENTRY_MESSAGE_TYPE_VALUES);
 
+#define GATEWAY_LINK_ENTRY_QUEUE_POLICY_VALUES \
+    GATEWAY_LINK_ENTRY_QUEUE_POLICY_BLOCK, \
+    GATEWAY_LINK_ENTRY_QUEUE_POLICY_DROP_OLDEST, \
+    GATEWAY_LINK_ENTRY_QUEUE_POLICY_DROP_NEWEST, \
+    GATEWAY_LINK_ENTRY_QUEUE_POLICY_FAIL, \
+    GATEWAY_LINK_ENTRY_QUEUE_POLICY_SPILL
+
+/** @brief      Enumeration describing the value of : GATEWAY_LINK_ENTRY.queue_policy
+*/
+DEFINE_ENUM(GATEWAY_LINK_ENTRY_QUEUE_POLICY, GATEWAY_LINK_ENTRY_QUEUE_POLICY_VALUES);
+
+#define GATEWAY_LINK_ENTRY_GROUP_BALANCE_VALUES \
+    GATEWAY_LINK_ENTRY_GROUP_BALANCE_ROUND_ROBIN, \
+    GATEWAY_LINK_ENTRY_GROUP_BALANCE_SHORTEST_QUEUE, \
+    GATEWAY_LINK_ENTRY_GROUP_BALANCE_PARTITION
+
+/** @brief      Enumeration describing the value of : GATEWAY_LINK_ENTRY.group_balance
+*/
+DEFINE_ENUM(GATEWAY_LINK_ENTRY_GROUP_BALANCE, GATEWAY_LINK_ENTRY_GROUP_BALANCE_VALUES);
+
+#define GATEWAY_BROKER_SCHEDULER_VALUES \
+    GATEWAY_BROKER_SCHEDULER_THREAD_PER_MODULE, \
+    GATEWAY_BROKER_SCHEDULER_POOL
+
+/** @brief      Enumeration describing the value of : GATEWAY_PROPERTIES.broker_scheduler
+*/
+DEFINE_ENUM(GATEWAY_BROKER_SCHEDULER, GATEWAY_BROKER_SCHEDULER_VALUES);
+
+#define GATEWAY_BROKER_MEMORY_POLICY_VALUES \
+    GATEWAY_BROKER_MEMORY_POLICY_DROP_NEWEST, \
+    GATEWAY_BROKER_MEMORY_POLICY_SHED_LARGEST, \
+    GATEWAY_BROKER_MEMORY_POLICY_FAIL
+
+/** @brief      Enumeration describing the value of : GATEWAY_PROPERTIES.broker_memory_policy
+*/
+DEFINE_ENUM(GATEWAY_BROKER_MEMORY_POLICY, GATEWAY_BROKER_MEMORY_POLICY_VALUES);
+
 /** @brief      Struct representing a single link for a gateway. */
 typedef struct GATEWAY_LINK_ENTRY_TAG
 {
@@ -83,6 +121,45 @@ typedef struct GATEWAY_LINK_ENTRY_TAG
 
     /** @brief  The name of the message type between sink and source */
     GATEWAY_LINK_ENTRY_MESSAGE_TYPE message_type;
+
+    /** @brief  Maximum number of messages queued on a thread-message link, 0 for no limit */
+    size_t queue_capacity;
+
+    /** @brief  What a publish does when the link queue is full */
+    GATEWAY_LINK_ENTRY_QUEUE_POLICY queue_policy;
+
+    /** @brief  Filter on the message properties, NULL delivers all messages */
+    const char* predicate;
+
+    /** @brief  Thread-message links from one source with the same group share
+     *          its messages, each going to one of their sinks. NULL for none. */
+    const char* group;
+
+    /** @brief  How the group picks the sink of a message */
+    GATEWAY_LINK_ENTRY_GROUP_BALANCE group_balance;
+
+    /** @brief  Message property hashed by GATEWAY_LINK_ENTRY_GROUP_BALANCE_PARTITION */
+    const char* partition_key;
+
+    /** @brief  Comma separated message properties making up the coalescing key
+     *          of a thread-message link, which then keeps only the newest
+     *          queued message per key. NULL queues every message. */
+    const char* coalesce;
+
+    /** @brief  Delivers one in every sample_every messages, 0 or 1 delivers all */
+    size_t sample_every;
+
+    /** @brief  Delivers at most this many messages per second, 0 for no limit */
+    double max_rate_hz;
+
+    /** @brief  Milliseconds a message may wait for the sink before it is
+     *          discarded unread, 0 for no limit */
+    size_t ttl_ms;
+
+    /** @brief  Directory of the files a GATEWAY_LINK_ENTRY_QUEUE_POLICY_SPILL
+     *          link writes to when its queue is full, NULL for the system
+     *          temporary directory */
+    const char* spill_directory;
 } GATEWAY_LINK_ENTRY;
 
 /** @brief      Struct representing a particular gateway. */
@@ -117,6 +194,16 @@ typedef struct GATEWAY_MODULES_ENTRY_TAG
     const void* module_configuration;
 
 	const char* module_version;
+
+    /** @brief  Number of copies of the module to create, 0 or 1 for one. The
+     *          copies are named "<module_name>#<index>"; links naming
+     *          module_name are made with every copy. */
+    size_t instances;
+
+    /** @brief  Message property that picks the copy receiving a message, so
+     *          that messages of one key stay in order. NULL balances the
+     *          messages round robin. Ignored for a single instance. */
+    const char* partition_key;
 } GATEWAY_MODULES_ENTRY;
 
 /** @brief      Struct representing the properties that should be used when
@@ -132,6 +219,23 @@ typedef struct GATEWAY_PROPERTIES_DATA_TAG
     VECTOR_HANDLE gateway_links;
 
 	JSON_Object* deployConfig;
+
+    /** @brief  How the broker runs module Receive callbacks */
+    GATEWAY_BROKER_SCHEDULER broker_scheduler;
+
+    /** @brief  Worker threads of #GATEWAY_BROKER_SCHEDULER_POOL, 0 for one per CPU */
+    size_t broker_workers;
+
+    /** @brief  Bytes of messages the broker may hold for thread-message links, 0 for no limit */
+    size_t broker_memory_budget;
+
+    /** @brief  What a publish does when broker_memory_budget would be exceeded */
+    GATEWAY_BROKER_MEMORY_POLICY broker_memory_policy;
+
+    /** @brief  Milliseconds above which the 99th percentile of a module's
+     *          Receive durations gets it logged as a slow consumer, 0 for no
+     *          watchdog */
+    size_t broker_slow_receive_ms;
 } GATEWAY_PROPERTIES;
 
 /** @brief      Creates a gateway using a JSON configuration file as input
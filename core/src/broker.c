@@ -3,8 +3,24 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+/* on Linux the pool dispatcher waits on the modules' NN_RCVFD with epoll and
+ * is woken through an eventfd; elsewhere it uses nn_poll and a wake guid */
+#if defined(__linux__) && !defined(BROKER_DISPATCHER_NN_POLL)
+#define BROKER_DISPATCHER_EPOLL
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 
 #include "azure_c_shared_utility/gballoc.h"
+#include "azure_c_shared_utility/crt_abstractions.h"
 #include "azure_c_shared_utility/vector.h"
 #include "azure_c_shared_utility/strings.h"
 #include "azure_c_shared_utility/lock.h"
@@ -22,12 +38,59 @@
 #include "module.h"
 #include "module_access.h"
 #include "broker.h"
+#include "broker_atomic.h"
+#include "broker_queue.h"
+#include "broker_pool.h"
+#include "broker_predicate.h"
+#include "broker_slab.h"
+#include "broker_spill.h"
 
 /* minimum size for a guid string, 36 characters + null terminator */
 #define BROKER_GUID_SIZE 37
 #define INPROC_URL_HEAD "inproc://"
 #define INPROC_URL_HEAD_SIZE 9
 #define URL_SIZE (INPROC_URL_HEAD_SIZE + BROKER_GUID_SIZE +1)
+/* ring slots per thread-message link, messages beyond this go to the overflow list */
+#define THREAD_MESSAGE_QUEUE_CAPACITY 1024
+/* maximum number of messages the receiver thread takes per pass over its senders */
+#define THREAD_MESSAGE_RECEIVE_BATCH 64
+/* messages taken from one sender before moving to the next, so that a busy sender cannot fill a whole batch */
+#define THREAD_MESSAGE_SENDER_QUANTUM 8
+/* a publisher blocked on a full link re-checks the sink this often, in milliseconds */
+#define THREAD_MESSAGE_BLOCK_WAIT_MS 100
+/* one queue per BROKER_MESSAGE_PRIORITY on every thread-message link */
+#define THREAD_MESSAGE_LANE_COUNT 3
+/* a message queued longer than this is taken before any higher priority one */
+#define THREAD_MESSAGE_PRIORITY_AGING_US 100000
+/* property lengths of up to this many properties are cached on the stack while serializing */
+#define SERIALIZE_STACK_PROPERTIES 16
+/* Broker_Publish evaluates the link predicates of up to this many sinks without a malloc */
+#define THREAD_MESSAGE_FILTER_STACK_LINKS 16
+/* a spilled message is preceded by its publish time and priority */
+#define THREAD_MESSAGE_SPILL_HEADER_SIZE (2 * sizeof(uint64_t))
+/* initial buckets of the key table of a coalescing link, a power of two */
+#define THREAD_MESSAGE_COALESCE_BUCKETS 16
+/* direct links may call into each other this deep on one thread; deeper publishes are refused */
+#define BROKER_DIRECT_MAX_DEPTH 8
+/* leading bytes of a serialized message, as written by Message_ToByteArray */
+#define SERIALIZED_MESSAGE_HEADER_0 0xA1
+#define SERIALIZED_MESSAGE_HEADER_1 0x60
+/* second header byte of a frame holding several serialized messages, see Broker_PublishBatch */
+#define SERIALIZED_BATCH_HEADER_1 0x61
+/* a nanomsg frame starts with the source handle (the topic) and the publish time */
+#define BROKER_FRAME_HEADER_SIZE (sizeof(MODULE_HANDLE) + sizeof(uint64_t))
+/* frames the dispatcher may park per module before it stops reading that socket, a power of two */
+#define BROKER_ACTOR_MAILBOX_SIZE 256
+/* upper bound on how long the dispatcher sleeps in nn_poll, in milliseconds */
+#define BROKER_DISPATCHER_POLL_MS 1000
+/* ready sockets the dispatcher takes from one epoll_wait */
+#define BROKER_DISPATCHER_EVENTS 64
+/* oldest messages BROKER_MEMORY_POLICY_SHED_LARGEST drops at most to make room for one */
+#define BROKER_MEMORY_SHED_ROUNDS 64
+/* links holding the most bytes that BROKER_MEMORY_POLICY_SHED_LARGEST picks in its one pass over the routes */
+#define BROKER_MEMORY_SHED_LINKS 4
+/* default time between two slow-consumer checks, in milliseconds */
+#define BROKER_WATCHDOG_INTERVAL_MS 1000
 
 /*The structure backing the message broker handle*/
 typedef struct BROKER_HANDLE_DATA_TAG
@@ -36,15 +99,79 @@ typedef struct BROKER_HANDLE_DATA_TAG
     LOCK_HANDLE             modules_lock;
     int                     publish_socket;
     STRING_HANDLE           url;
+    /** Routing snapshot read by Broker_Publish without modules_lock */
+    struct BROKER_ROUTING_TABLE_TAG* volatile routing;
+    volatile size_t         routing_epoch;
+    volatile size_t         routing_readers[2];
+    /** BROKER_SCHEDULER_POOL: workers running the module actors, and the
+     *  thread moving frames from the module sockets to the actors */
+    BROKER_SCHEDULER        scheduler;
+    BROKER_POOL_HANDLE      pool;
+    struct BROKER_DISPATCHER_TAG* dispatcher;
+    /** Bytes of the messages held for thread-message links, checked against
+     *  memory_budget (0 for none) before a publisher clones a message */
+    volatile size_t         held_bytes;
+    size_t                  memory_budget;
+    BROKER_MEMORY_POLICY    memory_policy;
+    volatile size_t         memory_shed;
+    /** Thread flagging slow consumers, NULL when BROKER_CONFIG.slow_receive_us is 0 */
+    struct BROKER_WATCHDOG_TAG* watchdog;
 }BROKER_HANDLE_DATA;
 
 DEFINE_REFCOUNT_TYPE(BROKER_HANDLE_DATA);
 
+/* Decimation of one link, applied by the publisher before the message is
+ * cloned for the link, or by a default sink before the frame is decoded.
+ * every takes one message in every, interval_us at most one message per
+ * interval; next_us wraps with size_t and is compared by difference. */
+typedef struct BROKER_LINK_SAMPLER_TAG {
+    size_t every;
+    size_t interval_us;
+    volatile size_t seen;
+    volatile size_t next_us;
+    volatile size_t skipped;
+} BROKER_LINK_SAMPLER;
+
+/* One published message shared by every thread-message sink of the source.
+ * Each sink drops one reference once its Module_Receive returns. */
 typedef struct THREAD_MESSAGE_CTRL_TAG {
     MESSAGE_HANDLE msg;
-    void* next;
+    volatile size_t refcount;
+    /* broker_clock_us() at publish */
+    uint64_t published_us;
+    /* BROKER_TTL_PROPERTY of msg in microseconds, 0 when it does not expire */
+    uint64_t ttl_us;
+    BROKER_MESSAGE_PRIORITY priority;
+    /* THREAD_MESSAGE_COALESCE_SLOT of a message queued on a coalescing link, NULL otherwise */
+    struct THREAD_MESSAGE_COALESCE_SLOT_TAG* coalesce_slot;
+    /* message_footprint of msg, charged to broker->held_bytes while the control lives */
+    size_t bytes;
+    BROKER_HANDLE_DATA* broker;
 } THREAD_MESSAGE_CTRL;
 
+/* The message queued on a coalescing link for one key. Publishers with the
+ * same key swap the message in place until the receiver takes it, which
+ * unlinks the slot. */
+typedef struct THREAD_MESSAGE_COALESCE_SLOT_TAG {
+    struct THREAD_MESSAGE_HANDLING_RECEIVERS_IN_SENDER_TAG* link;
+    char* key;
+    size_t hash;
+    /* owned by the link: its own copy of the control, with a single reference */
+    THREAD_MESSAGE_CTRL* msgCtrl;
+    struct THREAD_MESSAGE_COALESCE_SLOT_TAG* next;
+} THREAD_MESSAGE_COALESCE_SLOT;
+
+typedef struct THREAD_MESSAGE_OVERFLOW_TAG {
+    THREAD_MESSAGE_CTRL* msgCtrl;
+    void* next;
+} THREAD_MESSAGE_OVERFLOW;
+
+/* Controls and overflow nodes come and go with every message, so they are
+ * recycled through slabs rather than the heap. Process wide, since the
+ * thread caches outlive any one broker. */
+static BROKER_SLAB thread_message_ctrl_slab = BROKER_SLAB_INITIALIZER(sizeof(THREAD_MESSAGE_CTRL));
+static BROKER_SLAB thread_message_overflow_slab = BROKER_SLAB_INITIALIZER(sizeof(THREAD_MESSAGE_OVERFLOW));
+
 typedef struct THREAD_MESSAGE_HANDLING_RECEIVER_TAG {
     LOCK_HANDLE lock;
     COND_HANDLE condition;
@@ -52,20 +179,140 @@ typedef struct THREAD_MESSAGE_HANDLING_RECEIVER_TAG {
     void* module_info;  // this type should be BROKER_MODULEINFO*
     void* senders;  // this type should be THREAD_MESSAGE_HANDLING_SENDERS_IN_RECEIVER
     bool toContinue;
+    /* non zero while the receiver thread sleeps on condition; publishers only take lock when it is set */
+    volatile size_t waiting;
+    /* bumped on every take so that each batch starts with the next sender */
+    size_t rotation;
 } THREAD_MESSAGE_HANDLING_RECEIVER;
 
+/* The messages of one priority class queued on a link. */
+typedef struct THREAD_MESSAGE_LANE_TAG {
+    /* lock-free ring the publishers push into and the receiver thread pops from */
+    BROKER_QUEUE_HANDLE queue;
+    /* slow path used only while the ring is full, keeps the lane unbounded and in order */
+    LOCK_HANDLE overflow_lock;
+    THREAD_MESSAGE_OVERFLOW* overflow_head;
+    THREAD_MESSAGE_OVERFLOW* overflow_tail;
+    volatile size_t overflow_count;
+} THREAD_MESSAGE_LANE;
+
 typedef struct THREAD_MESSAGE_HANDLING_RECEIVERS_IN_SENDER_TAG{
     THREAD_MESSAGE_HANDLING_RECEIVER* receiver;
-    THREAD_MESSAGE_CTRL*    sendingMessages;
+    /* indexed by BROKER_MESSAGE_PRIORITY */
+    THREAD_MESSAGE_LANE lanes[THREAD_MESSAGE_LANE_COUNT];
+    /* maximum of depth over all lanes, 0 when the link is unbounded */
+    size_t capacity;
+    BROKER_LINK_QUEUE_POLICY policy;
+    /* messages queued or being queued on the link */
+    volatile size_t depth;
+    /* sum of the bytes of those messages */
+    volatile size_t queued_bytes;
+    /* publishers waiting on the sink's fc_condition for room, BROKER_LINK_QUEUE_POLICY_BLOCK only */
+    volatile size_t blocked_publishers;
+    /* messages of publishers that found the link full and wait for room after
+     * their routing read section, each keeping the link alive until queued */
+    volatile size_t pins;
+    /* set by Broker_RemoveLink once the link is out of the routing snapshot, ends those waits */
+    volatile size_t removed;
+    volatile size_t dropped_oldest;
+    volatile size_t dropped_newest;
+    volatile size_t rejected;
+    volatile size_t enqueued;
+    volatile size_t peak_depth;
+    /* written only by the consumer, under the receiver lock */
+    volatile size_t delivered;
+    BROKER_LATENCY_HISTOGRAM queue_latency;
+    /* queued messages older than this are discarded by the consumer, 0 for no limit */
+    uint64_t ttl_us;
+    /* written only by the consumer, under the receiver lock */
+    volatile size_t expired;
+    /* messages whose properties do not match are not queued, NULL takes all */
+    BROKER_PREDICATE_HANDLE predicate;
+    BROKER_LINK_SAMPLER sampler;
+    /* links of one source with the same group take turns on its messages, NULL for none */
+    char* group;
+    BROKER_LINK_BALANCE balance;
+    /* BROKER_LINK_BALANCE_PARTITION only, the property hashed */
+    char* partition_key;
+    /* messages balanced over the group, only counted on its first link */
+    volatile size_t group_turn;
+    /* coalescing links only: the properties making up the key, and the
+     * queued messages by key in a hash table guarded by coalesce_lock */
+    char** coalesce_keys;
+    size_t coalesce_key_count;
+    LOCK_HANDLE coalesce_lock;
+    THREAD_MESSAGE_COALESCE_SLOT** coalesce_slots;
+    size_t coalesce_bucket_count;
+    size_t coalesce_slot_count;
+    /* queued messages replaced by a newer one */
+    volatile size_t coalesced;
+    /* BROKER_LINK_QUEUE_POLICY_SPILL only: messages that found the queue full,
+     * and every message after them until the consumer has read them back,
+     * go to the spill under spill_lock */
+    BROKER_SPILL_HANDLE spill;
+    LOCK_HANDLE spill_lock;
+    volatile size_t spill_count;
+    volatile size_t spilled;
     void* next;
 } THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER;
 
+/* A message for a full BROKER_LINK_QUEUE_POLICY_BLOCK link, put aside inside
+ * the routing read section and queued by its publisher once it left it. */
+typedef struct THREAD_MESSAGE_BLOCKED_TAG {
+    THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link;
+    THREAD_MESSAGE_CTRL* msgCtrl;
+    struct THREAD_MESSAGE_BLOCKED_TAG* next;
+} THREAD_MESSAGE_BLOCKED;
+
 typedef struct THREAD_MESSAGE_HANDLING_SENDER_TAG {
     LOCK_HANDLE lock;
     THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* receivers;
+    size_t receiver_count;
 } THREAD_MESSAGE_HANDLING_SENDER;
 
 
+/* Receive counters of one delivery path of a module. Each path has a single
+ * writer at a time (module_worker, the receiver thread, or the actor), so the
+ * counters are plain stores that Broker_GetStatistics reads racily. */
+typedef struct BROKER_RECEIVE_STATISTICS_TAG
+{
+    volatile size_t delivered;
+    /* default path only: frames discarded unread because they expired */
+    volatile size_t expired;
+    /* truncated broker_clock_us() at the start of the Receive running on the path, 0 when none is */
+    volatile size_t started_us;
+    BROKER_LATENCY_HISTOGRAM latency;
+    BROKER_LATENCY_HISTOGRAM duration;
+} BROKER_RECEIVE_STATISTICS;
+
+/* BROKER_SCHEDULER_POOL: a module is an actor run on the pool whenever its
+ * mailbox or one of its thread-message links has messages. At most one
+ * worker runs a given actor at a time, which keeps per-sink ordering. */
+typedef struct BROKER_ACTOR_TAG
+{
+    BROKER_POOL_HANDLE pool;
+    struct BROKER_MODULEINFO_TAG* module_info;
+    /* 1 from the moment the actor is submitted until a run finds no more work */
+    volatile size_t scheduled;
+    /* runs in progress, stop_module waits for 0 before freeing the actor */
+    volatile size_t running;
+    /* frames read by the dispatcher (single producer) for the actor (single consumer) */
+    unsigned char* mailbox[BROKER_ACTOR_MAILBOX_SIZE];
+    int mailbox_sizes[BROKER_ACTOR_MAILBOX_SIZE];
+    volatile size_t mailbox_head;
+    volatile size_t mailbox_tail;
+    /* frame read while the mailbox was full, owned by the dispatcher thread */
+    unsigned char* pending;
+    int pending_size;
+#ifdef BROKER_DISPATCHER_EPOLL
+    /* NN_RCVFD of the module's socket; while a frame is parked it is left
+     * out of the epoll set and the actor is on the dispatcher's parked list */
+    int receive_fd;
+    bool parked;
+    struct BROKER_ACTOR_TAG* parked_next;
+#endif
+} BROKER_ACTOR;
+
 typedef struct BROKER_MODULEINFO_TAG
 {
     /** Handle to the module that's associated with the broker */
@@ -81,13 +328,119 @@ typedef struct BROKER_MODULEINFO_TAG
     /** Guid sent to module worker thread to close task */
     STRING_HANDLE   quit_message_guid;
 
+    /** Flow control: publishers blocked on a full link to this module wait
+     *  on fc_condition under fc_lock
+     */
     LOCK_HANDLE     fc_lock;
+    COND_HANDLE     fc_condition;
 
     THREAD_MESSAGE_HANDLING_SENDER*   senderThMsg;
     THREAD_MESSAGE_HANDLING_RECEIVER* receiverThMsg;
 
+    /** BROKER_SCHEDULER_POOL only, replaces thread and the receiver thread */
+    BROKER_ACTOR*   actor;
+
+    /** Broker the module is attached to, read by the delivery path to find
+     *  the routing snapshot
+     */
+    struct BROKER_HANDLE_DATA_TAG* broker_data;
+    /** Default links to this module, changed under modules_lock. The sink
+     *  filters what its socket receives because nanomsg sends a frame to
+     *  every subscriber of the source.
+     */
+    struct BROKER_LINK_FILTER_TAG* default_links;
+    /** Default links with a predicate, sampling or ttl; frames are only checked when non zero */
+    volatile size_t default_filter_count;
+    /** Default links from this module. A source that also has thread-message
+     *  links only serializes its messages when this is non zero.
+     */
+    size_t          default_sink_count;
+
+    /** Direct links from this module, changed under modules_lock */
+    struct BROKER_DIRECT_LINK_TAG* direct_links;
+    /** Direct links to this module: publishers call Receive one at a time
+     *  under direct_lock. direct_calls counts the publishers that picked the
+     *  module from the routing and have not returned from Receive yet.
+     */
+    LOCK_HANDLE     direct_lock;
+    volatile size_t direct_calls;
+
+    /** Statistics: messages published by the module, and what its default,
+     *  thread-message and direct links delivered to it
+     */
+    volatile size_t published;
+    BROKER_RECEIVE_STATISTICS default_receive;
+    BROKER_RECEIVE_STATISTICS thread_receive;
+    BROKER_RECEIVE_STATISTICS direct_receive;
+
+    /** Watchdog only, under modules_lock: the Receive durations seen at its
+     *  last check, and whether the module is flagged as slow
+     */
+    BROKER_LATENCY_HISTOGRAM watchdog_seen;
+    bool            slow;
+
 }BROKER_MODULEINFO;
 
+/* BROKER_SCHEDULER_POOL: one thread polls every module socket and hands the
+ * frames to the actors. The module set is changed under lock; generation is
+ * bumped on each change and copied to seen once the thread polls the new set,
+ * so a removed module's socket can be closed safely. */
+typedef struct BROKER_DISPATCHER_TAG
+{
+    LOCK_HANDLE lock;
+    COND_HANDLE condition;
+    THREAD_HANDLE thread;
+    bool stop;
+    BROKER_MODULEINFO** modules;
+    size_t count;
+    size_t capacity;
+    size_t generation;
+    size_t seen;
+#ifdef BROKER_DISPATCHER_EPOLL
+    /* the modules' NN_RCVFD and event_fd, which interrupts epoll_wait */
+    int epoll_fd;
+    int event_fd;
+#else
+    /* the dispatcher also listens to this guid so that changes interrupt nn_poll */
+    int publish_socket;
+    int wake_socket;
+    STRING_HANDLE wake_guid;
+#endif
+} BROKER_DISPATCHER;
+
+/* A default link to a module: the source it subscribes to and the predicate
+ * the frames from that source must match. */
+typedef struct BROKER_LINK_FILTER_TAG
+{
+    MODULE_HANDLE source;
+    BROKER_PREDICATE_HANDLE predicate;
+    BROKER_LINK_SAMPLER sampler;
+    /* microseconds a frame may take from publish to the sink, 0 for no limit */
+    uint64_t ttl_us;
+    struct BROKER_LINK_FILTER_TAG* next;
+} BROKER_LINK_FILTER;
+
+/* A direct link from a module: its publisher calls Receive of sink itself. */
+typedef struct BROKER_DIRECT_LINK_TAG
+{
+    BROKER_MODULEINFO* sink;
+    BROKER_PREDICATE_HANDLE predicate;
+    BROKER_LINK_SAMPLER sampler;
+    struct BROKER_DIRECT_LINK_TAG* next;
+} BROKER_DIRECT_LINK;
+
+static int broker_scheduler_start(BROKER_HANDLE_DATA* broker_data, size_t worker_count);
+static void broker_scheduler_stop(BROKER_HANDLE_DATA* broker_data);
+static int broker_watchdog_start(BROKER_HANDLE_DATA* broker_data, const BROKER_CONFIG* config);
+static void broker_watchdog_stop(BROKER_HANDLE_DATA* broker_data);
+static BROKER_RESULT broker_actor_start(BROKER_HANDLE_DATA* broker_data, BROKER_MODULEINFO* module_info);
+static int broker_actor_stop(BROKER_HANDLE_DATA* broker_data, BROKER_MODULEINFO* module_info);
+static void broker_actor_schedule(BROKER_ACTOR* actor);
+static bool module_default_link_admits(BROKER_MODULEINFO* module_info, MODULE_HANDLE source, const unsigned char* bytes, size_t size, uint64_t published_us);
+static void thread_message_receiver_wakeup(THREAD_MESSAGE_HANDLING_RECEIVER* receiver);
+static int thread_message_link_spill(THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link, THREAD_MESSAGE_CTRL* msgCtrl);
+static THREAD_MESSAGE_CTRL* thread_message_link_unspill(THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link);
+
 static int nn_really_close(int s)
 {
     int result;
@@ -110,9 +463,44 @@ static int nn_really_send(int s, const void* buf, size_t len, int flags)
 
 typedef struct THREAD_MESSASGE_HANDLING_SENDER_FOR_RECEIVER_TAG {
     BROKER_MODULEINFO* sender_module_info;
+    THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link;
     void* next;
 } THREAD_MESSAGE_HANDLING_SENDER_FOR_RECEIVER;
 
+/* Immutable snapshot of who publishes to whom. Writers rebuild it under
+ * modules_lock whenever a module or a thread-message link changes, swap the
+ * pointer, then wait until no publisher can still be reading the previous
+ * snapshot before freeing it or anything only it refers to. */
+typedef struct BROKER_ROUTE_TAG
+{
+    MODULE_HANDLE source;
+    BROKER_MODULEINFO* module_info;
+    /* the source has thread-message links */
+    bool thread_messaging;
+    /* the source has default links, served alongside the thread-message ones */
+    bool default_linked;
+    /* one of the links has a predicate or samples */
+    bool filtered;
+    /* some links form groups; groups[i] is the index of the first link of the group of link i, or i */
+    bool grouped;
+    size_t link_count;
+    THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER** links;
+    size_t* groups;
+    /* default links into the module, only when one of them has a predicate */
+    size_t filter_count;
+    const BROKER_LINK_FILTER** filters;
+    /* direct links from the module */
+    size_t direct_count;
+    const BROKER_DIRECT_LINK** direct_links;
+} BROKER_ROUTE;
+
+typedef struct BROKER_ROUTING_TABLE_TAG
+{
+    /* open addressing on the source handle, a NULL source marks a free slot */
+    size_t mask;
+    BROKER_ROUTE* routes;
+} BROKER_ROUTING_TABLE;
+
 
 static STRING_HANDLE construct_url()
 {
@@ -149,12 +537,27 @@ static STRING_HANDLE construct_url()
 }
 
 BROKER_HANDLE Broker_Create(void)
+{
+    return Broker_CreateWithConfig(NULL);
+}
+
+BROKER_HANDLE Broker_CreateWithConfig(const BROKER_CONFIG* config)
 {
     BROKER_HANDLE_DATA* result;
 
+    if (config != NULL && config->scheduler != BROKER_SCHEDULER_THREAD_PER_MODULE && config->scheduler != BROKER_SCHEDULER_POOL)
+    {
+        LogError("invalid scheduler %d", (int)config->scheduler);
+        result = NULL;
+    }
+    else if (config != NULL && config->memory_policy != BROKER_MEMORY_POLICY_DROP_NEWEST &&
+        config->memory_policy != BROKER_MEMORY_POLICY_SHED_LARGEST && config->memory_policy != BROKER_MEMORY_POLICY_FAIL)
+    {
+        LogError("invalid memory policy %d", (int)config->memory_policy);
+        result = NULL;
+    }
     /*Codes_SRS_BROKER_13_067: [Broker_Create shall malloc a new instance of BROKER_HANDLE_DATA and return NULL if it fails.]*/
-    result = REFCOUNT_TYPE_CREATE(BROKER_HANDLE_DATA);
-    if (result == NULL)
+    else if ((result = REFCOUNT_TYPE_CREATE(BROKER_HANDLE_DATA)) == NULL)
     {
         LogError("malloc returned NULL");
         /*return as is*/
@@ -222,6 +625,33 @@ BROKER_HANDLE Broker_Create(void)
                             free(result);
                             result = NULL;
                         }
+                        else
+                        {
+                            result->routing = NULL;
+                            result->routing_epoch = 0;
+                            result->routing_readers[0] = 0;
+                            result->routing_readers[1] = 0;
+                            result->scheduler = (config != NULL) ? config->scheduler : BROKER_SCHEDULER_THREAD_PER_MODULE;
+                            result->pool = NULL;
+                            result->dispatcher = NULL;
+                            result->held_bytes = 0;
+                            result->memory_budget = (config != NULL) ? config->memory_budget : 0;
+                            result->memory_policy = (config != NULL) ? config->memory_policy : BROKER_MEMORY_POLICY_DROP_NEWEST;
+                            result->memory_shed = 0;
+                            result->watchdog = NULL;
+                            if ((result->scheduler == BROKER_SCHEDULER_POOL && broker_scheduler_start(result, config->worker_count) != 0) ||
+                                (config != NULL && config->slow_receive_us != 0 && broker_watchdog_start(result, config) != 0))
+                            {
+                                LogError("unable to start the broker worker pool or watchdog");
+                                broker_scheduler_stop(result);
+                                singlylinkedlist_destroy(result->modules);
+                                Lock_Deinit(result->modules_lock);
+                                nn_really_close(result->publish_socket);
+                                STRING_delete(result->url);
+                                free(result);
+                                result = NULL;
+                            }
+                        }
                     }
                 }
             }
@@ -246,6 +676,428 @@ void Broker_IncRef(BROKER_HANDLE broker)
     }
 }
 
+static int32_t read_int32_be(const unsigned char* src)
+{
+    return (int32_t)(((uint32_t)src[0] << 24) | ((uint32_t)src[1] << 16) | ((uint32_t)src[2] << 8) | (uint32_t)src[3]);
+}
+
+/* monotonic clock in microseconds, used for the latency statistics */
+static uint64_t broker_clock_us(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER now;
+    if (frequency.QuadPart == 0)
+    {
+        (void)QueryPerformanceFrequency(&frequency);
+    }
+    (void)QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / frequency.QuadPart) * 1000000 + (uint64_t)(now.QuadPart % frequency.QuadPart) * 1000000 / (uint64_t)frequency.QuadPart;
+#else
+    struct timespec now;
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+#endif
+}
+
+static void broker_link_sampler_init(BROKER_LINK_SAMPLER* sampler, size_t every, double max_rate_hz)
+{
+    sampler->every = (every > 1) ? every : 0;
+    // above 1 MHz the interval rounds to 0, which is no limit
+    sampler->interval_us = (max_rate_hz > 0) ? (size_t)(1000000.0 / max_rate_hz) : 0;
+    sampler->seen = 0;
+    sampler->next_us = (size_t)broker_clock_us();
+    sampler->skipped = 0;
+}
+
+static bool broker_link_sampler_active(const BROKER_LINK_SAMPLER* sampler)
+{
+    return sampler->every != 0 || sampler->interval_us != 0;
+}
+
+/* True when the link takes this message, always for a link that does not
+ * sample. Concurrent publishers each count once, and only one of them wins a
+ * rate interval. */
+static bool broker_link_sampler_take(BROKER_LINK_SAMPLER* sampler)
+{
+    bool result = true;
+    if (sampler->every != 0) {
+        result = ((BROKER_ATOMIC_ADD(&sampler->seen, 1) - 1) % sampler->every == 0);
+    }
+    if (result && sampler->interval_us != 0) {
+        size_t now = (size_t)broker_clock_us();
+        size_t next = BROKER_ATOMIC_LOAD(&sampler->next_us);
+        result = ((ptrdiff_t)(now - next) >= 0) && BROKER_ATOMIC_CAS(&sampler->next_us, next, now + sampler->interval_us);
+    }
+    if (!result) {
+        (void)BROKER_ATOMIC_ADD(&sampler->skipped, 1);
+    }
+    return result;
+}
+
+static size_t broker_histogram_bucket(uint64_t value)
+{
+    size_t result;
+    if (value < 4)
+    {
+        result = (size_t)value;
+    }
+    else
+    {
+        size_t msb = 0;
+        uint64_t v = value;
+        while (v >>= 1)
+        {
+            msb++;
+        }
+        /* 4 buckets per power of two, picked by the two bits below the top one */
+        result = (msb - 1) * 4 + (size_t)((value >> (msb - 2)) & 3);
+        if (result >= BROKER_LATENCY_HISTOGRAM_BUCKETS)
+        {
+            result = BROKER_LATENCY_HISTOGRAM_BUCKETS - 1;
+        }
+    }
+    return result;
+}
+
+/* Single writer only. */
+static void broker_histogram_record(BROKER_LATENCY_HISTOGRAM* histogram, uint64_t value)
+{
+    histogram->counts[broker_histogram_bucket(value)]++;
+    histogram->count++;
+    histogram->total_us += value;
+    if (value > histogram->max_us)
+    {
+        histogram->max_us = value;
+    }
+}
+
+static void broker_histogram_add(BROKER_LATENCY_HISTOGRAM* destination, const BROKER_LATENCY_HISTOGRAM* source)
+{
+    size_t i;
+    for (i = 0; i < BROKER_LATENCY_HISTOGRAM_BUCKETS; i++)
+    {
+        destination->counts[i] += source->counts[i];
+    }
+    destination->count += source->count;
+    destination->total_us += source->total_us;
+    if (source->max_us > destination->max_us)
+    {
+        destination->max_us = source->max_us;
+    }
+}
+
+uint64_t Broker_LatencyHistogramBucketLimit(size_t bucket)
+{
+    uint64_t result;
+    if (bucket < 4)
+    {
+        result = bucket;
+    }
+    else if (bucket >= BROKER_LATENCY_HISTOGRAM_BUCKETS - 1)
+    {
+        result = UINT64_MAX;
+    }
+    else
+    {
+        size_t shift = bucket / 4 - 1;
+        result = ((uint64_t)(4 + bucket % 4) << shift) + ((uint64_t)1 << shift) - 1;
+    }
+    return result;
+}
+
+uint64_t Broker_LatencyHistogramPercentile(const BROKER_LATENCY_HISTOGRAM* histogram, double percentile)
+{
+    uint64_t result = 0;
+    if (histogram == NULL)
+    {
+        LogError("histogram is NULL");
+    }
+    else if (histogram->count > 0)
+    {
+        size_t target = (size_t)(histogram->count * (percentile < 0 ? 0 : percentile > 100 ? 100 : percentile) / 100.0);
+        size_t seen = 0;
+        size_t i;
+        for (i = 0; i < BROKER_LATENCY_HISTOGRAM_BUCKETS; i++)
+        {
+            seen += histogram->counts[i];
+            if (seen > target || seen == histogram->count)
+            {
+                break;
+            }
+        }
+        result = Broker_LatencyHistogramBucketLimit(i);
+        if (result > histogram->max_us)
+        {
+            result = histogram->max_us;
+        }
+    }
+    return result;
+}
+
+/* Calls the module's Receive and records its latency and duration. */
+static void module_receive_measured(BROKER_MODULEINFO* module_info, BROKER_RECEIVE_STATISTICS* statistics, MESSAGE_HANDLE msg, uint64_t published_us)
+{
+    uint64_t start = broker_clock_us();
+    // 0 means idle to the watchdog
+    BROKER_ATOMIC_STORE(&statistics->started_us, ((size_t)start == 0) ? 1 : (size_t)start);
+    MODULE_RECEIVE(module_info->module->module_apis)(module_info->module->module_handle, msg);
+    BROKER_ATOMIC_STORE(&statistics->started_us, 0);
+    broker_histogram_record(&statistics->duration, broker_clock_us() - start);
+    broker_histogram_record(&statistics->latency, start > published_us ? start - published_us : 0);
+    statistics->delivered++;
+}
+
+/* BROKER_PREDICATE_LOOKUP over the properties of a message, context is the
+ * CONSTMAP_HANDLE returned by Message_GetProperties. */
+static const char* message_properties_lookup(void* context, const char* name)
+{
+    return (context == NULL) ? NULL : ConstMap_GetValue((CONSTMAP_HANDLE)context, name);
+}
+
+typedef struct SERIALIZED_PROPERTIES_TAG
+{
+    const unsigned char* bytes;
+    size_t size;
+} SERIALIZED_PROPERTIES;
+
+/* BROKER_PREDICATE_LOOKUP over a serialized message, context is a
+ * SERIALIZED_PROPERTIES. Walks the name\0value\0 pairs in place so that a
+ * frame can be filtered without deserializing it. */
+static const char* serialized_properties_lookup(void* context, const char* name)
+{
+    const char* result = NULL;
+    const SERIALIZED_PROPERTIES* properties = (const SERIALIZED_PROPERTIES*)context;
+    const unsigned char* bytes = properties->bytes;
+    size_t size = properties->size;
+
+    if (size >= 10)
+    {
+        int32_t count = read_int32_be(bytes + 6);
+        size_t offset = 10;
+        int32_t i;
+        for (i = 0; i < count && offset < size; i++)
+        {
+            const unsigned char* key_end = (const unsigned char*)memchr(bytes + offset, '\0', size - offset);
+            const unsigned char* value_end = (key_end == NULL || key_end + 1 >= bytes + size) ? NULL : (const unsigned char*)memchr(key_end + 1, '\0', size - (key_end + 1 - bytes));
+            if (value_end == NULL)
+            {
+                break;
+            }
+            else if (strcmp((const char*)(bytes + offset), name) == 0)
+            {
+                result = (const char*)(key_end + 1);
+                break;
+            }
+            offset = (size_t)(value_end + 1 - bytes);
+        }
+    }
+    return result;
+}
+
+/* Microseconds given by a BROKER_TTL_PROPERTY value, 0 when it is missing or
+ * not a decimal number. */
+static uint64_t broker_ttl_us(const char* value)
+{
+    uint64_t result = 0;
+    if (value != NULL && value[0] >= '0' && value[0] <= '9')
+    {
+        char* end;
+        unsigned long long ttl_ms = strtoull(value, &end, 10);
+        if (*end == '\0')
+        {
+            result = (uint64_t)ttl_ms * 1000;
+        }
+    }
+    return result;
+}
+
+/* True when a message published at published_us is at least ttl_us old at now. */
+static bool broker_ttl_expired(uint64_t ttl_us, uint64_t published_us, uint64_t now)
+{
+    return ttl_us != 0 && now > published_us && now - published_us >= ttl_us;
+}
+
+#ifdef BROKER_ZERO_COPY_RECEIVE
+static void free_nn_buffer(void* context)
+{
+    (void)nn_freemsg(context);
+}
+
+/* Deserializes a message received on a module socket without copying its
+ * content: the content buffer points into buf and buf is released with
+ * nn_freemsg once the last reference to the content is gone. Takes ownership
+ * of buf in every case. */
+static MESSAGE_HANDLE message_create_from_nn_buffer(unsigned char* buf, int nbytes)
+{
+    MESSAGE_HANDLE result = NULL;
+    /*Codes_SRS_BROKER_17_024: [ The function shall strip off the topic from the message. ]*/
+    const unsigned char* bytes = buf + BROKER_FRAME_HEADER_SIZE;
+    size_t size = (size_t)nbytes - BROKER_FRAME_HEADER_SIZE;
+    MAP_HANDLE properties = NULL;
+    const unsigned char* content = NULL;
+    int32_t content_size = 0;
+
+    /* header, total size, property count and content size */
+    if (nbytes < (int)BROKER_FRAME_HEADER_SIZE + 14 || bytes[0] != SERIALIZED_MESSAGE_HEADER_0 || bytes[1] != SERIALIZED_MESSAGE_HEADER_1 || (size_t)read_int32_be(bytes + 2) != size)
+    {
+        LogError("received message is malformed");
+    }
+    else if ((properties = Map_Create(NULL)) == NULL)
+    {
+        LogError("Map_Create failed");
+    }
+    else
+    {
+        int32_t count = read_int32_be(bytes + 6);
+        size_t offset = 10;
+        int32_t i;
+        for (i = 0; i < count; i++)
+        {
+            const unsigned char* key_end = (const unsigned char*)memchr(bytes + offset, '\0', size - offset);
+            const unsigned char* value_end = (key_end == NULL) ? NULL : (const unsigned char*)memchr(key_end + 1, '\0', size - (key_end + 1 - bytes));
+            if (value_end == NULL || Map_Add(properties, (const char*)(bytes + offset), (const char*)(key_end + 1)) != MAP_OK)
+            {
+                LogError("received message has malformed properties");
+                break;
+            }
+            offset = (size_t)(value_end + 1 - bytes);
+        }
+
+        if (i == count && count >= 0 && size - offset >= 4)
+        {
+            content_size = read_int32_be(bytes + offset);
+            if (content_size >= 0 && (size_t)content_size == size - offset - 4)
+            {
+                content = bytes + offset + 4;
+            }
+            else
+            {
+                LogError("received message has a malformed content size");
+            }
+        }
+    }
+
+    if (content == NULL)
+    {
+        nn_freemsg(buf);
+    }
+    else
+    {
+        CONSTBUFFER_HANDLE content_handle = CONSTBUFFER_CreateWithCustomFree(content, (size_t)content_size, free_nn_buffer, buf);
+        if (content_handle == NULL)
+        {
+            LogError("CONSTBUFFER_CreateWithCustomFree failed");
+            nn_freemsg(buf);
+        }
+        else
+        {
+            MESSAGE_BUFFER_CONFIG config;
+            config.sourceContent = content_handle;
+            config.sourceProperties = properties;
+            /*Codes_SRS_BROKER_17_017: [ The function shall deserialize the message received. ]*/
+            result = Message_CreateFromBuffer(&config);
+            if (result == NULL)
+            {
+                LogError("Message_CreateFromBuffer failed");
+            }
+            /* the message holds its own reference to the content; dropping ours frees buf if it failed */
+            CONSTBUFFER_Destroy(content_handle);
+        }
+    }
+
+    if (properties != NULL)
+    {
+        Map_Destroy(properties);
+    }
+    return result;
+}
+#endif
+
+/* Delivers, in order, every message of a frame built by Broker_PublishBatch:
+ * 0xA1 0x61, message count, then the serialized messages back to back. */
+static void module_worker_deliver_batch(BROKER_MODULEINFO* module_info, MODULE_HANDLE source, const unsigned char* bytes, size_t size, uint64_t published_us)
+{
+    int32_t count = (size >= 6) ? read_int32_be(bytes + 2) : 0;
+    size_t offset = 6;
+    int32_t i;
+    for (i = 0; i < count; i++)
+    {
+        int32_t msg_size = (size - offset >= 6) ? read_int32_be(bytes + offset + 2) : 0;
+        if (msg_size <= 0 || (size_t)msg_size > size - offset)
+        {
+            LogError("received batch is malformed, %d of %d messages delivered", i, count);
+            break;
+        }
+        else
+        {
+            if (module_default_link_admits(module_info, source, bytes + offset, (size_t)msg_size, published_us))
+            {
+                /* messages of a batch share one buffer, so they are copied even with BROKER_ZERO_COPY_RECEIVE */
+                MESSAGE_HANDLE msg = Message_CreateFromByteArray(bytes + offset, msg_size);
+                if (msg != NULL)
+                {
+                    module_receive_measured(module_info, &module_info->default_receive, msg, published_us);
+                    Message_Destroy(msg);
+                }
+            }
+            offset += (size_t)msg_size;
+        }
+    }
+}
+
+/* Delivers what the module's socket received, a single message or a batch,
+ * and frees buf. Used by module_worker and by the actor in pool mode. */
+static void module_deliver_received(BROKER_MODULEINFO* module_info, unsigned char* buf, int nbytes)
+{
+    uint64_t published_us = 0;
+    MODULE_HANDLE source;
+    if ((size_t)nbytes < BROKER_FRAME_HEADER_SIZE + 2)
+    {
+        LogError("received frame of %d bytes is too short", nbytes);
+    }
+    else
+    {
+        memcpy(&source, buf, sizeof(MODULE_HANDLE));
+        memcpy(&published_us, buf + sizeof(MODULE_HANDLE), sizeof(uint64_t));
+        if (buf[BROKER_FRAME_HEADER_SIZE] == SERIALIZED_MESSAGE_HEADER_0 && buf[BROKER_FRAME_HEADER_SIZE + 1] == SERIALIZED_BATCH_HEADER_1)
+        {
+            module_worker_deliver_batch(module_info, source, buf + BROKER_FRAME_HEADER_SIZE, nbytes - BROKER_FRAME_HEADER_SIZE, published_us);
+        }
+        else if (!module_default_link_admits(module_info, source, buf + BROKER_FRAME_HEADER_SIZE, nbytes - BROKER_FRAME_HEADER_SIZE, published_us))
+        {
+            /* expired, or filtered out by the link predicates, before deserializing; buf is freed below */
+        }
+        else
+        {
+#ifdef BROKER_ZERO_COPY_RECEIVE
+            /* the message borrows buf and frees it when destroyed */
+            MESSAGE_HANDLE msg = message_create_from_nn_buffer(buf, nbytes);
+            buf = NULL;
+#else
+            /*Codes_SRS_BROKER_17_024: [ The function shall strip off the topic from the message. ]*/
+            const unsigned char*buf_bytes = (const unsigned char*)buf;
+            buf_bytes += BROKER_FRAME_HEADER_SIZE;
+            /*Codes_SRS_BROKER_17_017: [ The function shall deserialize the message received. ]*/
+            MESSAGE_HANDLE msg = Message_CreateFromByteArray(buf_bytes, nbytes - BROKER_FRAME_HEADER_SIZE);
+#endif
+            /*Codes_SRS_BROKER_17_018: [ If the deserialization is not successful, the message loop shall continue. ]*/
+            if (msg != NULL)
+            {
+                /*Codes_SRS_BROKER_13_092: [The function shall deliver the message to the module's callback function via module_info->module_apis. ]*/
+                module_receive_measured(module_info, &module_info->default_receive, msg, published_us);
+                /*Codes_SRS_BROKER_13_093: [ The function shall destroy the message that was dequeued by calling Message_Destroy. ]*/
+                Message_Destroy(msg);
+            }
+        }
+    }
+    /*Codes_SRS_BROKER_17_019: [ The function shall free the buffer received on the receive_socket. ]*/
+    if (buf != NULL)
+    {
+        nn_freemsg(buf);
+    }
+}
+
 /**
 * This function runs for each module. It receives a pointer to a MODULE_INFO
 * object that describes the module. Its job is to call the Receive function on
@@ -309,27 +1161,19 @@ static int module_worker(void * user_data)
                     Unlock(module_info->receiverThMsg->lock);
                 }
             }
-            if(should_continue!=0)
+            if (should_continue != 0)
             {
-                /*Codes_SRS_BROKER_17_024: [ The function shall strip off the topic from the message. ]*/
-                const unsigned char*buf_bytes = (const unsigned char*)buf;
-                buf_bytes += sizeof(MODULE_HANDLE);
-                /*Codes_SRS_BROKER_17_017: [ The function shall deserialize the message received. ]*/
-                MESSAGE_HANDLE msg = Message_CreateFromByteArray(buf_bytes, nbytes - sizeof(MODULE_HANDLE));
-                /*Codes_SRS_BROKER_17_018: [ If the deserialization is not successful, the message loop shall continue. ]*/
-                if (msg != NULL)
-                {
-                    /*Codes_SRS_BROKER_13_092: [The function shall deliver the message to the module's callback function via module_info->module_apis. ]*/
-                    MODULE_RECEIVE(module_info->module->module_apis)(module_info->module->module_handle, msg);
-                    /*Codes_SRS_BROKER_13_093: [ The function shall destroy the message that was dequeued by calling Message_Destroy. ]*/
-                    Message_Destroy(msg);
-                }
+                module_deliver_received(module_info, buf, nbytes);
+            }
+            else
+            {
+                /*Codes_SRS_BROKER_17_019: [ The function shall free the buffer received on the receive_socket. ]*/
+                nn_freemsg(buf);
             }
-            /*Codes_SRS_BROKER_17_019: [ The function shall free the buffer received on the receive_socket. ]*/
-            nn_freemsg(buf);
         }    
     }
 
+    BrokerSlab_ReleaseThreadCaches();
     return 0;
 }
 
@@ -388,16 +1232,39 @@ else
         }
         if (result == BROKER_OK) {
             module_info->fc_lock = Lock_Init();
-        }
-    }
-    return result;
-}
-
-static void deinit_module(BROKER_MODULEINFO* module_info)
-{
-    /*Codes_SRS_BROKER_13_057: [The function shall free all members of the MODULE_INFO object.]*/
+            module_info->fc_condition = Condition_Init();
+            module_info->direct_lock = Lock_Init();
+            if (module_info->fc_lock == NULL || module_info->fc_condition == NULL || module_info->direct_lock == NULL)
+            {
+                LogError("create flow control or direct link lock or condition failed");
+                if (module_info->fc_lock != NULL)
+                {
+                    Lock_Deinit(module_info->fc_lock);
+                }
+                if (module_info->fc_condition != NULL)
+                {
+                    Condition_Deinit(module_info->fc_condition);
+                }
+                if (module_info->direct_lock != NULL)
+                {
+                    Lock_Deinit(module_info->direct_lock);
+                }
+                Lock_Deinit(module_info->socket_lock);
+                STRING_delete(module_info->quit_message_guid);
+                result = BROKER_ERROR;
+            }
+        }
+    }
+    return result;
+}
+
+static void deinit_module(BROKER_MODULEINFO* module_info)
+{
+    /*Codes_SRS_BROKER_13_057: [The function shall free all members of the MODULE_INFO object.]*/
     Lock_Deinit(module_info->socket_lock);
     Lock_Deinit(module_info->fc_lock);
+    Condition_Deinit(module_info->fc_condition);
+    Lock_Deinit(module_info->direct_lock);
 
     STRING_delete(module_info->quit_message_guid);
 
@@ -405,7 +1272,13 @@ static void deinit_module(BROKER_MODULEINFO* module_info)
         // Can I think senderThMsg has no receiver and no sending message?
         free((void*)module_info->senderThMsg);
     }
-    if (module_info->receiverThMsg != NULL) {
+    if (module_info->receiverThMsg != NULL && module_info->actor != NULL) {
+        // BROKER_SCHEDULER_POOL: there is no receiver thread to own the lock and condition
+        Condition_Deinit(module_info->receiverThMsg->condition);
+        Lock_Deinit(module_info->receiverThMsg->lock);
+        free((void*)module_info->receiverThMsg);
+    }
+    else if (module_info->receiverThMsg != NULL) {
         // Can I think receiverThMsg has no sender?
         if (Lock(module_info->receiverThMsg->lock) != LOCK_OK) {
             LogError("lock for receiverThMsg in deinit_module failed!");
@@ -429,10 +1302,24 @@ static void deinit_module(BROKER_MODULEINFO* module_info)
         free((void*)module_info->receiverThMsg);
     }
 
+    while (module_info->default_links != NULL) {
+        BROKER_LINK_FILTER* filter = module_info->default_links;
+        module_info->default_links = filter->next;
+        BrokerPredicate_Destroy(filter->predicate);
+        free(filter);
+    }
+    while (module_info->direct_links != NULL) {
+        BROKER_DIRECT_LINK* direct_link = module_info->direct_links;
+        module_info->direct_links = direct_link->next;
+        BrokerPredicate_Destroy(direct_link->predicate);
+        free(direct_link);
+    }
+
+    free(module_info->actor);
     free(module_info->module);
 }
 
-static BROKER_RESULT start_module(BROKER_MODULEINFO* module_info, STRING_HANDLE url)
+static BROKER_RESULT start_module(BROKER_HANDLE_DATA* broker_data, BROKER_MODULEINFO* module_info)
 {
     BROKER_RESULT result;
 
@@ -448,7 +1335,7 @@ static BROKER_RESULT start_module(BROKER_MODULEINFO* module_info, STRING_HANDLE
     else
     {
         /*Codes_SRS_BROKER_17_014: [ The function shall bind the socket to the the BROKER_HANDLE_DATA::url. ]*/
-        int connect_result = nn_connect(module_info->receive_socket, STRING_c_str(url));
+        int connect_result = nn_connect(module_info->receive_socket, STRING_c_str(broker_data->url));
         if (connect_result < 0)
         {
             /*Codes_SRS_BROKER_13_047: [ This function shall return BROKER_ERROR if an underlying API call to the platform causes an error or BROKER_OK otherwise. ]*/
@@ -469,6 +1356,15 @@ static BROKER_RESULT start_module(BROKER_MODULEINFO* module_info, STRING_HANDLE
                 module_info->receive_socket = -1;
                 result = BROKER_ERROR;
             }
+            else if (broker_data->scheduler == BROKER_SCHEDULER_POOL)
+            {
+                /* the dispatcher reads the socket and the pool runs Module_Receive */
+                result = broker_actor_start(broker_data, module_info);
+                if (result != BROKER_OK)
+                {
+                    nn_really_close(module_info->receive_socket);
+                }
+            }
             else
             {
                 /*Codes_SRS_BROKER_13_102: [The function shall create a new thread for the module by calling ThreadAPI_Create using module_worker as the thread callback and using the newly allocated BROKER_MODULEINFO object as the thread context.*/
@@ -496,7 +1392,7 @@ static BROKER_RESULT start_module(BROKER_MODULEINFO* module_info, STRING_HANDLE
 
 /*stop module means: stop the thread that feeds messages to Module_Receive function + deletion of all queued messages */
 /*returns 0 if success, otherwise __LINE__*/
-static int stop_module(int publish_socket, BROKER_MODULEINFO* module_info)
+static int stop_module_worker(int publish_socket, BROKER_MODULEINFO* module_info)
 {
     int  quit_result, close_result, thread_result, result;
 
@@ -551,12 +1447,374 @@ static int stop_module(int publish_socket, BROKER_MODULEINFO* module_info)
     return result;
 }
 
+static int stop_module(BROKER_HANDLE_DATA* broker_data, BROKER_MODULEINFO* module_info)
+{
+    int result;
+    if (module_info->actor != NULL)
+    {
+        /* BROKER_SCHEDULER_POOL: there is no thread to signal, the actor only has to go idle */
+        result = broker_actor_stop(broker_data, module_info);
+    }
+    else
+    {
+        result = stop_module_worker(broker_data->publish_socket, module_info);
+    }
+    return result;
+}
+
 static bool find_module_predicate(LIST_ITEM_HANDLE list_item, const void* value)
 {
     BROKER_MODULEINFO* element = (BROKER_MODULEINFO*)singlylinkedlist_item_get_value(list_item);
     return element->module->module_handle == ((MODULE*)value)->module_handle;
 }
 
+static size_t broker_route_hash(MODULE_HANDLE handle)
+{
+    size_t value = ((size_t)handle >> 3) * (size_t)2654435761u;
+    return value ^ (value >> 15);
+}
+
+/* Called with modules_lock held. */
+static BROKER_ROUTING_TABLE* broker_routing_build(BROKER_HANDLE_DATA* broker_data)
+{
+    BROKER_ROUTING_TABLE* result;
+    LIST_ITEM_HANDLE item;
+    size_t module_count = 0;
+    size_t link_count = 0;
+    size_t filter_count = 0;
+    size_t direct_count = 0;
+    size_t capacity = 2;
+
+    for (item = singlylinkedlist_get_head_item(broker_data->modules); item != NULL; item = singlylinkedlist_get_next_item(item))
+    {
+        BROKER_MODULEINFO* module_info = (BROKER_MODULEINFO*)singlylinkedlist_item_get_value(item);
+        module_count++;
+        if (module_info->senderThMsg != NULL)
+        {
+            link_count += module_info->senderThMsg->receiver_count;
+        }
+        if (module_info->default_filter_count != 0)
+        {
+            const BROKER_LINK_FILTER* filter;
+            for (filter = module_info->default_links; filter != NULL; filter = filter->next)
+            {
+                filter_count++;
+            }
+        }
+        {
+            const BROKER_DIRECT_LINK* direct_link;
+            for (direct_link = module_info->direct_links; direct_link != NULL; direct_link = direct_link->next)
+            {
+                direct_count++;
+            }
+        }
+    }
+    /* load factor of at most one half keeps probe sequences short */
+    while (capacity < module_count * 2)
+    {
+        capacity <<= 1;
+    }
+
+    /* routes and link arrays share one allocation so a snapshot is freed with a single free */
+    result = (BROKER_ROUTING_TABLE*)malloc(sizeof(BROKER_ROUTING_TABLE) + capacity * sizeof(BROKER_ROUTE) + link_count * sizeof(THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER*) + filter_count * sizeof(BROKER_LINK_FILTER*) + direct_count * sizeof(BROKER_DIRECT_LINK*) + link_count * sizeof(size_t));
+    if (result == NULL)
+    {
+        LogError("malloc of routing table failed");
+    }
+    else
+    {
+        THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER** links;
+        const BROKER_LINK_FILTER** filters;
+        const BROKER_DIRECT_LINK** direct_links;
+        size_t* groups;
+        size_t i;
+
+        result->mask = capacity - 1;
+        result->routes = (BROKER_ROUTE*)(result + 1);
+        links = (THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER**)(result->routes + capacity);
+        filters = (const BROKER_LINK_FILTER**)(links + link_count);
+        direct_links = (const BROKER_DIRECT_LINK**)(filters + filter_count);
+        groups = (size_t*)(direct_links + direct_count);
+        for (i = 0; i < capacity; i++)
+        {
+            result->routes[i].source = NULL;
+        }
+
+        for (item = singlylinkedlist_get_head_item(broker_data->modules); item != NULL; item = singlylinkedlist_get_next_item(item))
+        {
+            BROKER_MODULEINFO* module_info = (BROKER_MODULEINFO*)singlylinkedlist_item_get_value(item);
+            size_t index = broker_route_hash(module_info->module->module_handle) & result->mask;
+            BROKER_ROUTE* route;
+
+            while (result->routes[index].source != NULL)
+            {
+                index = (index + 1) & result->mask;
+            }
+            route = &result->routes[index];
+            route->source = module_info->module->module_handle;
+            route->module_info = module_info;
+            route->thread_messaging = (module_info->senderThMsg != NULL);
+            route->default_linked = (module_info->default_sink_count != 0);
+            route->filtered = false;
+            route->grouped = false;
+            route->links = links;
+            route->groups = groups;
+            route->link_count = 0;
+            if (module_info->senderThMsg != NULL)
+            {
+                THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link = module_info->senderThMsg->receivers;
+                while (link != NULL)
+                {
+                    size_t first = route->link_count;
+                    if (link->group != NULL)
+                    {
+                        first = 0;
+                        while (first < route->link_count && (route->links[first]->group == NULL || strcmp(route->links[first]->group, link->group) != 0))
+                        {
+                            first++;
+                        }
+                        route->grouped = route->grouped || (first < route->link_count);
+                    }
+                    route->filtered = route->filtered || (link->predicate != NULL) || broker_link_sampler_active(&link->sampler);
+                    route->groups[route->link_count] = first;
+                    route->links[route->link_count++] = link;
+                    link = link->next;
+                }
+            }
+            links += route->link_count;
+            groups += route->link_count;
+
+            route->filters = filters;
+            route->filter_count = 0;
+            if (module_info->default_filter_count != 0)
+            {
+                const BROKER_LINK_FILTER* filter;
+                for (filter = module_info->default_links; filter != NULL; filter = filter->next)
+                {
+                    route->filters[route->filter_count++] = filter;
+                }
+            }
+            filters += route->filter_count;
+
+            route->direct_links = direct_links;
+            route->direct_count = 0;
+            {
+                const BROKER_DIRECT_LINK* direct_link;
+                for (direct_link = module_info->direct_links; direct_link != NULL; direct_link = direct_link->next)
+                {
+                    route->direct_links[route->direct_count++] = direct_link;
+                }
+            }
+            direct_links += route->direct_count;
+        }
+    }
+    return result;
+}
+
+static const BROKER_ROUTE* broker_routing_find(const BROKER_ROUTING_TABLE* table, MODULE_HANDLE source)
+{
+    const BROKER_ROUTE* result = NULL;
+    if (table != NULL)
+    {
+        size_t index = broker_route_hash(source) & table->mask;
+        while (table->routes[index].source != NULL)
+        {
+            if (table->routes[index].source == source)
+            {
+                result = &table->routes[index];
+                break;
+            }
+            index = (index + 1) & table->mask;
+        }
+    }
+    return result;
+}
+
+/* Registers a publisher with the current epoch. The epoch is re-read after
+ * registering so that a writer that has already moved on never misses us. */
+static size_t broker_routing_read_begin(BROKER_HANDLE_DATA* broker_data)
+{
+    size_t epoch;
+    while (true)
+    {
+        epoch = BROKER_ATOMIC_LOAD(&broker_data->routing_epoch);
+        (void)BROKER_ATOMIC_ADD(&broker_data->routing_readers[epoch & 1], 1);
+        BROKER_ATOMIC_FENCE();
+        if (BROKER_ATOMIC_LOAD(&broker_data->routing_epoch) == epoch)
+        {
+            break;
+        }
+        (void)BROKER_ATOMIC_SUB(&broker_data->routing_readers[epoch & 1], 1);
+    }
+    return epoch;
+}
+
+static void broker_routing_read_end(BROKER_HANDLE_DATA* broker_data, size_t epoch)
+{
+    (void)BROKER_ATOMIC_SUB(&broker_data->routing_readers[epoch & 1], 1);
+}
+
+/* True when the module takes the serialized message in bytes from source: it
+ * has not outlived its BROKER_TTL_PROPERTY, and when the default links filter,
+ * one of them takes it within its ttl. The predicates are read from the
+ * routing snapshot, which is left before the module's Receive is called. */
+static bool module_default_link_admits(BROKER_MODULEINFO* module_info, MODULE_HANDLE source, const unsigned char* bytes, size_t size, uint64_t published_us)
+{
+    bool result = true;
+    bool expired = false;
+    uint64_t now = broker_clock_us();
+    SERIALIZED_PROPERTIES properties;
+
+    properties.bytes = bytes;
+    properties.size = size;
+    if (broker_ttl_expired(broker_ttl_us(serialized_properties_lookup(&properties, BROKER_TTL_PROPERTY)), published_us, now))
+    {
+        result = false;
+        expired = true;
+    }
+    else if (BROKER_ATOMIC_LOAD(&module_info->default_filter_count) != 0)
+    {
+        size_t epoch = broker_routing_read_begin(module_info->broker_data);
+        const BROKER_ROUTE* route = broker_routing_find((const BROKER_ROUTING_TABLE*)BROKER_ATOMIC_LOAD_PTR(&module_info->broker_data->routing), module_info->module->module_handle);
+        size_t i;
+        if (route != NULL)
+        {
+            for (i = 0; i < route->filter_count; i++)
+            {
+                if (route->filters[i]->source == source)
+                {
+                    const BROKER_LINK_FILTER* filter = route->filters[i];
+                    /* the links are alternatives, one match is enough; an expired frame takes no sample */
+                    result = BrokerPredicate_Evaluate(filter->predicate, serialized_properties_lookup, &properties);
+                    if (result && broker_ttl_expired(filter->ttl_us, published_us, now))
+                    {
+                        result = false;
+                        expired = true;
+                    }
+                    else if (result)
+                    {
+                        result = broker_link_sampler_take((BROKER_LINK_SAMPLER*)&filter->sampler);
+                    }
+                    if (result)
+                    {
+                        break;
+                    }
+                }
+            }
+        }
+        broker_routing_read_end(module_info->broker_data, epoch);
+    }
+    if (!result && expired)
+    {
+        module_info->default_receive.expired++;
+    }
+    return result;
+}
+
+/* Swaps in a snapshot of the current modules and links and returns once no
+ * publisher can still see the previous one. Called with modules_lock held.
+ * If the new snapshot cannot be built the routing is emptied so that nothing
+ * removed by the caller stays reachable, and __LINE__ is returned. */
+static int broker_routing_update(BROKER_HANDLE_DATA* broker_data)
+{
+    int result;
+    BROKER_ROUTING_TABLE* old_table = broker_data->routing;
+    BROKER_ROUTING_TABLE* new_table = broker_routing_build(broker_data);
+    size_t epoch;
+
+    if (new_table == NULL)
+    {
+        LogError("unable to rebuild the routing table, publishing is suspended until the next change");
+        result = __LINE__;
+    }
+    else
+    {
+        result = 0;
+    }
+
+    BROKER_ATOMIC_STORE_PTR(&broker_data->routing, new_table);
+    epoch = BROKER_ATOMIC_LOAD(&broker_data->routing_epoch);
+    (void)BROKER_ATOMIC_ADD(&broker_data->routing_epoch, 1);
+    /* publishers registered with the old epoch may hold old_table; new ones see new_table */
+    while (BROKER_ATOMIC_LOAD(&broker_data->routing_readers[epoch & 1]) != 0)
+    {
+        ThreadAPI_Sleep(0);
+    }
+    free(old_table);
+
+    return result;
+}
+
+/* True when the default link has to look at frames: it has a predicate,
+ * sampling or ttl. Such links are counted in default_filter_count. */
+static bool broker_link_filter_checks(const BROKER_LINK_FILTER* filter)
+{
+    return filter->predicate != NULL || broker_link_sampler_active(&filter->sampler) || filter->ttl_us != 0;
+}
+
+/* Unlinks filter, a default link from source_module to module_info, and
+ * frees it once no sink can still see it in the routing snapshot. A source
+ * left without default sinks stops serializing its messages. Called with
+ * modules_lock held. */
+static void broker_link_filter_remove(BROKER_HANDLE_DATA* broker_data, BROKER_MODULEINFO* source_module, BROKER_MODULEINFO* module_info, BROKER_LINK_FILTER* filter)
+{
+    BROKER_LINK_FILTER** previous = &module_info->default_links;
+    /* the snapshot only holds the filters of a sink with a non zero count */
+    bool routed = (module_info->default_filter_count != 0);
+    while (*previous != filter)
+    {
+        previous = &(*previous)->next;
+    }
+    *previous = filter->next;
+    if (broker_link_filter_checks(filter))
+    {
+        (void)BROKER_ATOMIC_SUB(&module_info->default_filter_count, 1);
+    }
+    source_module->default_sink_count--;
+    if (routed || source_module->default_sink_count == 0)
+    {
+        (void)broker_routing_update(broker_data);
+    }
+    BrokerPredicate_Destroy(filter->predicate);
+    free(filter);
+}
+
+/* Removes a default link from source_module_info to module_info and
+ * unsubscribes the sink's socket from the source. Called with modules_lock
+ * held. */
+static BROKER_RESULT broker_remove_default_link(BROKER_HANDLE_DATA* broker_data, BROKER_MODULEINFO* source_module_info, BROKER_MODULEINFO* module_info)
+{
+    BROKER_RESULT result;
+    MODULE_HANDLE source = source_module_info->module->module_handle;
+    BROKER_LINK_FILTER* filter = module_info->default_links;
+    while (filter != NULL && filter->source != source)
+    {
+        filter = filter->next;
+    }
+    if (filter == NULL)
+    {
+        LogError("no link from [%p] to [%p]", source, module_info->module->module_handle);
+        result = BROKER_REMOVE_LINK_ERROR;
+    }
+    else
+    {
+        broker_link_filter_remove(broker_data, source_module_info, module_info, filter);
+        /*Codes_SRS_BROKER_17_038: [ Broker_RemoveLink shall unsubscribe module_info->receive_socket from the link->module_source_handle module handle. ]*/
+        /* nanomsg counts the subscriptions to a topic, one per default link */
+        if (nn_setsockopt(module_info->receive_socket, NN_SUB, NN_SUB_UNSUBSCRIBE, &source, sizeof(MODULE_HANDLE)) < 0)
+        {
+            /*Codes_SRS_BROKER_17_040: [ Upon an error, Broker_RemoveLink shall return BROKER_REMOVE_LINK_ERROR. ]*/
+            LogError("Unable to unsubscribe module [%p] from [%p]", module_info->module->module_handle, source);
+            result = BROKER_REMOVE_LINK_ERROR;
+        }
+        else
+        {
+            result = BROKER_OK;
+        }
+    }
+    return result;
+}
+
 BROKER_RESULT Broker_RemoveModule(BROKER_HANDLE broker, const MODULE* module)
 {
     /*Codes_SRS_BROKER_13_048: [If `broker` or `module` is NULL the function shall return BROKER_INVALIDARG.]*/
@@ -591,7 +1849,47 @@ BROKER_RESULT Broker_RemoveModule(BROKER_HANDLE broker, const MODULE* module)
             else
             {
                 BROKER_MODULEINFO* module_info = (BROKER_MODULEINFO*)singlylinkedlist_item_get_value(module_info_item);
-                if (stop_module(broker_data->publish_socket, module_info) == 0)
+                BROKER_DIRECT_LINK* orphans = NULL;
+                LIST_ITEM_HANDLE item;
+
+                /*Codes_SRS_BROKER_13_052: [The function shall remove the module from BROKER_HANDLE_DATA::modules.]*/
+                singlylinkedlist_remove(broker_data->modules, module_info_item);
+                /* direct links into the module go with it */
+                for (item = singlylinkedlist_get_head_item(broker_data->modules); item != NULL; item = singlylinkedlist_get_next_item(item))
+                {
+                    BROKER_MODULEINFO* other = (BROKER_MODULEINFO*)singlylinkedlist_item_get_value(item);
+                    BROKER_DIRECT_LINK** direct_link = &other->direct_links;
+                    while (*direct_link != NULL)
+                    {
+                        if ((*direct_link)->sink == module_info)
+                        {
+                            BROKER_DIRECT_LINK* orphan = *direct_link;
+                            *direct_link = orphan->next;
+                            orphan->next = orphans;
+                            orphans = orphan;
+                        }
+                        else
+                        {
+                            direct_link = &(*direct_link)->next;
+                        }
+                    }
+                }
+                /* publishers must no longer see the module before its resources go away */
+                (void)broker_routing_update(broker_data);
+                /* a publisher that picked the module from an older routing may still be in its Receive */
+                while (BROKER_ATOMIC_LOAD(&module_info->direct_calls) != 0)
+                {
+                    ThreadAPI_Sleep(1);
+                }
+                while (orphans != NULL)
+                {
+                    BROKER_DIRECT_LINK* orphan = orphans;
+                    orphans = orphan->next;
+                    BrokerPredicate_Destroy(orphan->predicate);
+                    free(orphan);
+                }
+
+                if (stop_module(broker_data, module_info) == 0)
                 {
                     deinit_module(module_info);
                 }
@@ -599,9 +1897,6 @@ BROKER_RESULT Broker_RemoveModule(BROKER_HANDLE broker, const MODULE* module)
                 {
                     LogError("unable to stop module");
                 }
-
-                /*Codes_SRS_BROKER_13_052: [The function shall remove the module from BROKER_HANDLE_DATA::modules.]*/
-                singlylinkedlist_remove(broker_data->modules, module_info_item);
                 free(module_info);
 
                 /*Codes_SRS_BROKER_13_053: [This function shall return BROKER_ERROR if an underlying API call to the platform causes an error or BROKER_OK otherwise.]*/
@@ -663,6 +1958,19 @@ BROKER_RESULT Broker_AddModule(BROKER_HANDLE broker, const MODULE* module)
         {
             module_info->receiverThMsg = NULL;
             module_info->senderThMsg = NULL;
+            module_info->actor = NULL;
+            module_info->broker_data = (BROKER_HANDLE_DATA*)broker;
+            module_info->default_links = NULL;
+            module_info->default_filter_count = 0;
+            module_info->default_sink_count = 0;
+            module_info->published = 0;
+            memset(&module_info->default_receive, 0, sizeof(module_info->default_receive));
+            memset(&module_info->thread_receive, 0, sizeof(module_info->thread_receive));
+            module_info->direct_links = NULL;
+            module_info->direct_calls = 0;
+            memset(&module_info->direct_receive, 0, sizeof(module_info->direct_receive));
+            memset(&module_info->watchdog_seen, 0, sizeof(module_info->watchdog_seen));
+            module_info->slow = false;
             if (init_module(module_info, module) != BROKER_OK)
             {
                 /*Codes_SRS_BROKER_13_047: [This function shall return BROKER_ERROR if an underlying API call to the platform causes an error or BROKER_OK otherwise.]*/
@@ -697,7 +2005,7 @@ BROKER_RESULT Broker_AddModule(BROKER_HANDLE broker, const MODULE* module)
                     }
                     else
                     {
-                        if (start_module(module_info, broker_data->url) != BROKER_OK)
+                        if (start_module(broker_data, module_info) != BROKER_OK)
                         {
                             LogError("start_module failed");
                             deinit_module(module_info);
@@ -705,6 +2013,16 @@ BROKER_RESULT Broker_AddModule(BROKER_HANDLE broker, const MODULE* module)
                             free(module_info);
                             result = BROKER_ERROR;
                         }
+                        else if (broker_routing_update(broker_data) != 0)
+                        {
+                            /* the routing is empty now, so nothing refers to module_info any more */
+                            LogError("unable to publish routing for the new module");
+                            (void)stop_module(broker_data, module_info);
+                            deinit_module(module_info);
+                            singlylinkedlist_remove(broker_data->modules, moduleListItem);
+                            free(module_info);
+                            result = BROKER_ERROR;
+                        }
                         else
                         {
                             /*Codes_SRS_BROKER_13_047: [This function shall return BROKER_ERROR if an underlying API call to the platform causes an error or BROKER_OK otherwise.]*/
@@ -725,104 +2043,2318 @@ BROKER_RESULT Broker_AddModule(BROKER_HANDLE broker, const MODULE* module)
 
 
 
-static int thread_message_control_receiver_thread_worker(void* context)
+static THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* thread_message_link_create(THREAD_MESSAGE_HANDLING_RECEIVER* receiver, size_t capacity, BROKER_LINK_QUEUE_POLICY policy)
 {
-    THREAD_MESSAGE_HANDLING_RECEIVER* receiverContext = (THREAD_MESSAGE_HANDLING_RECEIVER*)context;
-    BROKER_MODULEINFO* receiver_module_info = (BROKER_MODULEINFO*)receiverContext->module_info;
-    if (Lock(receiverContext->lock) != LOCK_OK) {
-        LogError("lock for receiverContext in thread_message_control_receiver_thread_worker failed");
+    THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* result = (THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER*)malloc(sizeof(THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER));
+    if (result == NULL) {
+        LogError("malloc thread message link failed.");
     }
     else {
-        while (true) {
-            THREAD_MESSAGE_CTRL* msgCtrl = NULL;
-            if (!receiverContext->toContinue)
-            {
-                LogInfo("thread_message_control_receiver_thread_worker to be terminated.");
+        size_t lane;
+        for (lane = 0; lane < THREAD_MESSAGE_LANE_COUNT; lane++) {
+            result->lanes[lane].queue = BrokerQueue_Create(THREAD_MESSAGE_QUEUE_CAPACITY);
+            result->lanes[lane].overflow_lock = Lock_Init();
+            if (result->lanes[lane].queue == NULL || result->lanes[lane].overflow_lock == NULL) {
                 break;
             }
-            
-            while (msgCtrl == NULL) {
-                THREAD_MESSAGE_CTRL* pre_receive_msg = NULL;
-                THREAD_MESSAGE_HANDLING_SENDER_FOR_RECEIVER* sender = receiverContext->senders;
-                while (sender != NULL) {
-//                  if (Lock(sender->sender_module_info->senderThMsg->lock) != LOCK_OK) {
-//                      LogError("Lock for senderThMsg in thread_message_control_receiver_thread_worker failed");
-//                  }
-//                  else {
-                        THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* current_receiver = sender->sender_module_info->senderThMsg->receivers;
-                        while (current_receiver != NULL) {
-                            if (current_receiver->receiver == receiverContext) {
-                                if (msgCtrl == NULL) {
-                                    msgCtrl = current_receiver->sendingMessages;
-                                    pre_receive_msg = msgCtrl;
-                                }
-                                else {
-                                    pre_receive_msg->next = current_receiver->sendingMessages;
-                                    pre_receive_msg = pre_receive_msg->next;
-                                }
-                                THREAD_MESSAGE_CTRL* current_sending_msg = pre_receive_msg;
-                                while (current_sending_msg != NULL) {
-                                    if (current_sending_msg->next == NULL) {
-                                        pre_receive_msg = current_sending_msg;
-                                    }
-                                    current_sending_msg = current_sending_msg->next;
-                                }
-                                current_receiver->sendingMessages = NULL;
-                                break;
-                            }
-                            current_receiver = current_receiver->next;
-                        }
-                  //      THREAD_MESSAGE_HANDLING_SENDER_FOR_RECEIVER* current_sender = sender;
-                        sender = sender->next;
-//                      if (Unlock(current_sender->sender_module_info->senderThMsg->lock) != LOCK_OK) {
-//                          LogError("Unock for senderThMsg in thread_message_control_receiver_thread_worker failed");
-//                      }
-                    }
-                    if (msgCtrl == NULL) {
-                        if (!receiverContext->toContinue) {
-                            LogInfo("Received stop order so that exit message loop!");
-                            break;
-                        }
-                        if (Condition_Wait(receiverContext->condition, receiverContext->lock, 0) != COND_OK) {
-                            LogError("Wait for condition for receiverContext in thread_message_control_receiver_thread_worker failed");
-                        }
-                    }
-//                }
-                THREAD_MESSAGE_CTRL* current_msg = msgCtrl;
-                Unlock(receiverContext->lock);
-                while (current_msg != NULL) {
-                    MODULE_RECEIVE(receiver_module_info->module->module_apis)(receiver_module_info->module->module_handle, current_msg->msg);
-                    ThreadAPI_Sleep(0);
-                    THREAD_MESSAGE_CTRL* tmp_msg = current_msg;
-                    current_msg = current_msg->next;
-                    Message_Destroy(tmp_msg->msg);
-                    free((void*)tmp_msg);
+            result->lanes[lane].overflow_head = NULL;
+            result->lanes[lane].overflow_tail = NULL;
+            result->lanes[lane].overflow_count = 0;
+        }
+        if (lane < THREAD_MESSAGE_LANE_COUNT) {
+            LogError("create queue or overflow lock for thread message link failed.");
+            do {
+                if (result->lanes[lane].queue != NULL) {
+                    BrokerQueue_Destroy(result->lanes[lane].queue);
                 }
-                Lock(receiverContext->lock);
-            }
+                if (result->lanes[lane].overflow_lock != NULL) {
+                    Lock_Deinit(result->lanes[lane].overflow_lock);
+                }
+            } while (lane-- > 0);
+            free(result);
+            result = NULL;
         }
-        LOCK_RESULT lock_result = Unlock(receiverContext->lock);
-        if (lock_result != LOCK_OK) {
-            LogError("Unlock for receiverContext in thread_message_control_receiver_thread_worker failed");
+        else {
+            result->receiver = receiver;
+            result->capacity = capacity;
+            result->policy = policy;
+            result->depth = 0;
+            result->queued_bytes = 0;
+            result->ttl_us = 0;
+            result->expired = 0;
+            result->blocked_publishers = 0;
+            result->pins = 0;
+            result->removed = 0;
+            result->dropped_oldest = 0;
+            result->dropped_newest = 0;
+            result->rejected = 0;
+            result->enqueued = 0;
+            result->peak_depth = 0;
+            result->delivered = 0;
+            memset(&result->queue_latency, 0, sizeof(result->queue_latency));
+            result->predicate = NULL;
+            broker_link_sampler_init(&result->sampler, 0, 0);
+            result->group = NULL;
+            result->balance = BROKER_LINK_BALANCE_ROUND_ROBIN;
+            result->partition_key = NULL;
+            result->group_turn = 0;
+            result->coalesce_keys = NULL;
+            result->coalesce_key_count = 0;
+            result->coalesce_lock = NULL;
+            result->coalesce_slots = NULL;
+            result->coalesce_bucket_count = 0;
+            result->coalesce_slot_count = 0;
+            result->coalesced = 0;
+            result->spill = NULL;
+            result->spill_lock = NULL;
+            result->spill_count = 0;
+            result->spilled = 0;
+            result->next = NULL;
         }
     }
-    Condition_Deinit(receiverContext->condition);
-    if (Lock_Deinit(receiverContext->lock) != LOCK_OK) {
-        LogError("Deinit for receiverContext in thread_message_control_receiver_thread_worker failed");
-    }
-
-    return 0;
+    return result;
 }
 
-BROKER_RESULT Broker_AddLink(BROKER_HANDLE broker, const BROKER_LINK_DATA* link)
+/* Bytes of content and properties of the message, the part of a clone that
+ * lives as long as the clone does. */
+static size_t message_footprint(MESSAGE_HANDLE message)
 {
-    BROKER_RESULT result;
-    /*Codes_SRS_BROKER_17_029: [ If broker or link are NULL, Broker_AddLink shall return BROKER_INVALIDARG. ]*/
-    if (broker == NULL || link == NULL || link->module_sink_handle == NULL || link->module_source_handle == NULL)
-    {
+    size_t result = 0;
+    const CONSTBUFFER* content = Message_GetContent(message);
+    CONSTMAP_HANDLE properties = Message_GetProperties(message);
+    const char* const* keys;
+    const char* const* values;
+    size_t count;
+    if (content != NULL) {
+        result += content->size;
+    }
+    if (properties != NULL) {
+        if (ConstMap_GetInternals(properties, &keys, &values, &count) == CONSTMAP_OK) {
+            for (size_t i = 0; i < count; i++) {
+                result += strlen(keys[i]) + strlen(values[i]) + 2;
+            }
+        }
+        ConstMap_Destroy(properties);
+    }
+    return result;
+}
+
+/* BROKER_TTL_PROPERTY of the message in microseconds, 0 when it has none. */
+static uint64_t message_ttl_us(MESSAGE_HANDLE message)
+{
+    uint64_t result = 0;
+    CONSTMAP_HANDLE properties = Message_GetProperties(message);
+    if (properties != NULL) {
+        result = broker_ttl_us(ConstMap_GetValue(properties, BROKER_TTL_PROPERTY));
+        ConstMap_Destroy(properties);
+    }
+    return result;
+}
+
+static THREAD_MESSAGE_CTRL* thread_message_ctrl_create(BROKER_HANDLE_DATA* broker_data, MESSAGE_HANDLE message, size_t bytes, size_t refcount, BROKER_MESSAGE_PRIORITY priority)
+{
+    THREAD_MESSAGE_CTRL* result = (THREAD_MESSAGE_CTRL*)BrokerSlab_Alloc(&thread_message_ctrl_slab);
+    if (result == NULL) {
+        LogError("allocate THREAD_MESSAGE_CTRL failed.");
+    }
+    else {
+        // one clone for all sinks; sinks only read the message
+        result->msg = Message_Clone(message);
+        if (result->msg == NULL) {
+            LogError("clone message for THREAD_MESSAGE_CTRL failed.");
+            BrokerSlab_Free(&thread_message_ctrl_slab, result);
+            result = NULL;
+        }
+        else {
+            result->refcount = refcount;
+            result->published_us = broker_clock_us();
+            result->ttl_us = message_ttl_us(message);
+            result->priority = priority;
+            result->coalesce_slot = NULL;
+            result->bytes = bytes;
+            result->broker = broker_data;
+            (void)BROKER_ATOMIC_ADD(&broker_data->held_bytes, bytes);
+        }
+    }
+    return result;
+}
+
+/* Destroys the control and its message whatever the refcount. */
+static void thread_message_ctrl_free(THREAD_MESSAGE_CTRL* msgCtrl)
+{
+    (void)BROKER_ATOMIC_SUB(&msgCtrl->broker->held_bytes, msgCtrl->bytes);
+    Message_Destroy(msgCtrl->msg);
+    BrokerSlab_Free(&thread_message_ctrl_slab, msgCtrl);
+}
+
+/* Unlinks the slot of a message queued on a coalescing link, so that the
+ * next message with its key is queued anew instead of replacing this one.
+ * Once it returns no publisher changes msgCtrl->msg any more. */
+static void thread_message_coalesce_detach(THREAD_MESSAGE_CTRL* msgCtrl)
+{
+    THREAD_MESSAGE_COALESCE_SLOT* slot = msgCtrl->coalesce_slot;
+    THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link = slot->link;
+    if (Lock(link->coalesce_lock) != LOCK_OK) {
+        LogError("Lock coalesce_lock in thread_message_coalesce_detach failed.");
+    }
+    else {
+        THREAD_MESSAGE_COALESCE_SLOT** previous = &link->coalesce_slots[slot->hash & (link->coalesce_bucket_count - 1)];
+        while (*previous != slot) {
+            previous = &(*previous)->next;
+        }
+        *previous = slot->next;
+        link->coalesce_slot_count--;
+        msgCtrl->coalesce_slot = NULL;
+        Unlock(link->coalesce_lock);
+        free(slot->key);
+        free(slot);
+    }
+}
+
+static void thread_message_ctrl_release(THREAD_MESSAGE_CTRL* msgCtrl)
+{
+    if (BROKER_ATOMIC_SUB(&msgCtrl->refcount, 1) == 0) {
+        // a coalesced message dropped before the receiver took it
+        if (msgCtrl->coalesce_slot != NULL) {
+            thread_message_coalesce_detach(msgCtrl);
+        }
+        thread_message_ctrl_free(msgCtrl);
+    }
+}
+
+/* Sets matches[i] when the predicate of the route's i-th link takes the
+ * message and its sampler keeps it, and returns how many do. The properties
+ * are read at most once for all links, and only for a predicate. */
+static size_t thread_message_links_match(const BROKER_ROUTE* route, MESSAGE_HANDLE message, bool* matches)
+{
+    size_t result = 0;
+    CONSTMAP_HANDLE properties = NULL;
+    for (size_t i = 0; i < route->link_count; i++) {
+        THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link = route->links[i];
+        if (link->predicate != NULL && properties == NULL) {
+            properties = Message_GetProperties(message);
+        }
+        matches[i] = BrokerPredicate_Evaluate(link->predicate, message_properties_lookup, (void*)properties) &&
+            broker_link_sampler_take(&link->sampler);
+        if (matches[i]) {
+            result++;
+        }
+    }
+    if (properties != NULL) {
+        ConstMap_Destroy(properties);
+    }
+    return result;
+}
+
+/* FNV-1a, spreads partition keys over the links of a group */
+static size_t partition_hash(const char* key)
+{
+    uint32_t hash = 2166136261u;
+    while (*key != '\0') {
+        hash = (hash ^ (unsigned char)*key++) * 16777619u;
+    }
+    return (size_t)hash;
+}
+
+/* Keeps one link of each group of the route set in matches, clears the
+ * other links of the group, and returns how many links are left set.
+ * pending, when not NULL, counts per link the messages of the batch being
+ * published that were given to it but are not queued yet. */
+static size_t thread_message_links_balance(const BROKER_ROUTE* route, MESSAGE_HANDLE message, bool* matches, size_t* pending)
+{
+    size_t result = 0;
+    CONSTMAP_HANDLE properties = NULL;
+    for (size_t i = 0; i < route->link_count; i++) {
+        if (route->groups[i] == i && route->links[i]->group != NULL) {
+            THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* first = route->links[i];
+            const char* key = NULL;
+            size_t members = 0;
+            for (size_t j = i; j < route->link_count; j++) {
+                if (route->groups[j] == i && matches[j]) {
+                    members++;
+                }
+            }
+            if (first->balance == BROKER_LINK_BALANCE_PARTITION && members > 0) {
+                if (properties == NULL) {
+                    properties = Message_GetProperties(message);
+                }
+                key = (properties == NULL) ? NULL : ConstMap_GetValue(properties, first->partition_key);
+            }
+            if (key != NULL) {
+                // the partition counts every link of the group, so a key keeps its sink whatever the predicates say
+                size_t all_members = 0;
+                size_t chosen = route->link_count;
+                size_t target;
+                for (size_t j = i; j < route->link_count; j++) {
+                    if (route->groups[j] == i) {
+                        all_members++;
+                    }
+                }
+                target = partition_hash(key) % all_members;
+                for (size_t j = i, rank = 0; j < route->link_count; j++) {
+                    if (route->groups[j] == i) {
+                        if (rank++ == target) {
+                            chosen = j;
+                        }
+                        else {
+                            matches[j] = false;
+                        }
+                    }
+                }
+                if (pending != NULL && matches[chosen]) {
+                    pending[chosen]++;
+                }
+            }
+            else if (members > 0) {
+                // members are ranked from the one whose turn it is; round robin takes the first,
+                // shortest queue the least loaded with ties going by rank
+                size_t start = BROKER_ATOMIC_ADD(&first->group_turn, 1) % members;
+                size_t chosen = route->link_count;
+                size_t chosen_load = 0;
+                size_t chosen_order = 0;
+                size_t rank = 0;
+                for (size_t j = i; j < route->link_count; j++) {
+                    if (route->groups[j] == i && matches[j]) {
+                        size_t order = (rank + members - start) % members;
+                        // a partitioned message without its key is balanced round robin
+                        size_t load = (first->balance == BROKER_LINK_BALANCE_SHORTEST_QUEUE) ? BROKER_ATOMIC_LOAD(&route->links[j]->depth) + ((pending != NULL) ? pending[j] : 0) : order;
+                        if (chosen == route->link_count || load < chosen_load || (load == chosen_load && order < chosen_order)) {
+                            chosen = j;
+                            chosen_load = load;
+                            chosen_order = order;
+                        }
+                        matches[j] = false;
+                        rank++;
+                    }
+                }
+                matches[chosen] = true;
+                if (pending != NULL) {
+                    pending[chosen]++;
+                }
+            }
+        }
+    }
+    for (size_t i = 0; i < route->link_count; i++) {
+        if (matches[i]) {
+            result++;
+        }
+    }
+    if (properties != NULL) {
+        ConstMap_Destroy(properties);
+    }
+    return result;
+}
+
+/* Oldest message of the lane without removing it. Single consumer only. */
+static THREAD_MESSAGE_CTRL* thread_message_lane_peek(THREAD_MESSAGE_LANE* lane)
+{
+    THREAD_MESSAGE_CTRL* result = (THREAD_MESSAGE_CTRL*)BrokerQueue_Peek(lane->queue);
+    if (result == NULL && BROKER_ATOMIC_LOAD(&lane->overflow_count) != 0) {
+        if (Lock(lane->overflow_lock) != LOCK_OK) {
+            LogError("Lock overflow_lock in thread_message_lane_peek failed.");
+        }
+        else {
+            if (lane->overflow_head != NULL) {
+                result = lane->overflow_head->msgCtrl;
+            }
+            Unlock(lane->overflow_lock);
+        }
+    }
+    return result;
+}
+
+/* Takes the oldest message of one lane of the link. Single consumer only. */
+static THREAD_MESSAGE_CTRL* thread_message_link_dequeue_lane(THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link, size_t lane_index)
+{
+    THREAD_MESSAGE_LANE* lane = &link->lanes[lane_index];
+    THREAD_MESSAGE_CTRL* result = (THREAD_MESSAGE_CTRL*)BrokerQueue_TryPop(lane->queue);
+    if (result == NULL && BROKER_ATOMIC_LOAD(&lane->overflow_count) != 0) {
+        // everything in the ring is older than the overflow list, so the ring is drained first
+        if (Lock(lane->overflow_lock) != LOCK_OK) {
+            LogError("Lock overflow_lock in thread_message_link_dequeue failed.");
+        }
+        else {
+            THREAD_MESSAGE_OVERFLOW* overflow = lane->overflow_head;
+            if (overflow != NULL) {
+                lane->overflow_head = (THREAD_MESSAGE_OVERFLOW*)overflow->next;
+                if (lane->overflow_head == NULL) {
+                    lane->overflow_tail = NULL;
+                }
+                (void)BROKER_ATOMIC_SUB(&lane->overflow_count, 1);
+                result = overflow->msgCtrl;
+                BrokerSlab_Free(&thread_message_overflow_slab, overflow);
+            }
+            Unlock(lane->overflow_lock);
+        }
+    }
+    if (result != NULL) {
+        if (result->coalesce_slot != NULL) {
+            thread_message_coalesce_detach(result);
+        }
+        // after the detach no publisher changes result->bytes any more
+        (void)BROKER_ATOMIC_SUB(&link->queued_bytes, result->bytes);
+        (void)BROKER_ATOMIC_SUB(&link->depth, 1);
+        // pairs with the increment of blocked_publishers in thread_message_link_wait_for_room
+        if (BROKER_ATOMIC_LOAD(&link->blocked_publishers) != 0) {
+            BROKER_MODULEINFO* sink = (BROKER_MODULEINFO*)link->receiver->module_info;
+            if (Lock(sink->fc_lock) != LOCK_OK) {
+                LogError("Lock fc_lock in thread_message_link_dequeue failed.");
+            }
+            else {
+                Condition_Post(sink->fc_condition);
+                Unlock(sink->fc_lock);
+            }
+        }
+    }
+    return result;
+}
+
+/* Takes the message of the highest priority queued on the link. Single consumer only. */
+static THREAD_MESSAGE_CTRL* thread_message_link_dequeue(THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link)
+{
+    THREAD_MESSAGE_CTRL* result = NULL;
+    size_t lane = THREAD_MESSAGE_LANE_COUNT;
+    while (result == NULL && lane-- > 0) {
+        result = thread_message_link_dequeue_lane(link, lane);
+    }
+    return result;
+}
+
+/* Puts msgCtrl on the ring or the overflow list of its lane, ignoring the
+ * link capacity. returns 0 if the message was queued, otherwise __LINE__ */
+static int thread_message_link_push(THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link, THREAD_MESSAGE_CTRL* msgCtrl)
+{
+    int result;
+    THREAD_MESSAGE_LANE* lane = &link->lanes[msgCtrl->priority];
+    // fast path: one CAS on the ring, taken whenever nothing is parked in the overflow list
+    if (BROKER_ATOMIC_LOAD(&lane->overflow_count) == 0 && BrokerQueue_TryPush(lane->queue, msgCtrl)) {
+        result = 0;
+    }
+    else if (Lock(lane->overflow_lock) != LOCK_OK) {
+        LogError("Lock overflow_lock in thread_message_link_push failed.");
+        result = __LINE__;
+    }
+    else {
+        // the receiver may have caught up since the first try
+        if (lane->overflow_count == 0 && BrokerQueue_TryPush(lane->queue, msgCtrl)) {
+            result = 0;
+        }
+        else {
+            THREAD_MESSAGE_OVERFLOW* overflow = (THREAD_MESSAGE_OVERFLOW*)BrokerSlab_Alloc(&thread_message_overflow_slab);
+            if (overflow == NULL) {
+                LogError("allocate THREAD_MESSAGE_OVERFLOW failed.");
+                result = __LINE__;
+            }
+            else {
+                overflow->msgCtrl = msgCtrl;
+                overflow->next = NULL;
+                if (lane->overflow_tail == NULL) {
+                    lane->overflow_head = overflow;
+                }
+                else {
+                    lane->overflow_tail->next = overflow;
+                }
+                lane->overflow_tail = overflow;
+                (void)BROKER_ATOMIC_ADD(&lane->overflow_count, 1);
+                result = 0;
+            }
+        }
+        Unlock(lane->overflow_lock);
+    }
+    return result;
+}
+
+/* Statistics for count messages just queued on the link. */
+static void thread_message_link_note_enqueued(THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link, size_t count)
+{
+    size_t depth = BROKER_ATOMIC_LOAD(&link->depth);
+    size_t peak = BROKER_ATOMIC_LOAD(&link->peak_depth);
+    (void)BROKER_ATOMIC_ADD(&link->enqueued, count);
+    while (depth > peak && !BROKER_ATOMIC_CAS(&link->peak_depth, peak, depth)) {
+        peak = BROKER_ATOMIC_LOAD(&link->peak_depth);
+    }
+}
+
+/* Takes one unit of depth, failing if a bounded link is full. */
+static bool thread_message_link_reserve(THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link)
+{
+    bool result = false;
+    if (link->capacity == 0) {
+        (void)BROKER_ATOMIC_ADD(&link->depth, 1);
+        result = true;
+    }
+    else {
+        size_t depth = BROKER_ATOMIC_LOAD(&link->depth);
+        while (depth < link->capacity) {
+            if (BROKER_ATOMIC_CAS(&link->depth, depth, depth + 1)) {
+                result = true;
+                break;
+            }
+            depth = BROKER_ATOMIC_LOAD(&link->depth);
+        }
+    }
+    return result;
+}
+
+/* BROKER_LINK_QUEUE_POLICY_DROP_OLDEST: the publisher pops the oldest message
+ * of the lowest priority itself, under the receiver lock that makes it the
+ * single consumer. */
+static void thread_message_link_drop_oldest(THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link)
+{
+    if (Lock(link->receiver->lock) != LOCK_OK) {
+        LogError("Lock receiver in thread_message_link_drop_oldest failed.");
+    }
+    else {
+        THREAD_MESSAGE_CTRL* oldest = NULL;
+        size_t lane;
+        for (lane = 0; oldest == NULL && lane < THREAD_MESSAGE_LANE_COUNT; lane++) {
+            oldest = thread_message_link_dequeue_lane(link, lane);
+        }
+        Unlock(link->receiver->lock);
+        if (oldest != NULL) {
+            thread_message_ctrl_release(oldest);
+            (void)BROKER_ATOMIC_ADD(&link->dropped_oldest, 1);
+        }
+    }
+}
+
+/* BROKER_MEMORY_POLICY_SHED_LARGEST: drops the oldest message of the lowest
+ * priority queued on the link, under the receiver lock like
+ * thread_message_link_drop_oldest, but only when no other link holds it, so
+ * that the drop gives its bytes back. Returns those bytes, 0 when the link is
+ * empty or its oldest message is shared. */
+static size_t thread_message_link_shed_oldest(THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link)
+{
+    size_t result = 0;
+    if (Lock(link->receiver->lock) != LOCK_OK) {
+        LogError("Lock receiver in thread_message_link_shed_oldest failed.");
+    }
+    else {
+        THREAD_MESSAGE_CTRL* oldest = NULL;
+        size_t lane;
+        for (lane = 0; lane < THREAD_MESSAGE_LANE_COUNT; lane++) {
+            oldest = thread_message_lane_peek(&link->lanes[lane]);
+            if (oldest != NULL) {
+                break;
+            }
+        }
+        // the other links only ever let go of the message, so a single reference stays single
+        if (oldest != NULL && BROKER_ATOMIC_LOAD(&oldest->refcount) == 1) {
+            oldest = thread_message_link_dequeue_lane(link, lane);
+            // read after the dequeue, once no coalescing publisher changes it any more
+            result = oldest->bytes;
+            thread_message_ctrl_release(oldest);
+            (void)BROKER_ATOMIC_ADD(&link->dropped_oldest, 1);
+        }
+        Unlock(link->receiver->lock);
+    }
+    return result;
+}
+
+/* Decides whether a message of the given bytes may be held for the
+ * thread-message links of the broker. table is the routing snapshot of the
+ * caller's read section, the links shed from under
+ * BROKER_MEMORY_POLICY_SHED_LARGEST: one pass picks the
+ * BROKER_MEMORY_SHED_LINKS links holding the most bytes, and their oldest
+ * unshared messages go, largest link first, until the dropped bytes cover
+ * the overshoot. Every drop and a refusal count in memory_shed. On refusal
+ * *result becomes BROKER_QUEUE_FULL under BROKER_MEMORY_POLICY_FAIL. */
+static bool broker_memory_admit(BROKER_HANDLE_DATA* broker_data, const BROKER_ROUTING_TABLE* table, size_t bytes, BROKER_RESULT* result)
+{
+    size_t held = BROKER_ATOMIC_LOAD(&broker_data->held_bytes);
+    bool admitted = (broker_data->memory_budget == 0 || held + bytes <= broker_data->memory_budget);
+    // a message alone over the budget is refused without shedding anything for it
+    if (!admitted && broker_data->memory_policy == BROKER_MEMORY_POLICY_SHED_LARGEST && bytes <= broker_data->memory_budget) {
+        THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* largest[BROKER_MEMORY_SHED_LINKS];
+        size_t largest_bytes[BROKER_MEMORY_SHED_LINKS];
+        size_t candidates = 0;
+        size_t needed = held + bytes - broker_data->memory_budget;
+        size_t released = 0;
+        size_t rounds = 0;
+        for (size_t r = 0; r <= table->mask; r++) {
+            const BROKER_ROUTE* route = &table->routes[r];
+            if (route->source != NULL) {
+                for (size_t i = 0; i < route->link_count; i++) {
+                    size_t link_bytes = BROKER_ATOMIC_LOAD(&route->links[i]->queued_bytes);
+                    if (link_bytes > 0 && (candidates < BROKER_MEMORY_SHED_LINKS || link_bytes > largest_bytes[candidates - 1])) {
+                        // insertion into the short list, kept largest first
+                        size_t c = (candidates < BROKER_MEMORY_SHED_LINKS) ? candidates++ : BROKER_MEMORY_SHED_LINKS - 1;
+                        while (c > 0 && largest_bytes[c - 1] < link_bytes) {
+                            largest[c] = largest[c - 1];
+                            largest_bytes[c] = largest_bytes[c - 1];
+                            c--;
+                        }
+                        largest[c] = route->links[i];
+                        largest_bytes[c] = link_bytes;
+                    }
+                }
+            }
+        }
+        for (size_t c = 0; released < needed && c < candidates && rounds < BROKER_MEMORY_SHED_ROUNDS; c++) {
+            size_t freed;
+            while (released < needed && rounds < BROKER_MEMORY_SHED_ROUNDS && (freed = thread_message_link_shed_oldest(largest[c])) != 0) {
+                released += freed;
+                rounds++;
+                (void)BROKER_ATOMIC_ADD(&broker_data->memory_shed, 1);
+            }
+        }
+        admitted = (BROKER_ATOMIC_LOAD(&broker_data->held_bytes) + bytes <= broker_data->memory_budget);
+    }
+    if (!admitted) {
+        (void)BROKER_ATOMIC_ADD(&broker_data->memory_shed, 1);
+        if (broker_data->memory_policy == BROKER_MEMORY_POLICY_FAIL) {
+            *result = BROKER_QUEUE_FULL;
+        }
+    }
+    return admitted;
+}
+
+/* BROKER_LINK_QUEUE_POLICY_BLOCK: waits until the sink frees a slot. Returns
+ * false if the sink is shutting down or the link was removed. Never called
+ * inside the routing read section, where it would hold up every link change. */
+static bool thread_message_link_wait_for_room(THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link)
+{
+    bool result = false;
+    BROKER_MODULEINFO* sink = (BROKER_MODULEINFO*)link->receiver->module_info;
+    if (Lock(sink->fc_lock) != LOCK_OK) {
+        LogError("Lock fc_lock in thread_message_link_wait_for_room failed.");
+    }
+    else {
+        (void)BROKER_ATOMIC_ADD(&link->blocked_publishers, 1);
+        while (!(result = thread_message_link_reserve(link)) && link->receiver->toContinue && BROKER_ATOMIC_LOAD(&link->removed) == 0) {
+            (void)Condition_Wait(sink->fc_condition, sink->fc_lock, THREAD_MESSAGE_BLOCK_WAIT_MS);
+        }
+        (void)BROKER_ATOMIC_SUB(&link->blocked_publishers, 1);
+        Unlock(sink->fc_lock);
+    }
+    return result;
+}
+
+/* Pushes msgCtrl, for which a unit of depth is already reserved, and consumes
+ * the caller's reference. */
+static BROKER_RESULT thread_message_link_push_reserved(THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link, THREAD_MESSAGE_CTRL* msgCtrl)
+{
+    BROKER_RESULT result;
+    // counted ahead of the push like depth, the receiver may take the message at once
+    (void)BROKER_ATOMIC_ADD(&link->queued_bytes, msgCtrl->bytes);
+    if (thread_message_link_push(link, msgCtrl) != 0) {
+        LogError("enqueue message failed.");
+        (void)BROKER_ATOMIC_SUB(&link->queued_bytes, msgCtrl->bytes);
+        (void)BROKER_ATOMIC_SUB(&link->depth, 1);
+        thread_message_ctrl_release(msgCtrl);
+        result = BROKER_ERROR;
+    }
+    else {
+        thread_message_link_note_enqueued(link, 1);
+        result = BROKER_OK;
+    }
+    return result;
+}
+
+/* True when the publisher already put a message for link aside, so that its
+ * later messages for the link wait behind it. */
+static bool thread_message_link_is_blocked(const THREAD_MESSAGE_BLOCKED* blocked, const THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link)
+{
+    while (blocked != NULL && blocked->link != link) {
+        blocked = blocked->next;
+    }
+    return blocked != NULL;
+}
+
+/* Called inside the routing read section: puts msgCtrl aside on *blocked, in
+ * publish order, and pins the link until thread_message_links_wait_blocked
+ * has queued it. Returns false when there is no memory to do so. */
+static bool thread_message_link_block(THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link, THREAD_MESSAGE_CTRL* msgCtrl, THREAD_MESSAGE_BLOCKED** blocked)
+{
+    bool result;
+    THREAD_MESSAGE_BLOCKED* entry = (THREAD_MESSAGE_BLOCKED*)malloc(sizeof(THREAD_MESSAGE_BLOCKED));
+    if (entry == NULL) {
+        LogError("malloc of blocked message failed.");
+        result = false;
+    }
+    else {
+        (void)BROKER_ATOMIC_ADD(&link->pins, 1);
+        entry->link = link;
+        entry->msgCtrl = msgCtrl;
+        entry->next = NULL;
+        while (*blocked != NULL) {
+            blocked = &(*blocked)->next;
+        }
+        *blocked = entry;
+        result = true;
+    }
+    return result;
+}
+
+/* Called by the publisher after its routing read section: waits for room on
+ * the link of every message put aside by thread_message_link_block, in order,
+ * queues it, and unpins the link. Messages of a removed link, or of a sink
+ * shutting down, are dropped. */
+static BROKER_RESULT thread_message_links_wait_blocked(THREAD_MESSAGE_BLOCKED* blocked)
+{
+    BROKER_RESULT result = BROKER_OK;
+    while (blocked != NULL) {
+        THREAD_MESSAGE_BLOCKED* next = blocked->next;
+        THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link = blocked->link;
+        if (!thread_message_link_wait_for_room(link)) {
+            (void)BROKER_ATOMIC_ADD(&link->dropped_newest, 1);
+            thread_message_ctrl_release(blocked->msgCtrl);
+        }
+        else {
+            BROKER_RESULT link_result = thread_message_link_push_reserved(link, blocked->msgCtrl);
+            if (link_result != BROKER_OK) {
+                result = link_result;
+            }
+            thread_message_receiver_wakeup(link->receiver);
+        }
+        // Broker_RemoveLink destroys the link once the last pin is gone
+        (void)BROKER_ATOMIC_SUB(&link->pins, 1);
+        free(blocked);
+        blocked = next;
+    }
+    return result;
+}
+
+/* Queues msgCtrl according to the link's capacity and policy. The caller's
+ * reference is consumed in every case: the message is either queued, or put
+ * aside on *blocked, or spilled and released, or released. Returns
+ * BROKER_QUEUE_FULL only for BROKER_LINK_QUEUE_POLICY_FAIL. */
+static BROKER_RESULT thread_message_link_enqueue(THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link, THREAD_MESSAGE_CTRL* msgCtrl, THREAD_MESSAGE_BLOCKED** blocked)
+{
+    BROKER_RESULT result = BROKER_OK;
+    bool set_aside = false;
+    // once a link spills, later messages follow the spilled ones to disk until the consumer has read them back
+    bool spill = (link->spill != NULL && BROKER_ATOMIC_LOAD(&link->spill_count) != 0);
+    // likewise behind a message of this publisher already waiting for room
+    bool wait = (link->policy == BROKER_LINK_QUEUE_POLICY_BLOCK && thread_message_link_is_blocked(*blocked, link));
+    bool reserved = !spill && !wait && thread_message_link_reserve(link);
+    if (!reserved && !spill) {
+        switch (link->policy) {
+        case BROKER_LINK_QUEUE_POLICY_DROP_OLDEST:
+            // concurrent publishers may each take a freed slot, so depth can pass capacity by at most their number
+            thread_message_link_drop_oldest(link);
+            (void)BROKER_ATOMIC_ADD(&link->depth, 1);
+            reserved = true;
+            break;
+        case BROKER_LINK_QUEUE_POLICY_BLOCK:
+            // a pool worker must not wait, the sink may need this very worker to drain; it drops the newest instead
+            set_aside = !BrokerPool_IsWorkerThread() && thread_message_link_block(link, msgCtrl, blocked);
+            if (!set_aside) {
+                (void)BROKER_ATOMIC_ADD(&link->dropped_newest, 1);
+            }
+            break;
+        case BROKER_LINK_QUEUE_POLICY_FAIL:
+            (void)BROKER_ATOMIC_ADD(&link->rejected, 1);
+            result = BROKER_QUEUE_FULL;
+            break;
+        case BROKER_LINK_QUEUE_POLICY_SPILL:
+            spill = true;
+            break;
+        case BROKER_LINK_QUEUE_POLICY_DROP_NEWEST:
+        default:
+            (void)BROKER_ATOMIC_ADD(&link->dropped_newest, 1);
+            break;
+        }
+    }
+
+    if (set_aside) {
+        // queued by thread_message_links_wait_blocked once the publisher left the read section
+    }
+    else if (!reserved) {
+        if (spill && thread_message_link_spill(link, msgCtrl) != 0) {
+            (void)BROKER_ATOMIC_ADD(&link->dropped_newest, 1);
+        }
+        thread_message_ctrl_release(msgCtrl);
+    }
+    else {
+        result = thread_message_link_push_reserved(link, msgCtrl);
+    }
+    return result;
+}
+
+/* Joins the values of the link's coalescing properties of the message into
+ * its key, NULL when the message has none of them. */
+static char* thread_message_coalesce_key(THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link, MESSAGE_HANDLE message)
+{
+    char* result = NULL;
+    CONSTMAP_HANDLE properties = Message_GetProperties(message);
+    if (properties != NULL) {
+        size_t size = 0;
+        bool found = false;
+        size_t k;
+        for (k = 0; k < link->coalesce_key_count; k++) {
+            const char* value = ConstMap_GetValue(properties, link->coalesce_keys[k]);
+            if (value != NULL) {
+                size += strlen(value);
+                found = true;
+            }
+            // separator, or the terminator after the last value
+            size++;
+        }
+        if (found) {
+            result = (char*)malloc(size);
+            if (result == NULL) {
+                LogError("malloc coalescing key failed.");
+            }
+            else {
+                char* end = result;
+                for (k = 0; k < link->coalesce_key_count; k++) {
+                    const char* value = ConstMap_GetValue(properties, link->coalesce_keys[k]);
+                    if (value != NULL) {
+                        size_t length = strlen(value);
+                        (void)memcpy(end, value, length);
+                        end += length;
+                    }
+                    *end++ = '\x1f';
+                }
+                end[-1] = '\0';
+            }
+        }
+        ConstMap_Destroy(properties);
+    }
+    return result;
+}
+
+static THREAD_MESSAGE_COALESCE_SLOT* thread_message_coalesce_find(THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link, const char* key, size_t hash)
+{
+    THREAD_MESSAGE_COALESCE_SLOT* result = link->coalesce_slots[hash & (link->coalesce_bucket_count - 1)];
+    while (result != NULL && (result->hash != hash || strcmp(result->key, key) != 0)) {
+        result = result->next;
+    }
+    return result;
+}
+
+/* Adds slot to the table under coalesce_lock, doubling the buckets once
+ * there are more slots than buckets. A failed grow keeps the old buckets. */
+static void thread_message_coalesce_insert(THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link, THREAD_MESSAGE_COALESCE_SLOT* slot)
+{
+    size_t bucket;
+    if (link->coalesce_slot_count >= link->coalesce_bucket_count) {
+        size_t bucket_count = link->coalesce_bucket_count * 2;
+        THREAD_MESSAGE_COALESCE_SLOT** slots = (THREAD_MESSAGE_COALESCE_SLOT**)calloc(bucket_count, sizeof(THREAD_MESSAGE_COALESCE_SLOT*));
+        if (slots != NULL) {
+            for (bucket = 0; bucket < link->coalesce_bucket_count; bucket++) {
+                THREAD_MESSAGE_COALESCE_SLOT* moved = link->coalesce_slots[bucket];
+                while (moved != NULL) {
+                    THREAD_MESSAGE_COALESCE_SLOT* next = moved->next;
+                    moved->next = slots[moved->hash & (bucket_count - 1)];
+                    slots[moved->hash & (bucket_count - 1)] = moved;
+                    moved = next;
+                }
+            }
+            free(link->coalesce_slots);
+            link->coalesce_slots = slots;
+            link->coalesce_bucket_count = bucket_count;
+        }
+    }
+    bucket = slot->hash & (link->coalesce_bucket_count - 1);
+    slot->next = link->coalesce_slots[bucket];
+    link->coalesce_slots[bucket] = slot;
+    link->coalesce_slot_count++;
+}
+
+/* Makes link a coalescing link on the comma separated property names of
+ * coalesce. Returns 0 on success, non zero when a name is empty or on
+ * allocation failure. */
+static int thread_message_link_set_coalesce(THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link, const char* coalesce)
+{
+    int result = 0;
+    size_t count = 1;
+    const char* name;
+    for (name = coalesce; *name != '\0'; name++) {
+        if (*name == ',') {
+            count++;
+        }
+    }
+    link->coalesce_keys = (char**)calloc(count, sizeof(char*));
+    link->coalesce_slots = (THREAD_MESSAGE_COALESCE_SLOT**)calloc(THREAD_MESSAGE_COALESCE_BUCKETS, sizeof(THREAD_MESSAGE_COALESCE_SLOT*));
+    link->coalesce_lock = Lock_Init();
+    if (link->coalesce_keys == NULL || link->coalesce_slots == NULL || link->coalesce_lock == NULL) {
+        LogError("allocate coalescing state of the link failed.");
+        result = __LINE__;
+    }
+    else {
+        link->coalesce_bucket_count = THREAD_MESSAGE_COALESCE_BUCKETS;
+        name = coalesce;
+        while (result == 0 && link->coalesce_key_count < count) {
+            const char* end = strchr(name, ',');
+            size_t length;
+            if (end == NULL) {
+                end = name + strlen(name);
+            }
+            while (name < end && *name == ' ') {
+                name++;
+            }
+            length = (size_t)(end - name);
+            while (length > 0 && name[length - 1] == ' ') {
+                length--;
+            }
+            if (length == 0) {
+                LogError("empty property name in coalesce \"%s\".", coalesce);
+                result = __LINE__;
+            }
+            else if ((link->coalesce_keys[link->coalesce_key_count] = (char*)malloc(length + 1)) == NULL) {
+                LogError("malloc coalescing property name failed.");
+                result = __LINE__;
+            }
+            else {
+                (void)memcpy(link->coalesce_keys[link->coalesce_key_count], name, length);
+                link->coalesce_keys[link->coalesce_key_count][length] = '\0';
+                link->coalesce_key_count++;
+                name = end + 1;
+            }
+        }
+    }
+    // on failure thread_message_link_destroy frees whatever was set
+    return result;
+}
+
+/* Queues msgCtrl on a coalescing link. When a message with the same key is
+ * still queued its message is replaced in place and keeps its place and
+ * lane; otherwise the link queues a copy of the control of its own, since
+ * the shared one may be queued on other links too. Consumes the caller's
+ * reference like thread_message_link_enqueue. */
+static BROKER_RESULT thread_message_link_coalesce(THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link, THREAD_MESSAGE_CTRL* msgCtrl, THREAD_MESSAGE_BLOCKED** blocked)
+{
+    BROKER_RESULT result;
+    char* key = thread_message_coalesce_key(link, msgCtrl->msg);
+    if (key == NULL) {
+        // no key to coalesce on
+        result = thread_message_link_enqueue(link, msgCtrl, blocked);
+    }
+    else if (Lock(link->coalesce_lock) != LOCK_OK) {
+        LogError("Lock coalesce_lock in thread_message_link_coalesce failed.");
+        free(key);
+        thread_message_ctrl_release(msgCtrl);
+        result = BROKER_ERROR;
+    }
+    else {
+        size_t hash = partition_hash(key);
+        MESSAGE_HANDLE replaced = NULL;
+        THREAD_MESSAGE_CTRL* queued = NULL;
+        THREAD_MESSAGE_COALESCE_SLOT* slot = thread_message_coalesce_find(link, key, hash);
+        if (slot != NULL) {
+            MESSAGE_HANDLE newer = Message_Clone(msgCtrl->msg);
+            if (newer == NULL) {
+                LogError("clone message for coalescing failed.");
+                result = BROKER_ERROR;
+            }
+            else {
+                replaced = slot->msgCtrl->msg;
+                slot->msgCtrl->msg = newer;
+                slot->msgCtrl->published_us = msgCtrl->published_us;
+                slot->msgCtrl->ttl_us = msgCtrl->ttl_us;
+                // the queued control is charged for the newer message from now on
+                (void)BROKER_ATOMIC_ADD(&msgCtrl->broker->held_bytes, msgCtrl->bytes);
+                (void)BROKER_ATOMIC_SUB(&msgCtrl->broker->held_bytes, slot->msgCtrl->bytes);
+                (void)BROKER_ATOMIC_ADD(&link->queued_bytes, msgCtrl->bytes);
+                (void)BROKER_ATOMIC_SUB(&link->queued_bytes, slot->msgCtrl->bytes);
+                slot->msgCtrl->bytes = msgCtrl->bytes;
+                (void)BROKER_ATOMIC_ADD(&link->coalesced, 1);
+                result = BROKER_OK;
+            }
+            free(key);
+        }
+        else if ((slot = (THREAD_MESSAGE_COALESCE_SLOT*)malloc(sizeof(THREAD_MESSAGE_COALESCE_SLOT))) == NULL ||
+            (queued = thread_message_ctrl_create(msgCtrl->broker, msgCtrl->msg, msgCtrl->bytes, 1, msgCtrl->priority)) == NULL) {
+            LogError("create coalescing slot failed.");
+            free(slot);
+            free(key);
+            result = BROKER_ERROR;
+        }
+        else {
+            queued->published_us = msgCtrl->published_us;
+            queued->ttl_us = msgCtrl->ttl_us;
+            queued->coalesce_slot = slot;
+            slot->link = link;
+            slot->key = key;
+            slot->hash = hash;
+            slot->msgCtrl = queued;
+            thread_message_coalesce_insert(link, slot);
+            result = BROKER_OK;
+        }
+        Unlock(link->coalesce_lock);
+
+        if (replaced != NULL) {
+            Message_Destroy(replaced);
+        }
+        thread_message_ctrl_release(msgCtrl);
+        if (queued != NULL) {
+            // the slot is unlinked again if the policy drops the message
+            result = thread_message_link_enqueue(link, queued, blocked);
+        }
+    }
+    return result;
+}
+
+/* Queues count messages in order. On an unbounded link each run of messages
+ * of the same priority goes to its lane's ring with a single reservation and
+ * whatever does not fit takes the overflow path; a bounded link applies its
+ * policy message by message, and a coalescing link coalesces them one by
+ * one. Consumes the caller's reference to every message. */
+static BROKER_RESULT thread_message_link_enqueue_batch(THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link, THREAD_MESSAGE_CTRL** msgCtrls, size_t count, THREAD_MESSAGE_BLOCKED** blocked)
+{
+    BROKER_RESULT result = BROKER_OK;
+    size_t start = 0;
+    if (link->coalesce_keys != NULL) {
+        for (; start < count; start++) {
+            BROKER_RESULT message_result = thread_message_link_coalesce(link, msgCtrls[start], blocked);
+            if (message_result != BROKER_OK) {
+                result = message_result;
+            }
+        }
+    }
+    while (start < count) {
+        THREAD_MESSAGE_LANE* lane = &link->lanes[msgCtrls[start]->priority];
+        size_t end = start + 1;
+        size_t queued = 0;
+        while (end < count && msgCtrls[end]->priority == msgCtrls[start]->priority) {
+            end++;
+        }
+        if (link->capacity == 0 && BROKER_ATOMIC_LOAD(&lane->overflow_count) == 0) {
+            size_t bytes = 0;
+            for (size_t i = start; i < end; i++) {
+                bytes += msgCtrls[i]->bytes;
+            }
+            (void)BROKER_ATOMIC_ADD(&link->depth, end - start);
+            (void)BROKER_ATOMIC_ADD(&link->queued_bytes, bytes);
+            queued = BrokerQueue_TryPushMany(lane->queue, (void* const*)(msgCtrls + start), end - start);
+            // what did not fit is counted again, in depth and bytes, by thread_message_link_enqueue
+            bytes = 0;
+            for (size_t i = start + queued; i < end; i++) {
+                bytes += msgCtrls[i]->bytes;
+            }
+            (void)BROKER_ATOMIC_SUB(&link->depth, end - start - queued);
+            (void)BROKER_ATOMIC_SUB(&link->queued_bytes, bytes);
+            if (queued > 0) {
+                thread_message_link_note_enqueued(link, queued);
+            }
+        }
+        for (size_t i = start + queued; i < end; i++) {
+            BROKER_RESULT message_result = thread_message_link_enqueue(link, msgCtrls[i], blocked);
+            if (message_result != BROKER_OK) {
+                result = message_result;
+            }
+        }
+        start = end;
+    }
+    return result;
+}
+
+/* Destroys every message still queued on the link and the link itself. The link must already be unreachable for the receiver thread. */
+static void thread_message_link_destroy(THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link)
+{
+    THREAD_MESSAGE_CTRL* msgCtrl;
+    size_t lane;
+    while ((msgCtrl = thread_message_link_dequeue(link)) != NULL) {
+        thread_message_ctrl_release(msgCtrl);
+    }
+    // spilled messages go with their segment files
+    BrokerSpill_Destroy(link->spill);
+    if (link->spill_lock != NULL) {
+        Lock_Deinit(link->spill_lock);
+    }
+    for (lane = 0; lane < THREAD_MESSAGE_LANE_COUNT; lane++) {
+        BrokerQueue_Destroy(link->lanes[lane].queue);
+        Lock_Deinit(link->lanes[lane].overflow_lock);
+    }
+    BrokerPredicate_Destroy(link->predicate);
+    free(link->group);
+    free(link->partition_key);
+    if (link->coalesce_keys != NULL) {
+        for (size_t k = 0; k < link->coalesce_key_count; k++) {
+            free(link->coalesce_keys[k]);
+        }
+        free(link->coalesce_keys);
+    }
+    // every slot went with its message above
+    free(link->coalesce_slots);
+    if (link->coalesce_lock != NULL) {
+        Lock_Deinit(link->coalesce_lock);
+    }
+    free((void*)link);
+}
+
+/* Destroys a link that publishers can no longer find in the routing snapshot.
+ * Publishers still waiting for room on it after their read section are woken
+ * up to drop their messages, and the link goes once they let go of it. */
+static void thread_message_link_retire(THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link)
+{
+    BROKER_MODULEINFO* sink = (BROKER_MODULEINFO*)link->receiver->module_info;
+    BROKER_ATOMIC_STORE(&link->removed, 1);
+    if (BROKER_ATOMIC_LOAD(&link->blocked_publishers) != 0) {
+        if (Lock(sink->fc_lock) != LOCK_OK) {
+            LogError("Lock fc_lock in thread_message_link_retire failed.");
+        }
+        else {
+            Condition_Post(sink->fc_condition);
+            Unlock(sink->fc_lock);
+        }
+    }
+    // a waiter that misses the post sees removed within THREAD_MESSAGE_BLOCK_WAIT_MS
+    while (BROKER_ATOMIC_LOAD(&link->pins) != 0) {
+        ThreadAPI_Sleep(1);
+    }
+    thread_message_link_destroy(link);
+}
+
+static void thread_message_receiver_wakeup(THREAD_MESSAGE_HANDLING_RECEIVER* receiver)
+{
+    BROKER_ACTOR* actor = ((BROKER_MODULEINFO*)receiver->module_info)->actor;
+    if (actor != NULL) {
+        broker_actor_schedule(actor);
+    }
+    else {
+        // pairs with the fence in the receiver thread: either it sees our message or we see it waiting
+        BROKER_ATOMIC_FENCE();
+        if (BROKER_ATOMIC_LOAD(&receiver->waiting) != 0) {
+            if (Lock(receiver->lock) != LOCK_OK) {
+                LogError("Lock receiver in thread_message_receiver_wakeup failed.");
+            }
+            else {
+                Condition_Post(receiver->condition);
+                Unlock(receiver->lock);
+            }
+        }
+    }
+}
+
+/* Called with receiverContext->lock held. */
+static bool thread_message_receiver_has_pending(THREAD_MESSAGE_HANDLING_RECEIVER* receiverContext)
+{
+    bool result = false;
+    THREAD_MESSAGE_HANDLING_SENDER_FOR_RECEIVER* sender = receiverContext->senders;
+    while (sender != NULL && !result) {
+        size_t lane;
+        for (lane = 0; lane < THREAD_MESSAGE_LANE_COUNT && !result; lane++) {
+            result = BrokerQueue_Size(sender->link->lanes[lane].queue) > 0 || BROKER_ATOMIC_LOAD(&sender->link->lanes[lane].overflow_count) > 0;
+        }
+        result = result || BROKER_ATOMIC_LOAD(&sender->link->spill_count) > 0;
+        sender = sender->next;
+    }
+    return result;
+}
+
+/* Statistics for a message taken off the link by its consumer. */
+static THREAD_MESSAGE_CTRL* thread_message_link_note_taken(THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link, THREAD_MESSAGE_CTRL* msgCtrl, uint64_t now)
+{
+    broker_histogram_record(&link->queue_latency, now > msgCtrl->published_us ? now - msgCtrl->published_us : 0);
+    link->delivered++;
+    return msgCtrl;
+}
+
+/* Called by the consumer under the receiver lock for a message just taken off
+ * the link. Releases it and returns true when it outlived its own ttl or the
+ * link's, so that a backlog left by a stall is dropped in one go instead of
+ * being delivered. */
+static bool thread_message_link_discard_expired(THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link, THREAD_MESSAGE_CTRL* msgCtrl, uint64_t now)
+{
+    bool result = broker_ttl_expired(msgCtrl->ttl_us, msgCtrl->published_us, now) || broker_ttl_expired(link->ttl_us, msgCtrl->published_us, now);
+    if (result) {
+        link->expired++;
+        thread_message_ctrl_release(msgCtrl);
+    }
+    return result;
+}
+
+/* Called with receiverContext->lock held. Takes up to THREAD_MESSAGE_RECEIVE_BATCH
+ * messages from the links into batch and returns how many. Messages that
+ * waited longer than THREAD_MESSAGE_PRIORITY_AGING_US in a lower lane come
+ * first so that a flood of high priority messages cannot starve them, then
+ * the lanes are drained from the highest priority down. Within a lane the
+ * senders are served round robin, THREAD_MESSAGE_SENDER_QUANTUM messages at a
+ * time, starting with a different sender on each call, so a low-rate sender
+ * sharing the sink with a busy one waits at most one quantum per sender.
+ * A link's spilled messages are younger than anything it queues in memory,
+ * so they are read back, a quantum per sender, once its lanes are empty.
+ * Expired messages are discarded on the way. The per-link statistics are kept
+ * here because a link may be destroyed once the lock is released. */
+static size_t thread_message_receiver_take(THREAD_MESSAGE_HANDLING_RECEIVER* receiverContext, THREAD_MESSAGE_CTRL** batch)
+{
+    size_t count = 0;
+    uint64_t now = broker_clock_us();
+    THREAD_MESSAGE_HANDLING_SENDER_FOR_RECEIVER* first = receiverContext->senders;
+    THREAD_MESSAGE_HANDLING_SENDER_FOR_RECEIVER* sender;
+    THREAD_MESSAGE_CTRL* msgCtrl;
+    size_t sender_count = 0;
+    size_t visited;
+    size_t lane;
+
+    for (sender = receiverContext->senders; sender != NULL; sender = sender->next) {
+        sender_count++;
+    }
+    if (sender_count > 0) {
+        size_t skip = receiverContext->rotation++ % sender_count;
+        while (skip-- > 0) {
+            first = first->next;
+        }
+    }
+
+    // every pass visits each sender once, from first and wrapping around the list
+    for (visited = 0, sender = first; visited < sender_count; visited++, sender = (sender->next != NULL) ? sender->next : receiverContext->senders) {
+        for (lane = 0; lane + 1 < THREAD_MESSAGE_LANE_COUNT; lane++) {
+            while (count < THREAD_MESSAGE_RECEIVE_BATCH &&
+                (msgCtrl = thread_message_lane_peek(&sender->link->lanes[lane])) != NULL &&
+                now > msgCtrl->published_us && now - msgCtrl->published_us >= THREAD_MESSAGE_PRIORITY_AGING_US) {
+                msgCtrl = thread_message_link_dequeue_lane(sender->link, lane);
+                if (!thread_message_link_discard_expired(sender->link, msgCtrl, now)) {
+                    batch[count++] = thread_message_link_note_taken(sender->link, msgCtrl, now);
+                }
+            }
+        }
+    }
+    lane = THREAD_MESSAGE_LANE_COUNT;
+    while (count < THREAD_MESSAGE_RECEIVE_BATCH && lane-- > 0) {
+        bool progress = true;
+        while (progress && count < THREAD_MESSAGE_RECEIVE_BATCH) {
+            progress = false;
+            for (visited = 0, sender = first; visited < sender_count; visited++, sender = (sender->next != NULL) ? sender->next : receiverContext->senders) {
+                size_t quantum = 0;
+                while (quantum < THREAD_MESSAGE_SENDER_QUANTUM && count < THREAD_MESSAGE_RECEIVE_BATCH && (msgCtrl = thread_message_link_dequeue_lane(sender->link, lane)) != NULL) {
+                    // expired messages take no share of the quantum or the batch
+                    if (!thread_message_link_discard_expired(sender->link, msgCtrl, now)) {
+                        batch[count++] = thread_message_link_note_taken(sender->link, msgCtrl, now);
+                        quantum++;
+                    }
+                }
+                progress = progress || (quantum > 0);
+            }
+        }
+    }
+    for (visited = 0, sender = first; visited < sender_count && count < THREAD_MESSAGE_RECEIVE_BATCH; visited++, sender = (sender->next != NULL) ? sender->next : receiverContext->senders) {
+        size_t quantum = 0;
+        while (quantum < THREAD_MESSAGE_SENDER_QUANTUM && count < THREAD_MESSAGE_RECEIVE_BATCH &&
+            BROKER_ATOMIC_LOAD(&sender->link->spill_count) != 0 && BROKER_ATOMIC_LOAD(&sender->link->depth) == 0 &&
+            (msgCtrl = thread_message_link_unspill(sender->link)) != NULL) {
+            if (!thread_message_link_discard_expired(sender->link, msgCtrl, now)) {
+                batch[count++] = thread_message_link_note_taken(sender->link, msgCtrl, now);
+                quantum++;
+            }
+        }
+    }
+    return count;
+}
+
+static int thread_message_control_receiver_thread_worker(void* context)
+{
+    THREAD_MESSAGE_HANDLING_RECEIVER* receiverContext = (THREAD_MESSAGE_HANDLING_RECEIVER*)context;
+    BROKER_MODULEINFO* receiver_module_info = (BROKER_MODULEINFO*)receiverContext->module_info;
+    THREAD_MESSAGE_CTRL* batch[THREAD_MESSAGE_RECEIVE_BATCH];
+    if (Lock(receiverContext->lock) != LOCK_OK) {
+        LogError("lock for receiverContext in thread_message_control_receiver_thread_worker failed");
+    }
+    else {
+        while (true) {
+            if (!receiverContext->toContinue)
+            {
+                LogInfo("thread_message_control_receiver_thread_worker to be terminated.");
+                break;
+            }
+
+            // senders may only be walked under the lock, so messages are taken out first and delivered after unlocking
+            size_t count = thread_message_receiver_take(receiverContext, batch);
+
+            if (count == 0) {
+                BROKER_ATOMIC_STORE(&receiverContext->waiting, 1);
+                BROKER_ATOMIC_FENCE();
+                if (receiverContext->toContinue && !thread_message_receiver_has_pending(receiverContext)) {
+                    if (Condition_Wait(receiverContext->condition, receiverContext->lock, 0) != COND_OK) {
+                        LogError("Wait for condition for receiverContext in thread_message_control_receiver_thread_worker failed");
+                    }
+                }
+                BROKER_ATOMIC_STORE(&receiverContext->waiting, 0);
+            }
+            else {
+                Unlock(receiverContext->lock);
+                // the whole batch is delivered without touching the lock or yielding
+                for (size_t i = 0; i < count; i++) {
+                    module_receive_measured(receiver_module_info, &receiver_module_info->thread_receive, batch[i]->msg, batch[i]->published_us);
+                    thread_message_ctrl_release(batch[i]);
+                }
+                Lock(receiverContext->lock);
+            }
+        }
+        LOCK_RESULT lock_result = Unlock(receiverContext->lock);
+        if (lock_result != LOCK_OK) {
+            LogError("Unlock for receiverContext in thread_message_control_receiver_thread_worker failed");
+        }
+    }
+    Condition_Deinit(receiverContext->condition);
+    if (Lock_Deinit(receiverContext->lock) != LOCK_OK) {
+        LogError("Deinit for receiverContext in thread_message_control_receiver_thread_worker failed");
+    }
+
+    BrokerSlab_ReleaseThreadCaches();
+    return 0;
+}
+
+/* Called only by the dispatcher thread. Returns false when the mailbox is full. */
+static bool broker_actor_post(BROKER_ACTOR* actor, unsigned char* buf, int nbytes)
+{
+    bool result;
+    size_t tail = actor->mailbox_tail;
+    if (tail - BROKER_ATOMIC_LOAD(&actor->mailbox_head) == BROKER_ACTOR_MAILBOX_SIZE)
+    {
+        result = false;
+    }
+    else
+    {
+        actor->mailbox[tail & (BROKER_ACTOR_MAILBOX_SIZE - 1)] = buf;
+        actor->mailbox_sizes[tail & (BROKER_ACTOR_MAILBOX_SIZE - 1)] = nbytes;
+        BROKER_ATOMIC_STORE(&actor->mailbox_tail, tail + 1);
+        result = true;
+    }
+    return result;
+}
+
+/* Called only by the running actor. */
+static bool broker_actor_has_work(BROKER_ACTOR* actor)
+{
+    THREAD_MESSAGE_HANDLING_RECEIVER* receiver = actor->module_info->receiverThMsg;
+    bool result = actor->mailbox_head != BROKER_ATOMIC_LOAD(&actor->mailbox_tail);
+    if (!result && receiver != NULL)
+    {
+        if (Lock(receiver->lock) != LOCK_OK)
+        {
+            LogError("Lock receiver in broker_actor_has_work failed.");
+        }
+        else
+        {
+            result = thread_message_receiver_has_pending(receiver);
+            Unlock(receiver->lock);
+        }
+    }
+    return result;
+}
+
+static void broker_actor_run(void* context);
+
+/* The caller owns the scheduled flag. */
+static void broker_actor_submit(BROKER_ACTOR* actor)
+{
+    if (BrokerPool_Submit(actor->pool, broker_actor_run, actor) != 0)
+    {
+        /* the next publish or frame for this module schedules it again */
+        LogError("unable to schedule module [%p]", actor->module_info->module->module_handle);
+        BROKER_ATOMIC_STORE(&actor->scheduled, 0);
+    }
+}
+
+static void broker_actor_schedule(BROKER_ACTOR* actor)
+{
+    if (BROKER_ATOMIC_CAS(&actor->scheduled, 0, 1))
+    {
+        broker_actor_submit(actor);
+    }
+}
+
+/* Delivers one bounded batch from the mailbox and one from the thread-message
+ * links, then resubmits itself behind the other actors if work is left. */
+static void broker_actor_run(void* context)
+{
+    BROKER_ACTOR* actor = (BROKER_ACTOR*)context;
+    BROKER_MODULEINFO* module_info = actor->module_info;
+    THREAD_MESSAGE_HANDLING_RECEIVER* receiver = module_info->receiverThMsg;
+    THREAD_MESSAGE_CTRL* batch[THREAD_MESSAGE_RECEIVE_BATCH];
+    size_t head = actor->mailbox_head;
+    size_t count = 0;
+    size_t i;
+
+    (void)BROKER_ATOMIC_ADD(&actor->running, 1);
+
+    while (count < THREAD_MESSAGE_RECEIVE_BATCH && head != BROKER_ATOMIC_LOAD(&actor->mailbox_tail))
+    {
+        unsigned char* buf = actor->mailbox[head & (BROKER_ACTOR_MAILBOX_SIZE - 1)];
+        int nbytes = actor->mailbox_sizes[head & (BROKER_ACTOR_MAILBOX_SIZE - 1)];
+        BROKER_ATOMIC_STORE(&actor->mailbox_head, ++head);
+        module_deliver_received(module_info, buf, nbytes);
+        count++;
+    }
+
+    if (receiver != NULL)
+    {
+        count = 0;
+        if (Lock(receiver->lock) != LOCK_OK)
+        {
+            LogError("Lock receiver in broker_actor_run failed.");
+        }
+        else
+        {
+            count = thread_message_receiver_take(receiver, batch);
+            Unlock(receiver->lock);
+        }
+        for (i = 0; i < count; i++)
+        {
+            module_receive_measured(module_info, &module_info->thread_receive, batch[i]->msg, batch[i]->published_us);
+            thread_message_ctrl_release(batch[i]);
+        }
+    }
+
+    if (broker_actor_has_work(actor))
+    {
+        broker_actor_submit(actor);
+    }
+    else
+    {
+        // pairs with the CAS in broker_actor_schedule: either the publisher sees the flag cleared or we see its message
+        BROKER_ATOMIC_STORE(&actor->scheduled, 0);
+        BROKER_ATOMIC_FENCE();
+        if (broker_actor_has_work(actor) && BROKER_ATOMIC_CAS(&actor->scheduled, 0, 1))
+        {
+            broker_actor_submit(actor);
+        }
+    }
+
+    // last access to the actor, see broker_actor_stop
+    (void)BROKER_ATOMIC_SUB(&actor->running, 1);
+}
+
+static void broker_dispatcher_wake(BROKER_DISPATCHER* dispatcher)
+{
+#ifdef BROKER_DISPATCHER_EPOLL
+    if (eventfd_write(dispatcher->event_fd, 1) != 0)
+#else
+    if (nn_really_send(dispatcher->publish_socket, STRING_c_str(dispatcher->wake_guid), BROKER_GUID_SIZE, 0) < 0)
+#endif
+    {
+        LogError("unable to wake the broker dispatcher");
+    }
+}
+
+/* Moves the frames waiting on the module's socket into its mailbox. A frame
+ * that does not fit is parked and retried on the next pass, leaving the rest
+ * in the socket. */
+static void broker_dispatcher_read(BROKER_MODULEINFO* module_info, bool readable)
+{
+    BROKER_ACTOR* actor = module_info->actor;
+    size_t queued = 0;
+
+    if (actor->pending != NULL && broker_actor_post(actor, actor->pending, actor->pending_size))
+    {
+        actor->pending = NULL;
+        queued++;
+    }
+    while (readable && actor->pending == NULL && queued < BROKER_ACTOR_MAILBOX_SIZE)
+    {
+        unsigned char* buf = NULL;
+        int nbytes = nn_recv(module_info->receive_socket, (void*)&buf, NN_MSG, NN_DONTWAIT);
+        if (nbytes < 0)
+        {
+            break;
+        }
+        else if (broker_actor_post(actor, buf, nbytes))
+        {
+            queued++;
+        }
+        else
+        {
+            actor->pending = buf;
+            actor->pending_size = nbytes;
+        }
+    }
+
+    if (queued > 0)
+    {
+        broker_actor_schedule(actor);
+    }
+}
+
+#ifdef BROKER_DISPATCHER_EPOLL
+/* Called with the dispatcher lock held. */
+static int broker_dispatcher_watch(BROKER_DISPATCHER* dispatcher, BROKER_MODULEINFO* module_info)
+{
+    int result;
+    size_t fd_size = sizeof(module_info->actor->receive_fd);
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = module_info;
+    module_info->actor->parked = false;
+    module_info->actor->parked_next = NULL;
+    if (nn_getsockopt(module_info->receive_socket, NN_SOL_SOCKET, NN_RCVFD, &module_info->actor->receive_fd, &fd_size) < 0)
+    {
+        LogError("unable to get NN_RCVFD of module [%p]", module_info);
+        result = __LINE__;
+    }
+    else if (epoll_ctl(dispatcher->epoll_fd, EPOLL_CTL_ADD, module_info->actor->receive_fd, &event) != 0)
+    {
+        LogError("epoll_ctl ADD failed with %d", errno);
+        result = __LINE__;
+    }
+    else
+    {
+        result = 0;
+    }
+    return result;
+}
+
+/* Called with the dispatcher lock held, before the socket is closed. */
+static void broker_dispatcher_unwatch(BROKER_DISPATCHER* dispatcher, BROKER_MODULEINFO* module_info)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    if (epoll_ctl(dispatcher->epoll_fd, EPOLL_CTL_DEL, module_info->actor->receive_fd, &event) != 0)
+    {
+        LogError("epoll_ctl DEL failed with %d", errno);
+    }
+}
+
+/* Level triggered: a socket left with frames is reported again by the next
+ * epoll_wait. A module whose actor has a frame parked is taken out of the
+ * set until the frame fits, so that it does not spin the loop. */
+static void broker_dispatcher_park(BROKER_DISPATCHER* dispatcher, BROKER_MODULEINFO* module_info, bool parked)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = parked ? 0 : EPOLLIN;
+    event.data.ptr = module_info;
+    /* a module being removed is already out of the set */
+    if (epoll_ctl(dispatcher->epoll_fd, EPOLL_CTL_MOD, module_info->actor->receive_fd, &event) != 0 && errno != ENOENT)
+    {
+        LogError("epoll_ctl MOD failed with %d", errno);
+    }
+    module_info->actor->parked = parked;
+}
+
+static int broker_dispatcher_worker(void* context)
+{
+    BROKER_DISPATCHER* dispatcher = (BROKER_DISPATCHER*)context;
+    struct epoll_event events[BROKER_DISPATCHER_EVENTS];
+    BROKER_ACTOR* parked = NULL;
+    size_t generation = 0;
+    bool running = true;
+
+    while (running)
+    {
+        if (Lock(dispatcher->lock) != LOCK_OK)
+        {
+            LogError("Lock dispatcher in broker_dispatcher_worker failed.");
+            break;
+        }
+        if (dispatcher->stop)
+        {
+            running = false;
+        }
+        else if (dispatcher->generation != generation)
+        {
+            /* removed modules are out of the epoll set already, only the parked list may still hold them */
+            BROKER_ACTOR** next = &parked;
+            while (*next != NULL)
+            {
+                size_t i = 0;
+                while (i < dispatcher->count && dispatcher->modules[i]->actor != *next)
+                {
+                    i++;
+                }
+                if (i == dispatcher->count)
+                {
+                    *next = (*next)->parked_next;
+                }
+                else
+                {
+                    next = &(*next)->parked_next;
+                }
+            }
+            generation = dispatcher->generation;
+            dispatcher->seen = generation;
+            Condition_Post(dispatcher->condition);
+        }
+        Unlock(dispatcher->lock);
+
+        if (running)
+        {
+            /* a parked frame waits on its actor, not on the socket, so it is retried soon */
+            int ready = epoll_wait(dispatcher->epoll_fd, events, BROKER_DISPATCHER_EVENTS, (parked != NULL) ? 1 : BROKER_DISPATCHER_POLL_MS);
+            if (ready < 0 && errno != EINTR)
+            {
+                LogError("epoll_wait failed with %d", errno);
+                ThreadAPI_Sleep(1);
+            }
+            else
+            {
+                BROKER_ACTOR** next = &parked;
+                int i;
+                for (i = 0; i < ready; i++)
+                {
+                    BROKER_MODULEINFO* module_info = (BROKER_MODULEINFO*)events[i].data.ptr;
+                    if (module_info == NULL)
+                    {
+                        eventfd_t value;
+                        (void)eventfd_read(dispatcher->event_fd, &value);
+                    }
+                    else if (!module_info->actor->parked)
+                    {
+                        broker_dispatcher_read(module_info, true);
+                        if (module_info->actor->pending != NULL)
+                        {
+                            broker_dispatcher_park(dispatcher, module_info, true);
+                            module_info->actor->parked_next = parked;
+                            parked = module_info->actor;
+                        }
+                    }
+                }
+                while (*next != NULL)
+                {
+                    BROKER_ACTOR* actor = *next;
+                    broker_dispatcher_read(actor->module_info, false);
+                    if (actor->pending == NULL)
+                    {
+                        broker_dispatcher_park(dispatcher, actor->module_info, false);
+                        *next = actor->parked_next;
+                    }
+                    else
+                    {
+                        next = &actor->parked_next;
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
+#else
+static int broker_dispatcher_watch(BROKER_DISPATCHER* dispatcher, BROKER_MODULEINFO* module_info)
+{
+    /* the worker builds its nn_poll set from the module list */
+    (void)dispatcher;
+    (void)module_info;
+    return 0;
+}
+
+static void broker_dispatcher_unwatch(BROKER_DISPATCHER* dispatcher, BROKER_MODULEINFO* module_info)
+{
+    (void)dispatcher;
+    (void)module_info;
+}
+
+static int broker_dispatcher_worker(void* context)
+{
+    BROKER_DISPATCHER* dispatcher = (BROKER_DISPATCHER*)context;
+    BROKER_MODULEINFO** modules = NULL;
+    struct nn_pollfd* fds = (struct nn_pollfd*)malloc(sizeof(struct nn_pollfd));
+    size_t count = 0;
+    size_t allocated = 0;
+    size_t generation = 0;
+    bool running = (fds != NULL);
+
+    if (fds == NULL)
+    {
+        LogError("malloc of poll set failed");
+    }
+    while (running)
+    {
+        bool any_pending = false;
+        size_t i;
+
+        if (Lock(dispatcher->lock) != LOCK_OK)
+        {
+            LogError("Lock dispatcher in broker_dispatcher_worker failed.");
+            break;
+        }
+        if (dispatcher->stop)
+        {
+            running = false;
+        }
+        else if (dispatcher->generation != generation)
+        {
+            if (dispatcher->count > allocated)
+            {
+                BROKER_MODULEINFO** new_modules = (BROKER_MODULEINFO**)realloc(modules, dispatcher->count * sizeof(BROKER_MODULEINFO*));
+                struct nn_pollfd* new_fds = (new_modules == NULL) ? NULL : (struct nn_pollfd*)realloc(fds, (dispatcher->count + 1) * sizeof(struct nn_pollfd));
+                if (new_modules != NULL)
+                {
+                    modules = new_modules;
+                }
+                if (new_fds != NULL)
+                {
+                    fds = new_fds;
+                    allocated = dispatcher->count;
+                }
+            }
+            if (dispatcher->count > allocated)
+            {
+                /* keep polling the old set, the change is acknowledged once it fits */
+                LogError("unable to grow the dispatcher poll set");
+            }
+            else
+            {
+                count = dispatcher->count;
+                for (i = 0; i < count; i++)
+                {
+                    modules[i] = dispatcher->modules[i];
+                }
+                generation = dispatcher->generation;
+                dispatcher->seen = generation;
+                Condition_Post(dispatcher->condition);
+            }
+        }
+        Unlock(dispatcher->lock);
+
+        if (running)
+        {
+            int timeout;
+            for (i = 0; i < count; i++)
+            {
+                fds[i].fd = modules[i]->receive_socket;
+                fds[i].events = (modules[i]->actor->pending == NULL) ? NN_POLLIN : 0;
+                fds[i].revents = 0;
+                any_pending = any_pending || (modules[i]->actor->pending != NULL);
+            }
+            fds[count].fd = dispatcher->wake_socket;
+            fds[count].events = NN_POLLIN;
+            fds[count].revents = 0;
+
+            /* a parked frame waits on its actor, not on the socket, so it is retried soon */
+            timeout = any_pending ? 1 : BROKER_DISPATCHER_POLL_MS;
+            if (nn_poll(fds, (int)count + 1, timeout) < 0 && nn_errno() != EINTR)
+            {
+                LogError("nn_poll failed with %d", nn_errno());
+                ThreadAPI_Sleep(1);
+            }
+            else
+            {
+                if ((fds[count].revents & NN_POLLIN) != 0)
+                {
+                    unsigned char* buf = NULL;
+                    while (nn_recv(dispatcher->wake_socket, (void*)&buf, NN_MSG, NN_DONTWAIT) >= 0)
+                    {
+                        nn_freemsg(buf);
+                    }
+                }
+                for (i = 0; i < count; i++)
+                {
+                    if (modules[i]->actor->pending != NULL || (fds[i].revents & NN_POLLIN) != 0)
+                    {
+                        broker_dispatcher_read(modules[i], (fds[i].revents & NN_POLLIN) != 0);
+                    }
+                }
+            }
+        }
+    }
+
+    free(modules);
+    free(fds);
+    return 0;
+}
+#endif
+
+/* Called with modules_lock held. */
+static int broker_dispatcher_add(BROKER_DISPATCHER* dispatcher, BROKER_MODULEINFO* module_info)
+{
+    int result;
+    if (Lock(dispatcher->lock) != LOCK_OK)
+    {
+        LogError("Lock dispatcher in broker_dispatcher_add failed.");
+        result = __LINE__;
+    }
+    else
+    {
+        if (dispatcher->count == dispatcher->capacity)
+        {
+            size_t capacity = (dispatcher->capacity == 0) ? 8 : 2 * dispatcher->capacity;
+            BROKER_MODULEINFO** modules = (BROKER_MODULEINFO**)realloc(dispatcher->modules, capacity * sizeof(BROKER_MODULEINFO*));
+            if (modules != NULL)
+            {
+                dispatcher->modules = modules;
+                dispatcher->capacity = capacity;
+            }
+        }
+
+        if (dispatcher->count == dispatcher->capacity)
+        {
+            LogError("unable to grow the dispatcher module set");
+            result = __LINE__;
+        }
+        else if (broker_dispatcher_watch(dispatcher, module_info) != 0)
+        {
+            result = __LINE__;
+        }
+        else
+        {
+            dispatcher->modules[dispatcher->count++] = module_info;
+            dispatcher->generation++;
+            broker_dispatcher_wake(dispatcher);
+            result = 0;
+        }
+        Unlock(dispatcher->lock);
+    }
+    return result;
+}
+
+/* Called with modules_lock held. Returns once the dispatcher no longer polls
+ * the module's socket. */
+static int broker_dispatcher_remove(BROKER_DISPATCHER* dispatcher, BROKER_MODULEINFO* module_info)
+{
+    int result;
+    if (Lock(dispatcher->lock) != LOCK_OK)
+    {
+        LogError("Lock dispatcher in broker_dispatcher_remove failed.");
+        result = __LINE__;
+    }
+    else
+    {
+        size_t i = 0;
+        while (i < dispatcher->count && dispatcher->modules[i] != module_info)
+        {
+            i++;
+        }
+        if (i < dispatcher->count)
+        {
+            size_t generation;
+            broker_dispatcher_unwatch(dispatcher, module_info);
+            for (; i + 1 < dispatcher->count; i++)
+            {
+                dispatcher->modules[i] = dispatcher->modules[i + 1];
+            }
+            dispatcher->count--;
+            generation = ++dispatcher->generation;
+            broker_dispatcher_wake(dispatcher);
+            while (dispatcher->seen < generation && !dispatcher->stop)
+            {
+                (void)Condition_Wait(dispatcher->condition, dispatcher->lock, BROKER_DISPATCHER_POLL_MS);
+            }
+        }
+        result = 0;
+        Unlock(dispatcher->lock);
+    }
+    return result;
+}
+
+static BROKER_RESULT broker_actor_start(BROKER_HANDLE_DATA* broker_data, BROKER_MODULEINFO* module_info)
+{
+    BROKER_RESULT result;
+    BROKER_ACTOR* actor = (BROKER_ACTOR*)malloc(sizeof(BROKER_ACTOR));
+    if (actor == NULL)
+    {
+        LogError("malloc of BROKER_ACTOR failed");
+        result = BROKER_ERROR;
+    }
+    else
+    {
+        actor->pool = broker_data->pool;
+        actor->module_info = module_info;
+        actor->scheduled = 0;
+        actor->running = 0;
+        actor->mailbox_head = 0;
+        actor->mailbox_tail = 0;
+        actor->pending = NULL;
+        actor->pending_size = 0;
+        module_info->actor = actor;
+        if (broker_dispatcher_add(broker_data->dispatcher, module_info) != 0)
+        {
+            module_info->actor = NULL;
+            free(actor);
+            result = BROKER_ERROR;
+        }
+        else
+        {
+            result = BROKER_OK;
+        }
+    }
+    return result;
+}
+
+/* Stops feeding the actor, closes the module's socket and waits until no
+ * worker runs the actor any more. Frames not yet delivered are dropped, like
+ * the messages left in a stopped module_worker's socket. */
+static int broker_actor_stop(BROKER_HANDLE_DATA* broker_data, BROKER_MODULEINFO* module_info)
+{
+    int result;
+    BROKER_ACTOR* actor = module_info->actor;
+
+    if (broker_dispatcher_remove(broker_data->dispatcher, module_info) != 0)
+    {
+        LogError("unable to remove module [%p] from the dispatcher", module_info);
+        result = __LINE__;
+    }
+    else
+    {
+        if (nn_really_close(module_info->receive_socket) < 0)
+        {
+            LogError("Receive socket close failed for module at  item [%p] failed", module_info);
+        }
+
+        /* publishers left the routing before this, so only the actor itself can still schedule the actor */
+        while (BROKER_ATOMIC_LOAD(&actor->running) != 0 || BROKER_ATOMIC_LOAD(&actor->scheduled) != 0)
+        {
+            ThreadAPI_Sleep(1);
+        }
+
+        while (actor->mailbox_head != actor->mailbox_tail)
+        {
+            nn_freemsg(actor->mailbox[actor->mailbox_head++ & (BROKER_ACTOR_MAILBOX_SIZE - 1)]);
+        }
+        if (actor->pending != NULL)
+        {
+            nn_freemsg(actor->pending);
+            actor->pending = NULL;
+        }
+        result = 0;
+    }
+    return result;
+}
+
+#ifdef BROKER_DISPATCHER_EPOLL
+static int broker_dispatcher_open_wake(BROKER_DISPATCHER* dispatcher, BROKER_HANDLE_DATA* broker_data)
+{
+    int result;
+    struct epoll_event event;
+    (void)broker_data;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if ((dispatcher->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+        LogError("epoll_create1 failed with %d", errno);
+        result = __LINE__;
+    }
+    else if ((dispatcher->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    {
+        LogError("eventfd failed with %d", errno);
+        (void)close(dispatcher->epoll_fd);
+        result = __LINE__;
+    }
+    else if (epoll_ctl(dispatcher->epoll_fd, EPOLL_CTL_ADD, dispatcher->event_fd, &event) != 0)
+    {
+        LogError("epoll_ctl ADD of the dispatcher eventfd failed with %d", errno);
+        (void)close(dispatcher->event_fd);
+        (void)close(dispatcher->epoll_fd);
+        result = __LINE__;
+    }
+    else
+    {
+        result = 0;
+    }
+    return result;
+}
+
+static void broker_dispatcher_close_wake(BROKER_DISPATCHER* dispatcher)
+{
+    (void)close(dispatcher->event_fd);
+    (void)close(dispatcher->epoll_fd);
+}
+#else
+static int broker_dispatcher_open_wake(BROKER_DISPATCHER* dispatcher, BROKER_HANDLE_DATA* broker_data)
+{
+    int result;
+    char uuid[BROKER_GUID_SIZE];
+    memset(uuid, 0, BROKER_GUID_SIZE);
+    if (UniqueId_Generate(uuid, BROKER_GUID_SIZE) != UNIQUEID_OK ||
+        (dispatcher->wake_guid = STRING_construct(uuid)) == NULL)
+    {
+        LogError("unable to create the dispatcher wake id");
+        result = __LINE__;
+    }
+    else if ((dispatcher->wake_socket = nn_socket(AF_SP, NN_SUB)) < 0)
+    {
+        LogError("dispatcher wake socket create failed");
+        STRING_delete(dispatcher->wake_guid);
+        result = __LINE__;
+    }
+    else if (nn_connect(dispatcher->wake_socket, STRING_c_str(broker_data->url)) < 0 ||
+        nn_setsockopt(dispatcher->wake_socket, NN_SUB, NN_SUB_SUBSCRIBE, STRING_c_str(dispatcher->wake_guid), STRING_length(dispatcher->wake_guid)) < 0)
+    {
+        LogError("unable to subscribe the dispatcher wake socket");
+        nn_really_close(dispatcher->wake_socket);
+        STRING_delete(dispatcher->wake_guid);
+        result = __LINE__;
+    }
+    else
+    {
+        dispatcher->publish_socket = broker_data->publish_socket;
+        result = 0;
+    }
+    return result;
+}
+
+static void broker_dispatcher_close_wake(BROKER_DISPATCHER* dispatcher)
+{
+    nn_really_close(dispatcher->wake_socket);
+    STRING_delete(dispatcher->wake_guid);
+}
+#endif
+
+static BROKER_DISPATCHER* broker_dispatcher_create(BROKER_HANDLE_DATA* broker_data)
+{
+    BROKER_DISPATCHER* result = (BROKER_DISPATCHER*)malloc(sizeof(BROKER_DISPATCHER));
+    if (result == NULL)
+    {
+        LogError("malloc of BROKER_DISPATCHER failed");
+    }
+    else if ((result->lock = Lock_Init()) == NULL)
+    {
+        LogError("Lock_Init failed");
+        free(result);
+        result = NULL;
+    }
+    else if ((result->condition = Condition_Init()) == NULL)
+    {
+        LogError("Condition_Init failed");
+        Lock_Deinit(result->lock);
+        free(result);
+        result = NULL;
+    }
+    else if (broker_dispatcher_open_wake(result, broker_data) != 0)
+    {
+        Condition_Deinit(result->condition);
+        Lock_Deinit(result->lock);
+        free(result);
+        result = NULL;
+    }
+    else
+    {
+        result->stop = false;
+        result->modules = NULL;
+        result->count = 0;
+        result->capacity = 0;
+        result->generation = 0;
+        result->seen = 0;
+        if (ThreadAPI_Create(&result->thread, broker_dispatcher_worker, result) != THREADAPI_OK)
+        {
+            LogError("unable to start the dispatcher thread");
+            broker_dispatcher_close_wake(result);
+            Condition_Deinit(result->condition);
+            Lock_Deinit(result->lock);
+            free(result);
+            result = NULL;
+        }
+    }
+    return result;
+}
+
+static void broker_dispatcher_destroy(BROKER_DISPATCHER* dispatcher)
+{
+    int thread_result;
+    if (Lock(dispatcher->lock) != LOCK_OK)
+    {
+        LogError("Lock dispatcher in broker_dispatcher_destroy failed.");
+    }
+    else
+    {
+        dispatcher->stop = true;
+        broker_dispatcher_wake(dispatcher);
+        Unlock(dispatcher->lock);
+    }
+    if (ThreadAPI_Join(dispatcher->thread, &thread_result) != THREADAPI_OK)
+    {
+        LogError("ThreadAPI_Join() returned an error.");
+    }
+    broker_dispatcher_close_wake(dispatcher);
+    Condition_Deinit(dispatcher->condition);
+    Lock_Deinit(dispatcher->lock);
+    free(dispatcher->modules);
+    free(dispatcher);
+}
+
+/* BROKER_SCHEDULER_POOL: returns 0 if the pool and the dispatcher run, otherwise __LINE__ */
+static int broker_scheduler_start(BROKER_HANDLE_DATA* broker_data, size_t worker_count)
+{
+    int result;
+    broker_data->pool = BrokerPool_Create(worker_count);
+    if (broker_data->pool == NULL)
+    {
+        LogError("unable to create the worker pool");
+        result = __LINE__;
+    }
+    else
+    {
+        broker_data->dispatcher = broker_dispatcher_create(broker_data);
+        if (broker_data->dispatcher == NULL)
+        {
+            BrokerPool_Destroy(broker_data->pool);
+            broker_data->pool = NULL;
+            result = __LINE__;
+        }
+        else
+        {
+            result = 0;
+        }
+    }
+    return result;
+}
+
+static void broker_scheduler_stop(BROKER_HANDLE_DATA* broker_data)
+{
+    if (broker_data->dispatcher != NULL)
+    {
+        broker_dispatcher_destroy(broker_data->dispatcher);
+        broker_data->dispatcher = NULL;
+    }
+    if (broker_data->pool != NULL)
+    {
+        BrokerPool_Destroy(broker_data->pool);
+        broker_data->pool = NULL;
+    }
+}
+
+/* Checks the Receive durations of every module each interval_ms. */
+typedef struct BROKER_WATCHDOG_TAG
+{
+    LOCK_HANDLE lock;
+    COND_HANDLE condition;
+    THREAD_HANDLE thread;
+    bool stop;
+    BROKER_HANDLE_DATA* broker_data;
+    uint64_t threshold_us;
+    size_t interval_ms;
+    BROKER_SLOW_MODULE_CALLBACK callback;
+    void* context;
+} BROKER_WATCHDOG;
+
+/* A change of the slow flag of a module, reported once modules_lock is left. */
+typedef struct BROKER_WATCHDOG_REPORT_TAG
+{
+    MODULE_HANDLE module;
+    bool slow;
+    uint64_t receive_us;
+} BROKER_WATCHDOG_REPORT;
+
+/* How long the Receive running on a path has taken so far, 0 when none is. */
+static uint64_t broker_watchdog_running_us(const BROKER_RECEIVE_STATISTICS* statistics, size_t now)
+{
+    size_t started = BROKER_ATOMIC_LOAD(&statistics->started_us);
+    return (started == 0) ? 0 : (uint64_t)(now - started);
+}
+
+/* Updates the slow flag of the module from the durations recorded since the
+ * last check and returns true when it changed. Called with modules_lock held. */
+static bool broker_watchdog_check_module(const BROKER_WATCHDOG* watchdog, BROKER_MODULEINFO* module_info, uint64_t* receive_us)
+{
+    bool result = false;
+    BROKER_LATENCY_HISTOGRAM durations;
+    BROKER_LATENCY_HISTOGRAM window;
+    size_t now = (size_t)broker_clock_us();
+    uint64_t running_us = broker_watchdog_running_us(&module_info->default_receive, now);
+    size_t i;
+
+    if (broker_watchdog_running_us(&module_info->thread_receive, now) > running_us)
+    {
+        running_us = broker_watchdog_running_us(&module_info->thread_receive, now);
+    }
+    if (broker_watchdog_running_us(&module_info->direct_receive, now) > running_us)
+    {
+        running_us = broker_watchdog_running_us(&module_info->direct_receive, now);
+    }
+
+    /* the histograms only grow, so the last interval is their difference with what was seen */
+    memset(&durations, 0, sizeof(durations));
+    broker_histogram_add(&durations, &module_info->default_receive.duration);
+    broker_histogram_add(&durations, &module_info->thread_receive.duration);
+    broker_histogram_add(&durations, &module_info->direct_receive.duration);
+    window = durations;
+    for (i = 0; i < BROKER_LATENCY_HISTOGRAM_BUCKETS; i++)
+    {
+        window.counts[i] -= module_info->watchdog_seen.counts[i];
+    }
+    window.count -= module_info->watchdog_seen.count;
+    module_info->watchdog_seen = durations;
+
+    *receive_us = Broker_LatencyHistogramPercentile(&window, 99);
+    if (running_us > *receive_us)
+    {
+        *receive_us = running_us;
+    }
+    /* an idle module keeps its flag until it receives again */
+    if (window.count != 0 || running_us != 0)
+    {
+        bool slow = (*receive_us > watchdog->threshold_us);
+        result = (slow != module_info->slow);
+        module_info->slow = slow;
+    }
+    return result;
+}
+
+static void broker_watchdog_check(BROKER_WATCHDOG* watchdog)
+{
+    BROKER_HANDLE_DATA* broker_data = watchdog->broker_data;
+    BROKER_WATCHDOG_REPORT* reports = NULL;
+    size_t report_count = 0;
+    if (Lock(broker_data->modules_lock) != LOCK_OK)
+    {
+        LogError("Lock on broker_data->modules_lock in broker_watchdog_check failed");
+    }
+    else
+    {
+        LIST_ITEM_HANDLE item;
+        size_t module_count = 0;
+        for (item = singlylinkedlist_get_head_item(broker_data->modules); item != NULL; item = singlylinkedlist_get_next_item(item))
+        {
+            module_count++;
+        }
+        reports = (BROKER_WATCHDOG_REPORT*)malloc((module_count + 1) * sizeof(BROKER_WATCHDOG_REPORT));
+        if (reports == NULL)
+        {
+            LogError("malloc of watchdog reports failed");
+        }
+        else
+        {
+            for (item = singlylinkedlist_get_head_item(broker_data->modules); item != NULL; item = singlylinkedlist_get_next_item(item))
+            {
+                BROKER_MODULEINFO* module_info = (BROKER_MODULEINFO*)singlylinkedlist_item_get_value(item);
+                uint64_t receive_us;
+                if (broker_watchdog_check_module(watchdog, module_info, &receive_us))
+                {
+                    reports[report_count].module = module_info->module->module_handle;
+                    reports[report_count].slow = module_info->slow;
+                    reports[report_count].receive_us = receive_us;
+                    report_count++;
+                }
+            }
+        }
+        Unlock(broker_data->modules_lock);
+    }
+
+    /* the callback may call back into the broker, so it runs without modules_lock */
+    for (size_t i = 0; i < report_count; i++)
+    {
+        if (reports[i].slow)
+        {
+            LogError("module [%p] is a slow consumer: Receive takes %llu us, above %llu us", reports[i].module, (unsigned long long)reports[i].receive_us, (unsigned long long)watchdog->threshold_us);
+        }
+        else
+        {
+            LogInfo("module [%p] is no longer a slow consumer: Receive takes %llu us", reports[i].module, (unsigned long long)reports[i].receive_us);
+        }
+        if (watchdog->callback != NULL)
+        {
+            watchdog->callback((BROKER_HANDLE)broker_data, reports[i].module, reports[i].slow, reports[i].receive_us, watchdog->context);
+        }
+    }
+    free(reports);
+}
+
+static int broker_watchdog_worker(void* context)
+{
+    BROKER_WATCHDOG* watchdog = (BROKER_WATCHDOG*)context;
+    if (Lock(watchdog->lock) != LOCK_OK)
+    {
+        LogError("Lock watchdog in broker_watchdog_worker failed.");
+    }
+    else
+    {
+        while (!watchdog->stop)
+        {
+            (void)Condition_Wait(watchdog->condition, watchdog->lock, (int)watchdog->interval_ms);
+            if (!watchdog->stop)
+            {
+                Unlock(watchdog->lock);
+                broker_watchdog_check(watchdog);
+                Lock(watchdog->lock);
+            }
+        }
+        Unlock(watchdog->lock);
+    }
+    return 0;
+}
+
+/* returns 0 if the watchdog runs, otherwise __LINE__ */
+static int broker_watchdog_start(BROKER_HANDLE_DATA* broker_data, const BROKER_CONFIG* config)
+{
+    int result;
+    BROKER_WATCHDOG* watchdog = (BROKER_WATCHDOG*)malloc(sizeof(BROKER_WATCHDOG));
+    if (watchdog == NULL)
+    {
+        LogError("malloc of BROKER_WATCHDOG failed");
+        result = __LINE__;
+    }
+    else if ((watchdog->lock = Lock_Init()) == NULL)
+    {
+        LogError("Lock_Init failed");
+        free(watchdog);
+        result = __LINE__;
+    }
+    else if ((watchdog->condition = Condition_Init()) == NULL)
+    {
+        LogError("Condition_Init failed");
+        Lock_Deinit(watchdog->lock);
+        free(watchdog);
+        result = __LINE__;
+    }
+    else
+    {
+        watchdog->stop = false;
+        watchdog->broker_data = broker_data;
+        watchdog->threshold_us = config->slow_receive_us;
+        watchdog->interval_ms = (config->watchdog_interval_ms != 0) ? config->watchdog_interval_ms : BROKER_WATCHDOG_INTERVAL_MS;
+        watchdog->callback = config->on_slow_module;
+        watchdog->context = config->on_slow_module_context;
+        if (ThreadAPI_Create(&watchdog->thread, broker_watchdog_worker, watchdog) != THREADAPI_OK)
+        {
+            LogError("unable to start the watchdog thread");
+            Condition_Deinit(watchdog->condition);
+            Lock_Deinit(watchdog->lock);
+            free(watchdog);
+            result = __LINE__;
+        }
+        else
+        {
+            broker_data->watchdog = watchdog;
+            result = 0;
+        }
+    }
+    return result;
+}
+
+static void broker_watchdog_stop(BROKER_HANDLE_DATA* broker_data)
+{
+    BROKER_WATCHDOG* watchdog = broker_data->watchdog;
+    if (watchdog != NULL)
+    {
+        int thread_result;
+        if (Lock(watchdog->lock) != LOCK_OK)
+        {
+            LogError("Lock watchdog in broker_watchdog_stop failed.");
+        }
+        else
+        {
+            watchdog->stop = true;
+            Condition_Post(watchdog->condition);
+            Unlock(watchdog->lock);
+        }
+        if (ThreadAPI_Join(watchdog->thread, &thread_result) != THREADAPI_OK)
+        {
+            LogError("ThreadAPI_Join() returned an error.");
+        }
+        Condition_Deinit(watchdog->condition);
+        Lock_Deinit(watchdog->lock);
+        free(watchdog);
+        broker_data->watchdog = NULL;
+    }
+}
+
+BROKER_RESULT Broker_AddLink(BROKER_HANDLE broker, const BROKER_LINK_DATA* link)
+{
+    BROKER_RESULT result;
+    /* owned here until a link takes it */
+    BROKER_PREDICATE_HANDLE predicate = NULL;
+    /*Codes_SRS_BROKER_17_029: [ If broker or link are NULL, Broker_AddLink shall return BROKER_INVALIDARG. ]*/
+    if (broker == NULL || link == NULL || link->module_sink_handle == NULL || link->module_source_handle == NULL)
+    {
         LogError("Broker_AddLink, input is NULL.");
         result = BROKER_INVALIDARG;
     }
+    else if (link->predicate != NULL && (predicate = BrokerPredicate_Compile(link->predicate)) == NULL)
+    {
+        LogError("Broker_AddLink, invalid predicate \"%s\".", link->predicate);
+        result = BROKER_INVALIDARG;
+    }
+    else if (link->group != NULL && (link->message_type != BROKER_LINK_MESSAGE_TYPE_THREAD ||
+        (link->group_balance != BROKER_LINK_BALANCE_ROUND_ROBIN && link->group_balance != BROKER_LINK_BALANCE_SHORTEST_QUEUE && link->group_balance != BROKER_LINK_BALANCE_PARTITION) ||
+        (link->group_balance == BROKER_LINK_BALANCE_PARTITION && link->partition_key == NULL)))
+    {
+        LogError("Broker_AddLink, group \"%s\" needs a thread-message link and a valid balance and partition key.", link->group);
+        result = BROKER_INVALIDARG;
+    }
+    else if (!(link->max_rate_hz >= 0))
+    {
+        LogError("Broker_AddLink, invalid max_rate_hz %f.", link->max_rate_hz);
+        result = BROKER_INVALIDARG;
+    }
+    else if (link->coalesce != NULL && link->message_type != BROKER_LINK_MESSAGE_TYPE_THREAD)
+    {
+        LogError("Broker_AddLink, coalesce \"%s\" needs a thread-message link.", link->coalesce);
+        result = BROKER_INVALIDARG;
+    }
     else
     {
         BROKER_HANDLE_DATA* broker_data = (BROKER_HANDLE_DATA*)broker;
@@ -857,6 +4389,7 @@ BROKER_RESULT Broker_AddLink(BROKER_HANDLE broker, const BROKER_LINK_DATA* link)
                 else
                 {
                     if (module_info->module->module_loader_type != OUTPROCESS&&source_module->module->module_loader_type != OUTPROCESS&&link->message_type == BROKER_LINK_MESSAGE_TYPE_THREAD) {
+                        result = BROKER_OK;
                         if (module_info->receiverThMsg == NULL) {
                             module_info->receiverThMsg = (THREAD_MESSAGE_HANDLING_RECEIVER*)malloc(sizeof(THREAD_MESSAGE_HANDLING_RECEIVER));
                             if (module_info->receiverThMsg == NULL) {
@@ -880,50 +4413,24 @@ BROKER_RESULT Broker_AddLink(BROKER_HANDLE broker, const BROKER_LINK_DATA* link)
                                 }
                                 else {
                                     module_info->receiverThMsg->toContinue = true;
+                                    module_info->receiverThMsg->waiting = 0;
+                                    module_info->receiverThMsg->rotation = 0;
                                     module_info->receiverThMsg->senders = NULL;
                                     module_info->receiverThMsg->module_info = module_info;
-                                    if (module_info->receiverThMsg->lock == NULL || module_info->receiverThMsg->condition == NULL) {
-                                        LogError("create lock or condition for receiverThMsg in Broker_AddLink failed. - lock:%08x,condition:%08x", module_info->receiverThMsg->lock, module_info->receiverThMsg->condition);
-                                        if (module_info->receiverThMsg->lock != NULL) {
-                                            Lock_Deinit(module_info->receiverThMsg->lock);
-                                        }
-                                        if (module_info->receiverThMsg->condition != NULL) {
-                                            Condition_Deinit(module_info->receiverThMsg->condition);
-                                        }
+                                    module_info->receiverThMsg->receiver_thread = NULL;
+                                    // in pool mode the module's actor drains the links, no thread is needed
+                                    if (module_info->actor == NULL && ThreadAPI_Create(&(module_info->receiverThMsg->receiver_thread), thread_message_control_receiver_thread_worker, module_info->receiverThMsg) != THREADAPI_OK) {
+                                        LogError("create receiver thread in Broker_AddLink failed.");
+                                        Lock_Deinit(module_info->receiverThMsg->lock);
+                                        Condition_Deinit(module_info->receiverThMsg->condition);
                                         free(module_info->receiverThMsg);
                                         module_info->receiverThMsg = NULL;
                                         result = BROKER_ADD_LINK_ERROR;
                                     }
-                                    else {
-                                        ThreadAPI_Create(&(module_info->receiverThMsg->receiver_thread), thread_message_control_receiver_thread_worker, module_info->receiverThMsg);
-                                    }
-                                }
-                            }
-                        }
-                        THREAD_MESSAGE_HANDLING_SENDER_FOR_RECEIVER* current_sender = module_info->receiverThMsg->senders;
-                        THREAD_MESSAGE_HANDLING_SENDER_FOR_RECEIVER* pre_sender = NULL;
-                        while (current_sender != NULL) {
-                            pre_sender = current_sender;
-                            current_sender = current_sender->next;
-                        }
-                        if (current_sender == NULL) {
-                            current_sender = (THREAD_MESSAGE_HANDLING_SENDER_FOR_RECEIVER*)malloc(sizeof(THREAD_MESSAGE_HANDLING_SENDER_FOR_RECEIVER));
-                            if (current_sender == NULL) {
-                                LogError("malloc current_sender in Broker_AddLink failed.");
-                                result = BROKER_ADD_LINK_ERROR;
-                            }
-                            else {
-                                current_sender->next = NULL;
-                                current_sender->sender_module_info = source_module;
-                                if (pre_sender == NULL) {
-                                    module_info->receiverThMsg->senders = current_sender;
-                                }
-                                else {
-                                    pre_sender->next = current_sender;
                                 }
                             }
                         }
-                        if (source_module->senderThMsg == NULL) {
+                        if (result == BROKER_OK && source_module->senderThMsg == NULL) {
                             source_module->senderThMsg = (THREAD_MESSAGE_HANDLING_SENDER*)malloc(sizeof(THREAD_MESSAGE_HANDLING_SENDER));
                             if (source_module->senderThMsg == NULL) {
                                 LogError("malloc senderThMsg in Broker_AddLink failed.");
@@ -932,236 +4439,943 @@ BROKER_RESULT Broker_AddLink(BROKER_HANDLE broker, const BROKER_LINK_DATA* link)
                             else {
                                 source_module->senderThMsg->lock = Lock_Init();
                                 if (source_module->senderThMsg->lock == NULL) {
-                                    LogError("");
+                                    LogError("create lock for senderThMsg in Broker_AddLink failed.");
                                     free(source_module->senderThMsg);
                                     source_module->senderThMsg = NULL;
                                     result = BROKER_ADD_LINK_ERROR;
                                 }
                                 else {
                                     source_module->senderThMsg->receivers = NULL;
+                                    source_module->senderThMsg->receiver_count = 0;
+                                }
+                            }
+                        }
+                        if (result == BROKER_OK) {
+                            THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* new_receiver = thread_message_link_create(module_info->receiverThMsg, link->queue_capacity, link->queue_policy);
+                            THREAD_MESSAGE_HANDLING_SENDER_FOR_RECEIVER* new_sender = (THREAD_MESSAGE_HANDLING_SENDER_FOR_RECEIVER*)malloc(sizeof(THREAD_MESSAGE_HANDLING_SENDER_FOR_RECEIVER));
+                            if (new_receiver == NULL || new_sender == NULL) {
+                                LogError("malloc link entries in Broker_AddLink failed.");
+                                if (new_receiver != NULL) {
+                                    thread_message_link_destroy(new_receiver);
+                                }
+                                free(new_sender);
+                                result = BROKER_ADD_LINK_ERROR;
+                            }
+                            else if (link->group != NULL && (mallocAndStrcpy_s(&new_receiver->group, link->group) != 0 ||
+                                (link->group_balance == BROKER_LINK_BALANCE_PARTITION && mallocAndStrcpy_s(&new_receiver->partition_key, link->partition_key) != 0))) {
+                                LogError("copy of link group in Broker_AddLink failed.");
+                                thread_message_link_destroy(new_receiver);
+                                free(new_sender);
+                                result = BROKER_ADD_LINK_ERROR;
+                            }
+                            else if (link->coalesce != NULL && thread_message_link_set_coalesce(new_receiver, link->coalesce) != 0) {
+                                LogError("Broker_AddLink, invalid coalesce \"%s\".", link->coalesce);
+                                thread_message_link_destroy(new_receiver);
+                                free(new_sender);
+                                result = BROKER_ADD_LINK_ERROR;
+                            }
+                            else if (link->queue_policy == BROKER_LINK_QUEUE_POLICY_SPILL && link->queue_capacity != 0 &&
+                                ((new_receiver->spill_lock = Lock_Init()) == NULL || (new_receiver->spill = BrokerSpill_Create(link->spill_directory)) == NULL)) {
+                                LogError("create spill for link in Broker_AddLink failed.");
+                                thread_message_link_destroy(new_receiver);
+                                free(new_sender);
+                                result = BROKER_ADD_LINK_ERROR;
+                            }
+                            else {
+                                new_receiver->balance = link->group_balance;
+                                new_receiver->predicate = predicate;
+                                broker_link_sampler_init(&new_receiver->sampler, link->sample_every, link->max_rate_hz);
+                                new_receiver->ttl_us = (uint64_t)link->ttl_ms * 1000;
+                                predicate = NULL;
+                                new_sender->sender_module_info = source_module;
+                                new_sender->link = new_receiver;
+                                new_sender->next = NULL;
+
+                                // publishers only see links through the routing snapshot, rebuilt below
+                                if (Lock(source_module->senderThMsg->lock) != LOCK_OK) {
+                                    LogError("Lock senderThMsg in Broker_AddLink failed.");
+                                    thread_message_link_destroy(new_receiver);
+                                    free(new_sender);
+                                    result = BROKER_ADD_LINK_ERROR;
+                                }
+                                else {
+                                    THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* last_receiver = source_module->senderThMsg->receivers;
+                                    if (last_receiver == NULL) {
+                                        source_module->senderThMsg->receivers = new_receiver;
+                                    }
+                                    else {
+                                        while (last_receiver->next != NULL) {
+                                            last_receiver = last_receiver->next;
+                                        }
+                                        last_receiver->next = new_receiver;
+                                    }
+                                    source_module->senderThMsg->receiver_count++;
+                                    Unlock(source_module->senderThMsg->lock);
+
+                                    // the receiver thread walks its senders under its own lock
+                                    if (Lock(module_info->receiverThMsg->lock) != LOCK_OK) {
+                                        LogError("Lock receiverThMsg in Broker_AddLink failed.");
+                                        result = BROKER_ADD_LINK_ERROR;
+                                    }
+                                    else {
+                                        THREAD_MESSAGE_HANDLING_SENDER_FOR_RECEIVER* last_sender = module_info->receiverThMsg->senders;
+                                        if (last_sender == NULL) {
+                                            module_info->receiverThMsg->senders = new_sender;
+                                        }
+                                        else {
+                                            while (last_sender->next != NULL) {
+                                                last_sender = last_sender->next;
+                                            }
+                                            last_sender->next = new_sender;
+                                        }
+                                        Unlock(module_info->receiverThMsg->lock);
+
+                                        if (broker_routing_update(broker_data) != 0) {
+                                            LogError("unable to publish routing for the new link.");
+                                            result = BROKER_ADD_LINK_ERROR;
+                                        }
+                                    }
                                 }
                             }
                         }
-                        if (source_module->senderThMsg != NULL) {
-                            THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* current_receiver = source_module->senderThMsg->receivers;
+                    }
+                    else if (module_info->module->module_loader_type != OUTPROCESS && source_module->module->module_loader_type != OUTPROCESS && link->message_type == BROKER_LINK_MESSAGE_TYPE_DIRECT) {
+                        BROKER_DIRECT_LINK* direct_link = (BROKER_DIRECT_LINK*)malloc(sizeof(BROKER_DIRECT_LINK));
+                        if (direct_link == NULL) {
+                            LogError("malloc of direct link in Broker_AddLink failed.");
+                            result = BROKER_ADD_LINK_ERROR;
+                        }
+                        else {
+                            direct_link->sink = module_info;
+                            direct_link->predicate = predicate;
+                            broker_link_sampler_init(&direct_link->sampler, link->sample_every, link->max_rate_hz);
+                            direct_link->next = source_module->direct_links;
+                            source_module->direct_links = direct_link;
+                            if (broker_routing_update(broker_data) != 0) {
+                                // publishers never saw the link, so it can go right away
+                                LogError("unable to publish routing for the new link.");
+                                source_module->direct_links = direct_link->next;
+                                free(direct_link);
+                                result = BROKER_ADD_LINK_ERROR;
+                            }
+                            else {
+                                predicate = NULL;
+                                result = BROKER_OK;
+                            }
+                        }
+                    }
+                    else {
+                        // in the case of out process module then should be done next step!! TODO:
+                        BROKER_LINK_FILTER* filter = (BROKER_LINK_FILTER*)malloc(sizeof(BROKER_LINK_FILTER));
+                        if (filter == NULL)
+                        {
+                            LogError("malloc of link filter in Broker_AddLink failed.");
+                            result = BROKER_ADD_LINK_ERROR;
+                        }
+                        else
+                        {
+                            filter->source = link->module_source_handle;
+                            filter->predicate = predicate;
+                            broker_link_sampler_init(&filter->sampler, link->sample_every, link->max_rate_hz);
+                            filter->ttl_us = (uint64_t)link->ttl_ms * 1000;
+                            filter->next = module_info->default_links;
+                            module_info->default_links = filter;
+                            if (broker_link_filter_checks(filter))
+                            {
+                                (void)BROKER_ATOMIC_ADD(&module_info->default_filter_count, 1);
+                            }
+                            /* owned by the filter from now on */
+                            predicate = NULL;
+
+                            bool first_default_sink = (source_module->default_sink_count++ == 0);
+
+                            /* the sink has to see the predicate before the first frame of the source,
+                             * and a source with thread-message links that it now has default sinks */
+                            if ((module_info->default_filter_count != 0 || first_default_sink) && broker_routing_update(broker_data) != 0)
+                            {
+                                LogError("unable to publish routing for the new link.");
+                                result = BROKER_ADD_LINK_ERROR;
+                            }
+                            /*Codes_SRS_BROKER_17_032: [ Broker_AddLink shall subscribe module_info->receive_socket to the link->source module handle. ]*/
+                            else if (nn_setsockopt(
+                                module_info->receive_socket, NN_SUB, NN_SUB_SUBSCRIBE, &(link->module_source_handle), sizeof(MODULE_HANDLE)) < 0)
+                            {
+                                /*Codes_SRS_BROKER_17_034: [ Upon an error, Broker_AddLink shall return BROKER_ADD_LINK_ERROR ]*/
+                                LogError("Unable to make link in Broker");
+                                result = BROKER_ADD_LINK_ERROR;
+                            }
+                            else
+                            {
+                                result = BROKER_OK;
+                            }
+
+                            if (result != BROKER_OK)
+                            {
+                                /* the link never took effect, so it must not admit frames of the source either */
+                                broker_link_filter_remove(broker_data, source_module, module_info, filter);
+                            }
+                        }
+                    }
+                }
+            }
+            /*Codes_SRS_BROKER_17_033: [ Broker_AddLink shall unlock the modules_lock. ]*/
+            Unlock(broker_data->modules_lock);
+        }
+    }
+    BrokerPredicate_Destroy(predicate);
+    return result;
+}
+
+BROKER_RESULT Broker_RemoveLink(BROKER_HANDLE broker, const BROKER_LINK_DATA* link)
+{
+    BROKER_RESULT result;
+    /*Codes_SRS_BROKER_17_035: [ If broker, link, link->module_source_handle or link->module_sink_handle are NULL, Broker_RemoveLink shall return BROKER_INVALIDARG. ]*/
+    if (broker == NULL || link == NULL || link->module_sink_handle == NULL || link->module_source_handle == NULL)
+    {
+        LogError("Broker_AddLink, input is NULL.");
+        result = BROKER_INVALIDARG;
+    }
+    else
+    {
+        BROKER_HANDLE_DATA* broker_data = (BROKER_HANDLE_DATA*)broker;
+        /*Codes_SRS_BROKER_17_036: [ Broker_RemoveLink shall lock the modules_lock. ]*/
+        if (Lock(broker_data->modules_lock) != LOCK_OK)
+        {
+            /*Codes_SRS_BROKER_17_040: [ Upon an error, Broker_RemoveLink shall return BROKER_REMOVE_LINK_ERROR. ]*/
+            LogError("Broker_AddLink, Lock on broker_data->modules_lock failed");
+            result = BROKER_REMOVE_LINK_ERROR;
+        }
+        else
+        {
+            /*Codes_SRS_BROKER_17_037: [ Broker_RemoveLink shall find the module_info for link->module_sink_handle. ]*/
+            BROKER_MODULEINFO* module_info = broker_locate_handle(broker_data, link->module_sink_handle);
+
+            if (module_info == NULL)
+            {
+                /*Codes_SRS_BROKER_17_040: [ Upon an error, Broker_RemoveLink shall return BROKER_REMOVE_LINK_ERROR. ]*/
+                LogError("Link->sink is not attached to the broker");
+                result = BROKER_REMOVE_LINK_ERROR;
+            }
+            else
+            {
+                /*Codes_SRS_BROKER_17_042: [ Broker_RemoveLink shall find the module_info for link->module_source_handle. ]*/
+                BROKER_MODULEINFO* source_module_info = broker_locate_handle(broker_data, link->module_source_handle);
+                if (source_module_info == NULL)
+                {
+                    LogError("Link->source is not attached to the broker");
+                    result = BROKER_REMOVE_LINK_ERROR;
+                }
+                else
+                {
+                    BROKER_DIRECT_LINK** direct_link = &source_module_info->direct_links;
+                    while (*direct_link != NULL && (*direct_link)->sink != module_info) {
+                        direct_link = &(*direct_link)->next;
+                    }
+                    if (*direct_link != NULL) {
+                        BROKER_DIRECT_LINK* removed = *direct_link;
+                        *direct_link = removed->next;
+                        // publishers copy the sink out of the snapshot, so the link itself can go once they left it
+                        (void)broker_routing_update(broker_data);
+                        BrokerPredicate_Destroy(removed->predicate);
+                        free(removed);
+                        result = BROKER_OK;
+                    }
+                    else if (module_info->receiverThMsg != NULL&&source_module_info->senderThMsg != NULL) {
+                        if (Lock(source_module_info->senderThMsg->lock) != LOCK_OK) {
+                            LogError("Lock senderThMsg failed.");
+                            result = BROKER_REMOVE_LINK_ERROR;
+                        }
+                        else {
+                            // groups and replicas may link a source to a sink more than once, so the
+                            // receiver's entry is the one pointing at the link found, and neither goes without the other
+                            THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* receiver = source_module_info->senderThMsg->receivers;
                             THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* pre_receiver = NULL;
-                            while (current_receiver != NULL) {
-                                pre_receiver = current_receiver;
-                                current_receiver = current_receiver->next;
+                            THREAD_MESSAGE_HANDLING_SENDER_FOR_RECEIVER* sender = NULL;
+                            while (receiver != NULL && receiver->receiver->module_info != module_info) {
+                                pre_receiver = receiver;
+                                receiver = receiver->next;
                             }
-                            if (current_receiver == NULL) {
-                                current_receiver = (THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER*)malloc(sizeof(THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER));
-                                if (current_receiver == NULL) {
-                                    LogError("malloc current_receiver in Broker_AddLink failed.");
-                                    result = BROKER_ADD_LINK_ERROR;
+                            if (receiver == NULL) {
+                                // not a thread-message link
+                                result = broker_remove_default_link(broker_data, source_module_info, module_info);
+                            }
+                            else if (Lock(module_info->receiverThMsg->lock) != LOCK_OK) {
+                                LogError("Lock for receiverThMsg failed.");
+                                result = BROKER_REMOVE_LINK_ERROR;
+                            }
+                            else {
+                                THREAD_MESSAGE_HANDLING_SENDER_FOR_RECEIVER* pre_sender = NULL;
+                                sender = module_info->receiverThMsg->senders;
+                                while (sender != NULL && sender->link != receiver) {
+                                    pre_sender = sender;
+                                    sender = sender->next;
+                                }
+                                if (sender == NULL) {
+                                    LogError("thread-message link from [%p] to [%p] is unknown to its sink.", link->module_source_handle, link->module_sink_handle);
+                                    result = BROKER_REMOVE_LINK_ERROR;
                                 }
                                 else {
-                                    current_receiver->next = NULL;
-                                    current_receiver->receiver = module_info->receiverThMsg;
-                                    current_receiver->sendingMessages = NULL;
-                                    if (pre_receiver == NULL) {
-                                        source_module->senderThMsg->receivers = current_receiver;
+                                    if (pre_sender == NULL) {
+                                        module_info->receiverThMsg->senders = sender->next;
+                                    }
+                                    else {
+                                        pre_sender->next = sender->next;
+                                    }
+                                    if (pre_receiver != NULL) {
+                                        pre_receiver->next = receiver->next;
                                     }
                                     else {
-                                        pre_receiver->next = current_receiver;
+                                        source_module_info->senderThMsg->receivers = receiver->next;
                                     }
+                                    source_module_info->senderThMsg->receiver_count--;
                                     result = BROKER_OK;
                                 }
+                                Unlock(module_info->receiverThMsg->lock);
+                            }
+                            Unlock(source_module_info->senderThMsg->lock);
+
+                            if (receiver != NULL && result == BROKER_OK) {
+                                free((void*)sender);
+                                // publishers may still hold the previous snapshot, the link goes only once they left it
+                                (void)broker_routing_update(broker_data);
+                                thread_message_link_retire(receiver);
                             }
                         }
                     }
                     else {
-                        // in the case of out process module then should be done next step!! TODO:
-                        /*Codes_SRS_BROKER_17_032: [ Broker_AddLink shall subscribe module_info->receive_socket to the link->source module handle. ]*/
-                        if (nn_setsockopt(
-                            module_info->receive_socket, NN_SUB, NN_SUB_SUBSCRIBE, &(link->module_source_handle), sizeof(MODULE_HANDLE)) < 0)
-                        {
-                            /*Codes_SRS_BROKER_17_034: [ Upon an error, Broker_AddLink shall return BROKER_ADD_LINK_ERROR ]*/
-                            LogError("Unable to make link in Broker");
-                            result = BROKER_ADD_LINK_ERROR;
-                        }
-                        else
-                        {
-                            result = BROKER_OK;
-                        }
+                        result = broker_remove_default_link(broker_data, source_module_info, module_info);
                     }
                 }
             }
-            /*Codes_SRS_BROKER_17_033: [ Broker_AddLink shall unlock the modules_lock. ]*/
+            /*Codes_SRS_BROKER_17_039: [ Broker_RemoveLink shall unlock the modules_lock. ]*/
             Unlock(broker_data->modules_lock);
         }
     }
     return result;
 }
 
-BROKER_RESULT Broker_RemoveLink(BROKER_HANDLE broker, const BROKER_LINK_DATA* link)
+/* Reads the counters of a thread-message link of source, for both
+ * Broker_GetLinkQueueStatistics and Broker_GetStatistics. Called under
+ * modules_lock. */
+static void broker_link_statistics_read(const BROKER_MODULEINFO* source, const THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link, BROKER_LINK_STATISTICS* statistics)
+{
+    statistics->source = source->module->module_handle;
+    statistics->sink = ((const BROKER_MODULEINFO*)link->receiver->module_info)->module->module_handle;
+    statistics->enqueued = BROKER_ATOMIC_LOAD(&link->enqueued);
+    statistics->delivered = BROKER_ATOMIC_LOAD(&link->delivered);
+    statistics->dropped_oldest = BROKER_ATOMIC_LOAD(&link->dropped_oldest);
+    statistics->dropped_newest = BROKER_ATOMIC_LOAD(&link->dropped_newest);
+    statistics->rejected = BROKER_ATOMIC_LOAD(&link->rejected);
+    statistics->coalesced = BROKER_ATOMIC_LOAD(&link->coalesced);
+    statistics->sampled_out = BROKER_ATOMIC_LOAD(&link->sampler.skipped);
+    statistics->spilled = BROKER_ATOMIC_LOAD(&link->spilled);
+    statistics->expired = BROKER_ATOMIC_LOAD(&link->expired);
+    statistics->depth = BROKER_ATOMIC_LOAD(&link->depth);
+    statistics->queued_bytes = BROKER_ATOMIC_LOAD(&link->queued_bytes);
+    statistics->spill_depth = BROKER_ATOMIC_LOAD(&link->spill_count);
+    statistics->peak_depth = BROKER_ATOMIC_LOAD(&link->peak_depth);
+    statistics->capacity = link->capacity;
+    statistics->queue_latency = link->queue_latency;
+}
+
+BROKER_RESULT Broker_GetLinkQueueStatistics(BROKER_HANDLE broker, const BROKER_LINK_DATA* link, BROKER_LINK_QUEUE_STATISTICS* statistics)
 {
     BROKER_RESULT result;
-    /*Codes_SRS_BROKER_17_035: [ If broker, link, link->module_source_handle or link->module_sink_handle are NULL, Broker_RemoveLink shall return BROKER_INVALIDARG. ]*/
-    if (broker == NULL || link == NULL || link->module_sink_handle == NULL || link->module_source_handle == NULL)
+    if (broker == NULL || link == NULL || statistics == NULL || link->module_sink_handle == NULL || link->module_source_handle == NULL)
     {
-        LogError("Broker_AddLink, input is NULL.");
+        LogError("Broker_GetLinkQueueStatistics, input is NULL.");
         result = BROKER_INVALIDARG;
     }
     else
     {
         BROKER_HANDLE_DATA* broker_data = (BROKER_HANDLE_DATA*)broker;
-        /*Codes_SRS_BROKER_17_036: [ Broker_RemoveLink shall lock the modules_lock. ]*/
         if (Lock(broker_data->modules_lock) != LOCK_OK)
         {
-            /*Codes_SRS_BROKER_17_040: [ Upon an error, Broker_RemoveLink shall return BROKER_REMOVE_LINK_ERROR. ]*/
-            LogError("Broker_AddLink, Lock on broker_data->modules_lock failed");
-            result = BROKER_REMOVE_LINK_ERROR;
+            LogError("Broker_GetLinkQueueStatistics, Lock on broker_data->modules_lock failed");
+            result = BROKER_ERROR;
         }
         else
         {
-            /*Codes_SRS_BROKER_17_037: [ Broker_RemoveLink shall find the module_info for link->module_sink_handle. ]*/
-            BROKER_MODULEINFO* module_info = broker_locate_handle(broker_data, link->module_sink_handle);
+            BROKER_MODULEINFO* source_module_info = broker_locate_handle(broker_data, link->module_source_handle);
+            THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* receiver = NULL;
+            if (source_module_info != NULL && source_module_info->senderThMsg != NULL)
+            {
+                receiver = source_module_info->senderThMsg->receivers;
+                while (receiver != NULL && ((BROKER_MODULEINFO*)receiver->receiver->module_info)->module->module_handle != link->module_sink_handle)
+                {
+                    receiver = receiver->next;
+                }
+            }
 
-            if (module_info == NULL)
+            if (receiver == NULL)
             {
-                /*Codes_SRS_BROKER_17_040: [ Upon an error, Broker_RemoveLink shall return BROKER_REMOVE_LINK_ERROR. ]*/
-                LogError("Link->sink is not attached to the broker");
-                result = BROKER_REMOVE_LINK_ERROR;
+                LogError("no thread-message link from [%p] to [%p]", link->module_source_handle, link->module_sink_handle);
+                result = BROKER_ERROR;
+            }
+            else
+            {
+                BROKER_LINK_STATISTICS link_statistics;
+                broker_link_statistics_read(source_module_info, receiver, &link_statistics);
+                statistics->depth = link_statistics.depth;
+                statistics->capacity = link_statistics.capacity;
+                statistics->dropped_oldest = link_statistics.dropped_oldest;
+                statistics->dropped_newest = link_statistics.dropped_newest;
+                statistics->rejected = link_statistics.rejected;
+                statistics->spilled = link_statistics.spilled;
+                statistics->spill_depth = link_statistics.spill_depth;
+                result = BROKER_OK;
+            }
+            Unlock(broker_data->modules_lock);
+        }
+    }
+    return result;
+}
+
+BROKER_RESULT Broker_GetStatistics(BROKER_HANDLE broker, BROKER_STATISTICS* statistics)
+{
+    BROKER_RESULT result;
+    if (broker == NULL || statistics == NULL)
+    {
+        LogError("Broker_GetStatistics, input is NULL.");
+        result = BROKER_INVALIDARG;
+    }
+    else
+    {
+        BROKER_HANDLE_DATA* broker_data = (BROKER_HANDLE_DATA*)broker;
+        statistics->module_count = 0;
+        statistics->modules = NULL;
+        statistics->link_count = 0;
+        statistics->links = NULL;
+        statistics->held_bytes = BROKER_ATOMIC_LOAD(&broker_data->held_bytes);
+        statistics->memory_budget = broker_data->memory_budget;
+        statistics->memory_shed = BROKER_ATOMIC_LOAD(&broker_data->memory_shed);
+        if (Lock(broker_data->modules_lock) != LOCK_OK)
+        {
+            LogError("Broker_GetStatistics, Lock on broker_data->modules_lock failed");
+            result = BROKER_ERROR;
+        }
+        else
+        {
+            LIST_ITEM_HANDLE item;
+            BROKER_MODULEINFO** module_infos;
+            size_t module_count = 0;
+            size_t link_count = 0;
+
+            // links are only changed under modules_lock, so they can be walked without the sender locks
+            for (item = singlylinkedlist_get_head_item(broker_data->modules); item != NULL; item = singlylinkedlist_get_next_item(item))
+            {
+                const BROKER_MODULEINFO* module_info = (const BROKER_MODULEINFO*)singlylinkedlist_item_get_value(item);
+                module_count++;
+                if (module_info->senderThMsg != NULL)
+                {
+                    link_count += module_info->senderThMsg->receiver_count;
+                }
+            }
+
+            module_infos = (BROKER_MODULEINFO**)malloc((module_count + 1) * sizeof(BROKER_MODULEINFO*));
+            statistics->modules = (BROKER_MODULE_STATISTICS*)calloc(module_count + 1, sizeof(BROKER_MODULE_STATISTICS));
+            statistics->links = (BROKER_LINK_STATISTICS*)calloc(link_count + 1, sizeof(BROKER_LINK_STATISTICS));
+            if (module_infos == NULL || statistics->modules == NULL || statistics->links == NULL)
+            {
+                LogError("unable to allocate statistics for %zu modules and %zu links", module_count, link_count);
+                Broker_FreeStatistics(statistics);
+                result = BROKER_ERROR;
+            }
+            else
+            {
+                size_t i;
+                for (item = singlylinkedlist_get_head_item(broker_data->modules); item != NULL; item = singlylinkedlist_get_next_item(item))
+                {
+                    BROKER_MODULEINFO* module_info = (BROKER_MODULEINFO*)singlylinkedlist_item_get_value(item);
+                    BROKER_MODULE_STATISTICS* module_statistics = &statistics->modules[statistics->module_count];
+                    module_infos[statistics->module_count++] = module_info;
+                    module_statistics->module = module_info->module->module_handle;
+                    module_statistics->published = BROKER_ATOMIC_LOAD(&module_info->published);
+                    module_statistics->delivered = module_info->default_receive.delivered + module_info->thread_receive.delivered + module_info->direct_receive.delivered;
+                    module_statistics->expired = module_info->default_receive.expired;
+                    module_statistics->slow = module_info->slow;
+                    broker_histogram_add(&module_statistics->receive_latency, &module_info->default_receive.latency);
+                    broker_histogram_add(&module_statistics->receive_latency, &module_info->thread_receive.latency);
+                    broker_histogram_add(&module_statistics->receive_latency, &module_info->direct_receive.latency);
+                    broker_histogram_add(&module_statistics->receive_duration, &module_info->default_receive.duration);
+                    broker_histogram_add(&module_statistics->receive_duration, &module_info->thread_receive.duration);
+                    broker_histogram_add(&module_statistics->receive_duration, &module_info->direct_receive.duration);
+                }
+
+                for (i = 0; i < statistics->module_count; i++)
+                {
+                    const THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link = (module_infos[i]->senderThMsg != NULL) ? module_infos[i]->senderThMsg->receivers : NULL;
+                    for (; link != NULL && statistics->link_count < link_count; link = (const THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER*)link->next)
+                    {
+                        BROKER_LINK_STATISTICS* link_statistics = &statistics->links[statistics->link_count++];
+                        const BROKER_MODULEINFO* sink = (const BROKER_MODULEINFO*)link->receiver->module_info;
+                        size_t j;
+                        broker_link_statistics_read(module_infos[i], link, link_statistics);
+
+                        for (j = 0; j < statistics->module_count; j++)
+                        {
+                            if (module_infos[j] == sink)
+                            {
+                                statistics->modules[j].dropped += link_statistics->dropped_oldest + link_statistics->dropped_newest + link_statistics->rejected;
+                                statistics->modules[j].expired += link_statistics->expired;
+                                statistics->modules[j].queue_depth += link_statistics->depth;
+                                statistics->modules[j].queued_bytes += link_statistics->queued_bytes;
+                                break;
+                            }
+                        }
+                    }
+                }
+                result = BROKER_OK;
+            }
+            free(module_infos);
+            Unlock(broker_data->modules_lock);
+        }
+    }
+    return result;
+}
+
+void Broker_FreeStatistics(BROKER_STATISTICS* statistics)
+{
+    if (statistics != NULL)
+    {
+        free(statistics->modules);
+        free(statistics->links);
+        statistics->module_count = 0;
+        statistics->modules = NULL;
+        statistics->link_count = 0;
+        statistics->links = NULL;
+    }
+}
+
+static void broker_decrement_ref(BROKER_HANDLE broker)
+{
+    /*Codes_SRS_BROKER_13_058: [If `broker` is NULL the function shall do nothing.]*/
+    if (broker != NULL)
+    {
+        /*Codes_SRS_BROKER_13_111: [Otherwise, Broker_Destroy shall decrement the internal ref count of the message.]*/
+        /*Codes_SRS_BROKER_13_112: [If the ref count is zero then the allocated resources are freed.]*/
+        if (DEC_REF(BROKER_HANDLE_DATA, broker) == DEC_RETURN_ZERO)
+        {
+            BROKER_HANDLE_DATA* broker_data = (BROKER_HANDLE_DATA*)broker; 
+            if (singlylinkedlist_get_head_item(broker_data->modules) != NULL)
+            {
+                LogError("WARNING: There are still active modules attached to the broker and the broker is being destroyed.");
+            }
+            broker_watchdog_stop(broker_data);
+            broker_scheduler_stop(broker_data);
+            /* May want to do nn_shutdown first for cleanliness. */
+            nn_really_close(broker_data->publish_socket);
+            STRING_delete(broker_data->url);
+            singlylinkedlist_destroy(broker_data->modules);
+            Lock_Deinit(broker_data->modules_lock);
+            free(broker_data->routing);
+            free(broker_data);
+        }
+    }
+    else
+    {
+        LogError("broker handle is NULL");
+    }
+}
+
+extern void Broker_Destroy(BROKER_HANDLE broker)
+{
+    broker_decrement_ref(broker);
+}
+
+extern void Broker_DecRef(BROKER_HANDLE broker)
+{
+    /*Codes_SRS_BROKER_13_113: [This function shall implement all the requirements of the Broker_Destroy API.]*/
+    broker_decrement_ref(broker);
+}
+
+static unsigned char* write_int32_be(unsigned char* dest, int32_t value)
+{
+    dest[0] = (unsigned char)(((uint32_t)value >> 24) & 0xFF);
+    dest[1] = (unsigned char)(((uint32_t)value >> 16) & 0xFF);
+    dest[2] = (unsigned char)(((uint32_t)value >> 8) & 0xFF);
+    dest[3] = (unsigned char)((uint32_t)value & 0xFF);
+    return dest + 4;
+}
+
+/* Everything needed to write one message in the Message_ToByteArray layout:
+ * 0xA1 0x60, total size, property count, name\0value\0 pairs, content size,
+ * content. Properties and content are walked once; string lengths are
+ * measured once and reused for the copy. */
+typedef struct SERIALIZED_MESSAGE_LAYOUT_TAG
+{
+    CONSTMAP_HANDLE properties;
+    const char* const* keys;
+    const char* const* values;
+    size_t count;
+    const CONSTBUFFER* content;
+    size_t* lengths;
+    size_t stack_lengths[2 * SERIALIZE_STACK_PROPERTIES];
+    size_t size;
+} SERIALIZED_MESSAGE_LAYOUT;
+
+/* returns 0 if success, otherwise __LINE__; nothing needs to be released on failure */
+static int serialized_message_layout_init(SERIALIZED_MESSAGE_LAYOUT* layout, MESSAGE_HANDLE message)
+{
+    int result;
+    layout->properties = Message_GetProperties(message);
+    layout->content = Message_GetContent(message);
+
+    if (layout->properties == NULL || layout->content == NULL)
+    {
+        LogError("unable to get properties or content of message [%p]", message);
+        result = __LINE__;
+    }
+    else if (ConstMap_GetInternals(layout->properties, &layout->keys, &layout->values, &layout->count) != CONSTMAP_OK)
+    {
+        LogError("unable to get property internals of message [%p]", message);
+        result = __LINE__;
+    }
+    else
+    {
+        layout->lengths = (layout->count <= SERIALIZE_STACK_PROPERTIES) ? layout->stack_lengths : (size_t*)malloc(2 * layout->count * sizeof(size_t));
+        if (layout->lengths == NULL)
+        {
+            LogError("malloc of property lengths failed");
+            result = __LINE__;
+        }
+        else
+        {
+            size_t i;
+            /* header, total size, property count and content size */
+            layout->size = 2 + 4 + 4 + 4 + layout->content->size;
+            for (i = 0; i < layout->count; i++)
+            {
+                layout->lengths[2 * i] = strlen(layout->keys[i]) + 1;
+                layout->lengths[2 * i + 1] = strlen(layout->values[i]) + 1;
+                layout->size += layout->lengths[2 * i] + layout->lengths[2 * i + 1];
+            }
+
+            if (layout->size > INT32_MAX)
+            {
+                LogError("message [%p] too large to serialize", message);
+                if (layout->lengths != layout->stack_lengths)
+                {
+                    free(layout->lengths);
+                }
+                result = __LINE__;
+            }
+            else
+            {
+                result = 0;
+            }
+        }
+    }
+
+    if (result != 0 && layout->properties != NULL)
+    {
+        ConstMap_Destroy(layout->properties);
+    }
+    return result;
+}
+
+static unsigned char* serialized_message_layout_write(const SERIALIZED_MESSAGE_LAYOUT* layout, unsigned char* dest)
+{
+    size_t i;
+    *dest++ = SERIALIZED_MESSAGE_HEADER_0;
+    *dest++ = SERIALIZED_MESSAGE_HEADER_1;
+    dest = write_int32_be(dest, (int32_t)layout->size);
+    dest = write_int32_be(dest, (int32_t)layout->count);
+    for (i = 0; i < layout->count; i++)
+    {
+        memcpy(dest, layout->keys[i], layout->lengths[2 * i]);
+        dest += layout->lengths[2 * i];
+        memcpy(dest, layout->values[i], layout->lengths[2 * i + 1]);
+        dest += layout->lengths[2 * i + 1];
+    }
+    dest = write_int32_be(dest, (int32_t)layout->content->size);
+    if (layout->content->size > 0)
+    {
+        memcpy(dest, layout->content->buffer, layout->content->size);
+        dest += layout->content->size;
+    }
+    return dest;
+}
+
+static void serialized_message_layout_deinit(SERIALIZED_MESSAGE_LAYOUT* layout)
+{
+    if (layout->lengths != layout->stack_lengths)
+    {
+        free(layout->lengths);
+    }
+    ConstMap_Destroy(layout->properties);
+}
+
+/* BROKER_LINK_QUEUE_POLICY_SPILL: appends the message to the link's spill,
+ * its publish time and priority followed by the message in the
+ * Message_ToByteArray layout. The caller keeps its reference. returns 0 if
+ * success, otherwise __LINE__ */
+static int thread_message_link_spill(THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link, THREAD_MESSAGE_CTRL* msgCtrl)
+{
+    int result;
+    SERIALIZED_MESSAGE_LAYOUT layout;
+    if (msgCtrl->coalesce_slot != NULL) {
+        // no publisher may replace the message while it is written, and its key is no longer queued
+        thread_message_coalesce_detach(msgCtrl);
+    }
+    if (serialized_message_layout_init(&layout, msgCtrl->msg) != 0) {
+        result = __LINE__;
+    }
+    else {
+        if (Lock(link->spill_lock) != LOCK_OK) {
+            LogError("Lock spill_lock in thread_message_link_spill failed.");
+            result = __LINE__;
+        }
+        else {
+            unsigned char* record = BrokerSpill_Append(link->spill, THREAD_MESSAGE_SPILL_HEADER_SIZE + layout.size);
+            if (record == NULL) {
+                LogError("unable to spill message of %zu bytes.", layout.size);
+                result = __LINE__;
+            }
+            else {
+                uint64_t priority = (uint64_t)msgCtrl->priority;
+                memcpy(record, &msgCtrl->published_us, sizeof(uint64_t));
+                memcpy(record + sizeof(uint64_t), &priority, sizeof(uint64_t));
+                (void)serialized_message_layout_write(&layout, record + THREAD_MESSAGE_SPILL_HEADER_SIZE);
+                (void)BROKER_ATOMIC_ADD(&link->spill_count, 1);
+                (void)BROKER_ATOMIC_ADD(&link->spilled, 1);
+                result = 0;
+            }
+            Unlock(link->spill_lock);
+        }
+        serialized_message_layout_deinit(&layout);
+    }
+    return result;
+}
+
+/* Reads the oldest spilled message of the link back into a new control with
+ * its original publish time and priority. Returns NULL when the spill is
+ * empty or the message cannot be read back, which drops it. Single consumer
+ * only. */
+static THREAD_MESSAGE_CTRL* thread_message_link_unspill(THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* link)
+{
+    THREAD_MESSAGE_CTRL* result = NULL;
+    if (Lock(link->spill_lock) != LOCK_OK) {
+        LogError("Lock spill_lock in thread_message_link_unspill failed.");
+    }
+    else {
+        size_t size;
+        const unsigned char* record = BrokerSpill_Peek(link->spill, &size);
+        if (record != NULL) {
+            MESSAGE_HANDLE message = Message_CreateFromByteArray(record + THREAD_MESSAGE_SPILL_HEADER_SIZE, (int32_t)(size - THREAD_MESSAGE_SPILL_HEADER_SIZE));
+            if (message == NULL) {
+                LogError("unable to read spilled message back, dropping it.");
+            }
+            else {
+                BROKER_MODULEINFO* sink = (BROKER_MODULEINFO*)link->receiver->module_info;
+                uint64_t priority;
+                memcpy(&priority, record + sizeof(uint64_t), sizeof(uint64_t));
+                result = thread_message_ctrl_create(sink->broker_data, message, message_footprint(message), 1, (BROKER_MESSAGE_PRIORITY)priority);
+                if (result != NULL) {
+                    memcpy(&result->published_us, record, sizeof(uint64_t));
+                }
+                Message_Destroy(message);
+            }
+            BrokerSpill_Pop(link->spill);
+            (void)BROKER_ATOMIC_SUB(&link->spill_count, 1);
+        }
+        Unlock(link->spill_lock);
+    }
+    return result;
+}
+
+/* Serializes message into a new nanomsg buffer prefixed with the source
+ * handle and the publish time. Returns NULL on failure. */
+static void* serialize_message_to_nn_buffer(MODULE_HANDLE source, MESSAGE_HANDLE message, size_t* buf_size)
+{
+    void* result;
+    SERIALIZED_MESSAGE_LAYOUT layout;
+
+    if (serialized_message_layout_init(&layout, message) != 0)
+    {
+        result = NULL;
+    }
+    else
+    {
+        /*Codes_SRS_BROKER_17_025: [ Broker_Publish shall allocate a nanomsg buffer the size of the serialized message + sizeof(MODULE_HANDLE). ]*/
+        result = nn_allocmsg(layout.size + BROKER_FRAME_HEADER_SIZE, 0);
+        if (result == NULL)
+        {
+            LogError("nn_allocmsg of %zu bytes failed", layout.size + BROKER_FRAME_HEADER_SIZE);
+        }
+        else
+        {
+            /*Codes_SRS_BROKER_17_026: [ Broker_Publish shall copy source into the beginning of the nanomsg buffer. ]*/
+            unsigned char* dest = (unsigned char*)result;
+            uint64_t published_us = broker_clock_us();
+            memcpy(dest, &source, sizeof(MODULE_HANDLE));
+            memcpy(dest + sizeof(MODULE_HANDLE), &published_us, sizeof(uint64_t));
+            /*Codes_SRS_BROKER_17_027: [ Broker_Publish shall serialize the message into the remainder of the nanomsg buffer. ]*/
+            (void)serialized_message_layout_write(&layout, dest + BROKER_FRAME_HEADER_SIZE);
+            *buf_size = layout.size + BROKER_FRAME_HEADER_SIZE;
+        }
+        serialized_message_layout_deinit(&layout);
+    }
+    return result;
+}
+
+/* Serializes messages into one nanomsg buffer: source handle, publish time, 0xA1 0x61,
+ * message count, then each message in the Message_ToByteArray layout.
+ * Messages that cannot be serialized are left out and counted in
+ * *skipped. Returns NULL on failure or when nothing could be serialized. */
+static void* serialize_batch_to_nn_buffer(MODULE_HANDLE source, MESSAGE_HANDLE* messages, size_t count, size_t* buf_size, size_t* skipped)
+{
+    void* result = NULL;
+    SERIALIZED_MESSAGE_LAYOUT* layouts = (SERIALIZED_MESSAGE_LAYOUT*)malloc(count * sizeof(SERIALIZED_MESSAGE_LAYOUT));
+
+    *skipped = count;
+    if (layouts == NULL)
+    {
+        LogError("malloc of %zu message layouts failed", count);
+    }
+    else
+    {
+        size_t used = 0;
+        size_t size = BROKER_FRAME_HEADER_SIZE + 2 + 4;
+        size_t i;
+
+        for (i = 0; i < count; i++)
+        {
+            if (serialized_message_layout_init(&layouts[used], messages[i]) == 0)
+            {
+                size += layouts[used].size;
+                used++;
+            }
+        }
+        *skipped = count - used;
+
+        if (used > 0)
+        {
+            result = nn_allocmsg(size, 0);
+            if (result == NULL)
+            {
+                LogError("nn_allocmsg of %zu bytes failed", size);
+                *skipped = count;
             }
             else
             {
-                /*Codes_SRS_BROKER_17_042: [ Broker_RemoveLink shall find the module_info for link->module_source_handle. ]*/
-                BROKER_MODULEINFO* source_module_info = broker_locate_handle(broker_data, link->module_source_handle);
-                if (source_module_info == NULL)
-                {
-                    LogError("Link->source is not attached to the broker");
-                    result = BROKER_REMOVE_LINK_ERROR;
-                }
-                else
+                unsigned char* dest = (unsigned char*)result;
+                uint64_t published_us = broker_clock_us();
+                memcpy(dest, &source, sizeof(MODULE_HANDLE));
+                memcpy(dest + sizeof(MODULE_HANDLE), &published_us, sizeof(uint64_t));
+                dest += BROKER_FRAME_HEADER_SIZE;
+                *dest++ = SERIALIZED_MESSAGE_HEADER_0;
+                *dest++ = SERIALIZED_BATCH_HEADER_1;
+                dest = write_int32_be(dest, (int32_t)used);
+                for (i = 0; i < used; i++)
                 {
-                    /*Codes_SRS_BROKER_17_038: [ Broker_RemoveLink shall unsubscribe module_info->receive_socket from the link->module_source_handle module handle. ]*/
-//                    if (nn_setsockopt(
-//                      module_info->receive_socket, NN_SUB, NN_SUB_UNSUBSCRIBE, &(link->module_source_handle), sizeof(MODULE_HANDLE)) < 0)
-//                  {
-//                      /*Codes_SRS_BROKER_17_040: [ Upon an error, Broker_RemoveLink shall return BROKER_REMOVE_LINK_ERROR. ]*/
-//                      LogError("Unable to make link in Broker");
-//                      result = BROKER_REMOVE_LINK_ERROR;
-//                  }
-//                  else
-//                  {
-//                      result = BROKER_OK;
-//                  }
-                    if (module_info->receiverThMsg != NULL&&source_module_info->senderThMsg != NULL) {
-                        if (Lock(module_info->receiverThMsg->lock) != LOCK_OK) {
-                            LogError("Lock for receiverThMsg failed.");
-                        }
-                        else {
-                            THREAD_MESSAGE_HANDLING_SENDER_FOR_RECEIVER* sender = module_info->receiverThMsg->senders;
-                            THREAD_MESSAGE_HANDLING_SENDER_FOR_RECEIVER* pre_sender = NULL;
-                            while (sender != NULL) {
-                                if (sender->sender_module_info == source_module_info) {
-                                    if (pre_sender == NULL) {
-                                        module_info->receiverThMsg->senders = sender->next;
-                                    }
-                                    else {
-                                        pre_sender->next = sender->next;
-                                    }
-                                    break;
-                                }
-                                pre_sender = sender;
-                                sender = sender->next;
-                            }
-                            Unlock(module_info->receiverThMsg->lock);
-
-                            if (Lock(source_module_info->senderThMsg->lock) != LOCK_OK) {
-                                LogError("Lock senderThMsg failed.");
-                            }
-                            else {
-                                THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* receiver = source_module_info->senderThMsg->receivers;
-                                THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* pre_receiver = NULL;
-                                while (receiver != NULL)
-                                {
-                                    if (receiver->receiver->module_info == module_info) {
-                                        if (pre_receiver != NULL) {
-                                            pre_receiver->next = receiver->next;
-                                        }
-                                        else {
-                                            source_module_info->senderThMsg->receivers = receiver->next;
-                                        }
-                                        break;
-                                    }
-                                    pre_receiver = receiver;
-                                    receiver = receiver->next;
-                                }
-                                if (receiver != NULL&&sender != NULL) {
-                                    free((void*)sender);
-
-                                    THREAD_MESSAGE_CTRL* sendingMsg = receiver->sendingMessages;
-                                    while (sendingMsg != NULL) {
-                                        THREAD_MESSAGE_CTRL* next = sendingMsg->next;
-                                        Message_Destroy(sendingMsg->msg);
-                                        free((void*)sendingMsg);
-                                        sendingMsg = next;
-                                    }
-                                    free((void*)receiver);
-                                    result = BROKER_OK;
-                                }
-                                else {
-                                    // may be error but shoudn't be system error
-                                    result = BROKER_REMOVE_LINK_ERROR;
-                                }
-                                Unlock(source_module_info->senderThMsg->lock);
-                            }
-                        }
-                    }
-                    else {
-                        // error
-                    }
+                    dest = serialized_message_layout_write(&layouts[i], dest);
                 }
+                *buf_size = size;
             }
-            /*Codes_SRS_BROKER_17_039: [ Broker_RemoveLink shall unlock the modules_lock. ]*/
-            Unlock(broker_data->modules_lock);
         }
+
+        for (i = 0; i < used; i++)
+        {
+            serialized_message_layout_deinit(&layouts[i]);
+        }
+        free(layouts);
     }
     return result;
 }
 
-static void broker_decrement_ref(BROKER_HANDLE broker)
+/* Priority class given by the BROKER_PRIORITY_PROPERTY property of the message. */
+static BROKER_MESSAGE_PRIORITY message_priority(MESSAGE_HANDLE message)
 {
-    /*Codes_SRS_BROKER_13_058: [If `broker` is NULL the function shall do nothing.]*/
-    if (broker != NULL)
+    BROKER_MESSAGE_PRIORITY result = BROKER_MESSAGE_PRIORITY_NORMAL;
+    CONSTMAP_HANDLE properties = Message_GetProperties(message);
+    if (properties != NULL)
     {
-        /*Codes_SRS_BROKER_13_111: [Otherwise, Broker_Destroy shall decrement the internal ref count of the message.]*/
-        /*Codes_SRS_BROKER_13_112: [If the ref count is zero then the allocated resources are freed.]*/
-        if (DEC_REF(BROKER_HANDLE_DATA, broker) == DEC_RETURN_ZERO)
+        const char* value = ConstMap_GetValue(properties, BROKER_PRIORITY_PROPERTY);
+        if (value != NULL)
         {
-            BROKER_HANDLE_DATA* broker_data = (BROKER_HANDLE_DATA*)broker; 
-            if (singlylinkedlist_get_head_item(broker_data->modules) != NULL)
+            if (strcmp(value, "high") == 0)
             {
-                LogError("WARNING: There are still active modules attached to the broker and the broker is being destroyed.");
+                result = BROKER_MESSAGE_PRIORITY_HIGH;
+            }
+            else if (strcmp(value, "low") == 0)
+            {
+                result = BROKER_MESSAGE_PRIORITY_LOW;
             }
-            /* May want to do nn_shutdown first for cleanliness. */
-            nn_really_close(broker_data->publish_socket);
-            STRING_delete(broker_data->url);
-            singlylinkedlist_destroy(broker_data->modules);
-            Lock_Deinit(broker_data->modules_lock);
-            free(broker_data);
         }
+        ConstMap_Destroy(properties);
     }
-    else
-    {
-        LogError("broker handle is NULL");
-    }
+    return result;
 }
 
-extern void Broker_Destroy(BROKER_HANDLE broker)
+/* Sinks whose Receive this thread is in through direct links, innermost last. */
+static BROKER_THREAD_LOCAL BROKER_MODULEINFO* direct_stack[BROKER_DIRECT_MAX_DEPTH];
+static BROKER_THREAD_LOCAL size_t direct_depth = 0;
+
+/* Called inside the routing read section. Stores in sinks the direct sinks of
+ * the route that take the message, pinned until direct_links_deliver, and
+ * returns how many there are. */
+static size_t direct_links_collect(const BROKER_ROUTE* route, MESSAGE_HANDLE message, BROKER_MODULEINFO** sinks)
 {
-    broker_decrement_ref(broker);
+    size_t result = 0;
+    CONSTMAP_HANDLE properties = NULL;
+    for (size_t i = 0; i < route->direct_count; i++) {
+        const BROKER_DIRECT_LINK* direct_link = route->direct_links[i];
+        if (direct_link->predicate != NULL && properties == NULL) {
+            properties = Message_GetProperties(message);
+        }
+        if (BrokerPredicate_Evaluate(direct_link->predicate, message_properties_lookup, (void*)properties) &&
+            broker_link_sampler_take((BROKER_LINK_SAMPLER*)&direct_link->sampler)) {
+            (void)BROKER_ATOMIC_ADD(&direct_link->sink->direct_calls, 1);
+            sinks[result++] = direct_link->sink;
+        }
+    }
+    if (properties != NULL) {
+        ConstMap_Destroy(properties);
+    }
+    return result;
 }
 
-extern void Broker_DecRef(BROKER_HANDLE broker)
+/* Called after the routing read section. Calls Receive of each sink from
+ * direct_links_collect on this thread with the publisher's own message, then
+ * unpins the sink. A sink already in Receive on this thread, or a chain
+ * deeper than BROKER_DIRECT_MAX_DEPTH, is refused rather than re-entered. */
+static BROKER_RESULT direct_links_deliver(BROKER_MODULEINFO** sinks, size_t count, MESSAGE_HANDLE message, uint64_t published_us)
 {
-    /*Codes_SRS_BROKER_13_113: [This function shall implement all the requirements of the Broker_Destroy API.]*/
-    broker_decrement_ref(broker);
+    BROKER_RESULT result = BROKER_OK;
+    for (size_t i = 0; i < count; i++) {
+        BROKER_MODULEINFO* sink = sinks[i];
+        bool reentered = false;
+        for (size_t depth = 0; depth < direct_depth; depth++) {
+            reentered = reentered || (direct_stack[depth] == sink);
+        }
+        if (reentered) {
+            LogError("direct link loops back to module [%p], message not delivered", sink->module->module_handle);
+            result = BROKER_ERROR;
+        }
+        else if (direct_depth == BROKER_DIRECT_MAX_DEPTH) {
+            LogError("direct links nested deeper than %d, message to module [%p] not delivered", BROKER_DIRECT_MAX_DEPTH, sink->module->module_handle);
+            result = BROKER_ERROR;
+        }
+        else if (Lock(sink->direct_lock) != LOCK_OK) {
+            LogError("Lock direct_lock of module [%p] failed.", sink->module->module_handle);
+            result = BROKER_ERROR;
+        }
+        else {
+            // modules expect one Receive at a time, so direct publishers to the same sink take turns
+            direct_stack[direct_depth++] = sink;
+            module_receive_measured(sink, &sink->direct_receive, message, published_us);
+            direct_depth--;
+            Unlock(sink->direct_lock);
+        }
+        (void)BROKER_ATOMIC_SUB(&sink->direct_calls, 1);
+    }
+    return result;
 }
 
-BROKER_RESULT Broker_Publish(BROKER_HANDLE broker, MODULE_HANDLE source, MESSAGE_HANDLE message)
+/* priority is NULL when it comes from the message properties; they are only
+ * read when the source has thread-message links. */
+static BROKER_RESULT broker_publish(BROKER_HANDLE broker, MODULE_HANDLE source, MESSAGE_HANDLE message, const BROKER_MESSAGE_PRIORITY* priority)
 {
     BROKER_RESULT result = BROKER_OK;
     /*Codes_SRS_BROKER_13_030: [If broker or message is NULL the function shall return BROKER_INVALIDARG.]*/
@@ -1174,138 +5388,405 @@ BROKER_RESULT Broker_Publish(BROKER_HANDLE broker, MODULE_HANDLE source, MESSAGE
     else
     {
         BROKER_HANDLE_DATA* broker_data = (BROKER_HANDLE_DATA*)broker;
-        /*Codes_SRS_BROKER_17_022: [ Broker_Publish shall Lock the modules lock. ]*/
-        if (Lock(broker_data->modules_lock) != LOCK_OK)
+        BROKER_MODULEINFO* stack_sinks[THREAD_MESSAGE_FILTER_STACK_LINKS];
+        BROKER_MODULEINFO** direct_sinks = stack_sinks;
+        size_t direct_count = 0;
+        uint64_t published_us = 0;
+        /* messages for full BROKER_LINK_QUEUE_POLICY_BLOCK links, queued after the read section */
+        THREAD_MESSAGE_BLOCKED* blocked = NULL;
+        /* publishers never take modules_lock, they read the routing snapshot of the current epoch */
+        size_t epoch = broker_routing_read_begin(broker_data);
+        const BROKER_ROUTING_TABLE* table = (const BROKER_ROUTING_TABLE*)BROKER_ATOMIC_LOAD_PTR(&broker_data->routing);
+        const BROKER_ROUTE* route = broker_routing_find(table, source);
+        if (route == NULL)
         {
-            /*Codes_SRS_BROKER_13_053: [This function shall return BROKER_ERROR if an underlying API call to the platform causes an error or BROKER_OK otherwise.]*/
-            LogError("Lock on broker_data->modules_lock failed");
+            LogError("Can't find BROKER_MODULEINFO");
             result = BROKER_ERROR;
-            return result;
         }
         else
         {
-            BROKER_MODULEINFO* source_info = broker_locate_handle(broker_data, source);
-            if (source_info == NULL) {
-                LogError("Can't find BROKER_MODULEINFO");
-                result = BROKER_ERROR;
-                return result;
-            }
-            bool normalMessaging = true;
-            if (source_info->senderThMsg != NULL) {
-                // TODO: current version is not support nanomsg and thread messaging.
-                if (Lock(source_info->senderThMsg->lock) != LOCK_OK) {
-                    LogError("Lock senderThMsg in Broker_Publish failed.");
-                }
-                else {
-                    THREAD_MESSAGE_HANDLING_RECIEVERS_IN_SENDER* target_receiver = source_info->senderThMsg->receivers;
-                    while (target_receiver != NULL) {
-                        THREAD_MESSAGE_CTRL* current_msg = (THREAD_MESSAGE_CTRL*)malloc(sizeof(THREAD_MESSAGE_CTRL));
-                        if (current_msg == NULL) {
-                            LogError("malloc current_msg in Broker_Publish failed.");
+            (void)BROKER_ATOMIC_ADD(&route->module_info->published, 1);
+            // thread-message sinks share one clone of the message, default sinks get it serialized once
+            if (route->thread_messaging) {
+                if (route->link_count > 0) {
+                    bool stack_matches[THREAD_MESSAGE_FILTER_STACK_LINKS];
+                    bool* matches = NULL;
+                    size_t match_count = route->link_count;
+                    if (route->filtered || route->grouped) {
+                        matches = (route->link_count <= THREAD_MESSAGE_FILTER_STACK_LINKS) ? stack_matches : (bool*)malloc(route->link_count * sizeof(bool));
+                        if (matches == NULL) {
+                            LogError("malloc of link matches in Broker_Publish failed.");
+                            result = BROKER_ERROR;
+                            match_count = 0;
                         }
                         else {
-                            current_msg->next = NULL;
-                            current_msg->msg = Message_Clone(message);
-                            if (current_msg->msg == NULL) {
-                                LogError("clone message in Broker_Publish failed.");
-                                free(current_msg);
+                            if (route->filtered) {
+                                match_count = thread_message_links_match(route, message, matches);
                             }
                             else {
-                                if (Lock(target_receiver->receiver->lock) != LOCK_OK) {
-                                    LogError("Lock receiver in Broker_Publish failed.");
+                                for (size_t i = 0; i < route->link_count; i++) {
+                                    matches[i] = true;
                                 }
-                                else {
-                                    THREAD_MESSAGE_CTRL* last_msg = target_receiver->sendingMessages;
-                                    if (last_msg == NULL) {
-                                        target_receiver->sendingMessages = current_msg;
-                                    }
-                                    else {
-                                        while (last_msg->next != NULL)
-                                        {
-                                            last_msg = last_msg->next;
-                                        }
-                                        last_msg->next = current_msg;
+                            }
+                            if (route->grouped) {
+                                match_count = thread_message_links_balance(route, message, matches, NULL);
+                            }
+                        }
+                    }
+                    // sinks whose predicate rejects the message, or whose group gave it to another, never see it nor are woken;
+                    // neither are any when the memory budget refuses it
+                    size_t bytes = (match_count > 0) ? message_footprint(message) : 0;
+                    if (match_count > 0 && broker_memory_admit(broker_data, table, bytes, &result)) {
+                        THREAD_MESSAGE_CTRL* shared_msg = thread_message_ctrl_create(broker_data, message, bytes, match_count, (priority == NULL) ? message_priority(message) : *priority);
+                        if (shared_msg == NULL) {
+                            LogError("create shared message in Broker_Publish failed.");
+                            result = BROKER_ERROR;
+                        }
+                        else {
+                            for (size_t i = 0; i < route->link_count; i++) {
+                                if (matches == NULL || matches[i]) {
+                                    // every sink is offered the message even if an earlier one is full
+                                    BROKER_RESULT link_result = (route->links[i]->coalesce_keys != NULL) ? thread_message_link_coalesce(route->links[i], shared_msg, &blocked) : thread_message_link_enqueue(route->links[i], shared_msg, &blocked);
+                                    if (link_result != BROKER_OK) {
+                                        result = link_result;
                                     }
-                                    Unlock(source_info->senderThMsg->lock);
-                                    Condition_Post(target_receiver->receiver->condition);
-                                    Unlock(target_receiver->receiver->lock);
-                                }
-                                if (Lock(source_info->senderThMsg->lock) != LOCK_OK) {
-                                    LogError("Lock senderThMsg in Broker_Publish failed.");
-                                }
-                                else {
-                                    target_receiver = target_receiver->next;
+                                    thread_message_receiver_wakeup(route->links[i]->receiver);
                                 }
                             }
                         }
                     }
-                    if (Unlock(source_info->senderThMsg->lock) != LOCK_OK) {
-                        LogError("unlock senderThMsg in Broker_Publish failed.");
+                    if (matches != stack_matches) {
+                        free(matches);
                     }
                 }
-                normalMessaging = false;
-                result = BROKER_OK;
             }
 
-            if (normalMessaging) {
-                int32_t msg_size;
-                /*Codes_SRS_BROKER_17_007: [ Broker_Publish shall clone the message. ]*/
-                MESSAGE_HANDLE msg = Message_Clone(message);
+            if (!route->thread_messaging || route->default_linked) {
+                size_t buf_size;
                 /*Codes_SRS_BROKER_17_008: [ Broker_Publish shall serialize the message. ]*/
-                msg_size = Message_ToByteArray(message, NULL, 0);
-                if (msg_size < 0)
+                void* nn_msg = serialize_message_to_nn_buffer(source, message, &buf_size);
+                if (nn_msg == NULL)
                 {
                     /*Codes_SRS_BROKER_13_053: [This function shall return BROKER_ERROR if an underlying API call to the platform causes an error or BROKER_OK otherwise.]*/
-                    LogError("unable to serialize a message [%p]", msg);
-                    Message_Destroy(msg);
+                    LogError("unable to serialize a message [%p]", message);
                     result = BROKER_ERROR;
                 }
                 else
                 {
-//                    time_t current = time(NULL);
-
-                    int32_t buf_size;
-                    /*Codes_SRS_BROKER_17_025: [ Broker_Publish shall allocate a nanomsg buffer the size of the serialized message + sizeof(MODULE_HANDLE). ]*/
-                    buf_size = msg_size + sizeof(MODULE_HANDLE);
-                    void* nn_msg = nn_allocmsg(buf_size, 0);
-                    if (nn_msg == NULL)
+                    /*Codes_SRS_BROKER_17_010: [ Broker_Publish shall send a message on the publish_socket. ]*/
+                    int nbytes = nn_send(broker_data->publish_socket, &nn_msg, NN_MSG, 0);
+                    if (nbytes < 0 || (size_t)nbytes != buf_size)
                     {
                         /*Codes_SRS_BROKER_13_053: [This function shall return BROKER_ERROR if an underlying API call to the platform causes an error or BROKER_OK otherwise.]*/
-                        LogError("unable to serialize a message [%p]", msg);
+                        LogError("unable to send a message [%p]", message);
+                        /*Codes_SRS_BROKER_17_012: [ Broker_Publish shall free the message. ]*/
+                        nn_freemsg(nn_msg);
                         result = BROKER_ERROR;
                     }
                     else
                     {
-                        /*Codes_SRS_BROKER_17_026: [ Broker_Publish shall copy source into the beginning of the nanomsg buffer. ]*/
-                        unsigned char *nn_msg_bytes = (unsigned char *)nn_msg;
-                        memcpy(nn_msg_bytes, &source, sizeof(MODULE_HANDLE));
-                        /*Codes_SRS_BROKER_17_027: [ Broker_Publish shall serialize the message into the remainder of the nanomsg buffer. ]*/
-                        nn_msg_bytes += sizeof(MODULE_HANDLE);
-                        Message_ToByteArray(message, nn_msg_bytes, msg_size);
-                        result = BROKER_OK;
+                        /*Codes_SRS_BROKER_17_011: [ Broker_Publish shall free the serialized message data. ]*/
+                        /* nanomsg owns the buffer once nn_send succeeded; result keeps any thread-message link error */
+                    }
+                }
+            }
+
+            if (route->direct_count > 0) {
+                if (route->direct_count > THREAD_MESSAGE_FILTER_STACK_LINKS) {
+                    direct_sinks = (BROKER_MODULEINFO**)malloc(route->direct_count * sizeof(BROKER_MODULEINFO*));
+                }
+                if (direct_sinks == NULL) {
+                    LogError("malloc of direct sinks in Broker_Publish failed.");
+                    result = BROKER_ERROR;
+                }
+                else {
+                    published_us = broker_clock_us();
+                    direct_count = direct_links_collect(route, message, direct_sinks);
+                }
+            }
+        }
+        broker_routing_read_end(broker_data, epoch);
+
+        // waiting for a slow sink inside the read section would hold up every link and module change
+        if (blocked != NULL) {
+            BROKER_RESULT blocked_result = thread_message_links_wait_blocked(blocked);
+            if (blocked_result != BROKER_OK) {
+                result = blocked_result;
+            }
+        }
+
+        // Receive may publish in turn, so it is only called once the read section is left
+        if (direct_count > 0) {
+            BROKER_RESULT direct_result = direct_links_deliver(direct_sinks, direct_count, message, published_us);
+            if (direct_result != BROKER_OK) {
+                result = direct_result;
+            }
+        }
+        if (direct_sinks != stack_sinks) {
+            free(direct_sinks);
+        }
+    }
+    /*Codes_SRS_BROKER_13_037: [ This function shall return BROKER_ERROR if an underlying API call to the platform causes an error or BROKER_OK otherwise. ]*/
+    return result;
+}
+
+BROKER_RESULT Broker_Publish(BROKER_HANDLE broker, MODULE_HANDLE source, MESSAGE_HANDLE message)
+{
+    return broker_publish(broker, source, message, NULL);
+}
+
+BROKER_RESULT Broker_PublishWithPriority(BROKER_HANDLE broker, MODULE_HANDLE source, MESSAGE_HANDLE message, BROKER_MESSAGE_PRIORITY priority)
+{
+    BROKER_RESULT result;
+    if (priority != BROKER_MESSAGE_PRIORITY_LOW && priority != BROKER_MESSAGE_PRIORITY_NORMAL && priority != BROKER_MESSAGE_PRIORITY_HIGH)
+    {
+        LogError("invalid priority %d", (int)priority);
+        result = BROKER_INVALIDARG;
+    }
+    else
+    {
+        result = broker_publish(broker, source, message, &priority);
+    }
+    return result;
+}
+
+BROKER_RESULT Broker_PublishBatch(BROKER_HANDLE broker, MODULE_HANDLE source, MESSAGE_HANDLE* messages, size_t count)
+{
+    BROKER_RESULT result = BROKER_OK;
+    size_t i;
+
+    if (broker == NULL || source == NULL || messages == NULL || count == 0 || count > INT32_MAX)
+    {
+        LogError("Broker handle, source, and/or messages are NULL or empty");
+        return BROKER_INVALIDARG;
+    }
+    for (i = 0; i < count; i++)
+    {
+        if (messages[i] == NULL)
+        {
+            LogError("message %zu of batch is NULL", i);
+            return BROKER_INVALIDARG;
+        }
+    }
 
-                        /*Codes_SRS_BROKER_17_010: [ Broker_Publish shall send a message on the publish_socket. ]*/
-                        int nbytes = nn_send(broker_data->publish_socket, &nn_msg, NN_MSG, 0);
-                        if (nbytes != buf_size)
+    {
+        BROKER_HANDLE_DATA* broker_data = (BROKER_HANDLE_DATA*)broker;
+        /* direct_sinks[m * direct_count + k]: k-th sink taking message m, direct_taken[m] of them */
+        BROKER_MODULEINFO** direct_sinks = NULL;
+        size_t* direct_taken = NULL;
+        size_t direct_count = 0;
+        uint64_t published_us = 0;
+        /* messages for full BROKER_LINK_QUEUE_POLICY_BLOCK links, queued after the read section */
+        THREAD_MESSAGE_BLOCKED* blocked = NULL;
+        /* one route lookup for the whole batch */
+        size_t epoch = broker_routing_read_begin(broker_data);
+        const BROKER_ROUTING_TABLE* table = (const BROKER_ROUTING_TABLE*)BROKER_ATOMIC_LOAD_PTR(&broker_data->routing);
+        const BROKER_ROUTE* route = broker_routing_find(table, source);
+        if (route != NULL)
+        {
+            (void)BROKER_ATOMIC_ADD(&route->module_info->published, count);
+        }
+        if (route == NULL)
+        {
+            LogError("Can't find BROKER_MODULEINFO");
+            result = BROKER_ERROR;
+        }
+        else
+        {
+            /* thread-message sinks and default sinks are both served */
+            if (route->thread_messaging && route->link_count > 0)
+            {
+                bool selective = route->filtered || route->grouped;
+                /* with predicates or groups, the second half holds the messages taken by one sink */
+                THREAD_MESSAGE_CTRL** shared_msgs = (THREAD_MESSAGE_CTRL**)malloc((selective ? 2 : 1) * count * sizeof(THREAD_MESSAGE_CTRL*));
+                /* matches[m * link_count + l]: sink l takes message m */
+                bool* matches = selective ? (bool*)malloc(count * route->link_count * sizeof(bool)) : NULL;
+                /* shortest-queue groups also count what the batch already gave each sink */
+                size_t* pending = route->grouped ? (size_t*)calloc(route->link_count, sizeof(size_t)) : NULL;
+                if (shared_msgs == NULL || (selective && matches == NULL) || (route->grouped && pending == NULL))
+                {
+                    LogError("malloc of batch in Broker_PublishBatch failed.");
+                    result = BROKER_ERROR;
+                }
+                else
+                {
+                    size_t created;
+                    /* without matches, the messages every sink takes; the memory budget may refuse some */
+                    size_t kept = 0;
+                    for (created = 0; created < count; created++)
+                    {
+                        size_t match_count = route->link_count;
+                        THREAD_MESSAGE_CTRL* shared_msg = NULL;
+                        if (matches != NULL)
                         {
-                            /*Codes_SRS_BROKER_13_053: [This function shall return BROKER_ERROR if an underlying API call to the platform causes an error or BROKER_OK otherwise.]*/
-                            LogError("unable to send a message [%p]", msg);
-                            /*Codes_SRS_BROKER_17_012: [ Broker_Publish shall free the message. ]*/
-                            nn_freemsg(nn_msg);
-                            result = BROKER_ERROR;
+                            bool* message_matches = matches + created * route->link_count;
+                            if (route->filtered)
+                            {
+                                match_count = thread_message_links_match(route, messages[created], message_matches);
+                            }
+                            else
+                            {
+                                for (i = 0; i < route->link_count; i++)
+                                {
+                                    message_matches[i] = true;
+                                }
+                            }
+                            if (route->grouped)
+                            {
+                                match_count = thread_message_links_balance(route, messages[created], message_matches, pending);
+                            }
+                        }
+                        /* a message no sink takes, or the memory budget refuses, is left out */
+                        if (match_count > 0)
+                        {
+                            size_t bytes = message_footprint(messages[created]);
+                            if (!broker_memory_admit(broker_data, table, bytes, &result))
+                            {
+                                if (matches != NULL)
+                                {
+                                    (void)memset(matches + created * route->link_count, 0, route->link_count * sizeof(bool));
+                                }
+                            }
+                            else if ((shared_msg = thread_message_ctrl_create(broker_data, messages[created], bytes, match_count, message_priority(messages[created]))) == NULL)
+                            {
+                                break;
+                            }
+                        }
+                        if (matches != NULL)
+                        {
+                            shared_msgs[created] = shared_msg;
+                        }
+                        else if (shared_msg != NULL)
+                        {
+                            shared_msgs[kept++] = shared_msg;
                         }
                     }
-                    /*Codes_SRS_BROKER_17_012: [ Broker_Publish shall free the message. ]*/
-                    Message_Destroy(msg);
-                    /*Codes_SRS_BROKER_17_011: [ Broker_Publish shall free the serialized message data. ]*/
+
+                    if (created < count)
+                    {
+                        /* nothing is queued yet, so the batch is dropped as a whole */
+                        LogError("create shared message %zu in Broker_PublishBatch failed.", created);
+                        for (i = 0; i < ((matches != NULL) ? created : kept); i++)
+                        {
+                            if (shared_msgs[i] != NULL)
+                            {
+                                thread_message_ctrl_free(shared_msgs[i]);
+                            }
+                        }
+                        result = BROKER_ERROR;
+                    }
+                    else
+                    {
+                        /* one ring reservation and one wakeup per sink */
+                        for (i = 0; i < route->link_count; i++)
+                        {
+                            THREAD_MESSAGE_CTRL** taken = shared_msgs;
+                            size_t taken_count = kept;
+                            if (matches != NULL)
+                            {
+                                size_t m;
+                                taken = shared_msgs + count;
+                                taken_count = 0;
+                                for (m = 0; m < count; m++)
+                                {
+                                    if (matches[m * route->link_count + i])
+                                    {
+                                        taken[taken_count++] = shared_msgs[m];
+                                    }
+                                }
+                            }
+                            if (taken_count > 0)
+                            {
+                                BROKER_RESULT link_result = thread_message_link_enqueue_batch(route->links[i], taken, taken_count, &blocked);
+                                if (link_result != BROKER_OK)
+                                {
+                                    result = link_result;
+                                }
+                                thread_message_receiver_wakeup(route->links[i]->receiver);
+                            }
+                        }
+                    }
+                }
+                free(pending);
+                free(matches);
+                free(shared_msgs);
+            }
+            if (!route->thread_messaging || route->default_linked)
+            {
+                size_t buf_size;
+                size_t skipped;
+                /* one frame, and so one nn_send, for the whole batch */
+                void* nn_msg = serialize_batch_to_nn_buffer(source, messages, count, &buf_size, &skipped);
+                if (nn_msg == NULL)
+                {
+                    LogError("unable to serialize a batch of %zu messages", count);
+                    result = BROKER_ERROR;
+                }
+                else
+                {
+                    int nbytes = nn_send(broker_data->publish_socket, &nn_msg, NN_MSG, 0);
+                    if (nbytes < 0 || (size_t)nbytes != buf_size)
+                    {
+                        LogError("unable to send a batch of %zu messages", count);
+                        nn_freemsg(nn_msg);
+                        result = BROKER_ERROR;
+                    }
+                    else if (skipped > 0)
+                    {
+                        LogError("%zu of %zu messages in the batch could not be serialized", skipped, count);
+                        result = BROKER_ERROR;
+                    }
+                }
+            }
+            if (route->direct_count > 0)
+            {
+                direct_sinks = (BROKER_MODULEINFO**)malloc(count * route->direct_count * sizeof(BROKER_MODULEINFO*));
+                direct_taken = (size_t*)malloc(count * sizeof(size_t));
+                if (direct_sinks == NULL || direct_taken == NULL)
+                {
+                    LogError("malloc of direct sinks in Broker_PublishBatch failed.");
+                    result = BROKER_ERROR;
+                }
+                else
+                {
+                    direct_count = route->direct_count;
+                    published_us = broker_clock_us();
+                    for (i = 0; i < count; i++)
+                    {
+                        direct_taken[i] = direct_links_collect(route, messages[i], direct_sinks + i * direct_count);
+                    }
                 }
+            }
+        }
+        broker_routing_read_end(broker_data, epoch);
 
+        /* waiting for a slow sink inside the read section would hold up every link and module change */
+        if (blocked != NULL)
+        {
+            BROKER_RESULT blocked_result = thread_message_links_wait_blocked(blocked);
+            if (blocked_result != BROKER_OK)
+            {
+                result = blocked_result;
+            }
+        }
+
+        /* direct sinks get the messages in order, on this thread, once the read section is left */
+        if (direct_count > 0)
+        {
+            for (i = 0; i < count; i++)
+            {
+                if (direct_taken[i] > 0)
+                {
+                    BROKER_RESULT direct_result = direct_links_deliver(direct_sinks + i * direct_count, direct_taken[i], messages[i], published_us);
+                    if (direct_result != BROKER_OK)
+                    {
+                        result = direct_result;
+                    }
+                }
             }
-            /*Codes_SRS_BROKER_17_023: [ Broker_Publish shall Unlock the modules lock. ]*/
-            Unlock(broker_data->modules_lock);
         }
+        free(direct_taken);
+        free(direct_sinks);
     }
-    /*Codes_SRS_BROKER_13_037: [ This function shall return BROKER_ERROR if an underlying API call to the platform causes an error or BROKER_OK otherwise. ]*/
     return result;
 }
-
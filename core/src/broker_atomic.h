@@ -0,0 +1,67 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef BROKER_ATOMIC_H
+#define BROKER_ATOMIC_H
+
+/* Minimal set of atomic operations used by the broker hot path. All values
+ * are size_t or pointers so the same code works on 32 and 64 bit targets. */
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define BROKER_CACHE_LINE_SIZE 64
+
+#if defined(_MSC_VER)
+
+#include <windows.h>
+
+#if defined(_WIN64)
+#define BROKER_ATOMIC_CAS(p, expected, desired) \
+    (InterlockedCompareExchange64((volatile LONG64*)(p), (LONG64)(desired), (LONG64)(expected)) == (LONG64)(expected))
+#define BROKER_ATOMIC_ADD(p, v) \
+    ((size_t)InterlockedExchangeAdd64((volatile LONG64*)(p), (LONG64)(v)) + (size_t)(v))
+#define BROKER_ATOMIC_EXCHANGE(p, v) \
+    ((size_t)InterlockedExchange64((volatile LONG64*)(p), (LONG64)(v)))
+#else
+#define BROKER_ATOMIC_CAS(p, expected, desired) \
+    (InterlockedCompareExchange((volatile LONG*)(p), (LONG)(desired), (LONG)(expected)) == (LONG)(expected))
+#define BROKER_ATOMIC_ADD(p, v) \
+    ((size_t)InterlockedExchangeAdd((volatile LONG*)(p), (LONG)(v)) + (size_t)(v))
+#define BROKER_ATOMIC_EXCHANGE(p, v) \
+    ((size_t)InterlockedExchange((volatile LONG*)(p), (LONG)(v)))
+#endif
+
+#define BROKER_ATOMIC_SUB(p, v) BROKER_ATOMIC_ADD(p, (size_t)0 - (size_t)(v))
+#define BROKER_ATOMIC_FENCE() MemoryBarrier()
+/* volatile accesses have acquire/release semantics with /volatile:ms */
+#define BROKER_ATOMIC_LOAD(p) (*(volatile size_t*)(p))
+#define BROKER_ATOMIC_STORE(p, v) (*(volatile size_t*)(p) = (size_t)(v))
+#define BROKER_ATOMIC_LOAD_PTR(p) (*(void* volatile*)(p))
+#define BROKER_ATOMIC_STORE_PTR(p, v) (*(void* volatile*)(p) = (void*)(v))
+
+#else
+
+#define BROKER_ATOMIC_CAS(p, expected, desired) \
+    __sync_bool_compare_and_swap((p), (expected), (desired))
+#define BROKER_ATOMIC_ADD(p, v) __atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define BROKER_ATOMIC_SUB(p, v) __atomic_sub_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define BROKER_ATOMIC_EXCHANGE(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define BROKER_ATOMIC_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define BROKER_ATOMIC_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define BROKER_ATOMIC_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define BROKER_ATOMIC_LOAD_PTR(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define BROKER_ATOMIC_STORE_PTR(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BROKER_ATOMIC_H
@@ -0,0 +1,383 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include <stdlib.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "azure_c_shared_utility/gballoc.h"
+#include "azure_c_shared_utility/xlogging.h"
+#include "azure_c_shared_utility/lock.h"
+#include "azure_c_shared_utility/condition.h"
+#include "azure_c_shared_utility/threadapi.h"
+
+#include "broker_atomic.h"
+#include "broker_pool.h"
+#include "broker_slab.h"
+
+#define BROKER_POOL_DEQUE_INITIAL_CAPACITY 64
+
+typedef struct BROKER_POOL_ITEM_TAG
+{
+    BROKER_POOL_TASK task;
+    void* context;
+} BROKER_POOL_ITEM;
+
+/* Growable ring guarded by its own lock. The owner and thieves both take
+ * from the head so a task that resubmits itself goes behind the others. */
+typedef struct BROKER_POOL_DEQUE_TAG
+{
+    LOCK_HANDLE lock;
+    BROKER_POOL_ITEM* items;
+    size_t capacity;
+    size_t head;
+    size_t count;
+} BROKER_POOL_DEQUE;
+
+typedef struct BROKER_POOL_WORKER_TAG
+{
+    struct BROKER_POOL_TAG* pool;
+    size_t index;
+    THREAD_HANDLE thread;
+    BROKER_POOL_DEQUE deque;
+    char pad[BROKER_CACHE_LINE_SIZE];
+} BROKER_POOL_WORKER;
+
+typedef struct BROKER_POOL_TAG
+{
+    BROKER_POOL_WORKER* workers;
+    size_t worker_count;
+    volatile size_t next_worker;
+    /* tasks queued in any deque; workers only sleep when it is 0 */
+    volatile size_t pending;
+    volatile size_t sleeping;
+    volatile size_t stopping;
+    LOCK_HANDLE idle_lock;
+    COND_HANDLE idle_condition;
+} BROKER_POOL;
+
+static BROKER_THREAD_LOCAL BROKER_POOL_WORKER* current_worker = NULL;
+
+static size_t broker_pool_cpu_count(void)
+{
+    size_t result;
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    result = (size_t)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    result = count > 0 ? (size_t)count : 1;
+#endif
+    return result;
+}
+
+static int broker_pool_deque_init(BROKER_POOL_DEQUE* deque)
+{
+    int result;
+    deque->items = (BROKER_POOL_ITEM*)malloc(BROKER_POOL_DEQUE_INITIAL_CAPACITY * sizeof(BROKER_POOL_ITEM));
+    if (deque->items == NULL)
+    {
+        LogError("malloc of pool deque failed");
+        result = __LINE__;
+    }
+    else
+    {
+        deque->lock = Lock_Init();
+        if (deque->lock == NULL)
+        {
+            LogError("Lock_Init failed");
+            free(deque->items);
+            result = __LINE__;
+        }
+        else
+        {
+            deque->capacity = BROKER_POOL_DEQUE_INITIAL_CAPACITY;
+            deque->head = 0;
+            deque->count = 0;
+            result = 0;
+        }
+    }
+    return result;
+}
+
+static void broker_pool_deque_deinit(BROKER_POOL_DEQUE* deque)
+{
+    Lock_Deinit(deque->lock);
+    free(deque->items);
+}
+
+static int broker_pool_deque_push(BROKER_POOL_DEQUE* deque, BROKER_POOL_TASK task, void* context)
+{
+    int result;
+    if (Lock(deque->lock) != LOCK_OK)
+    {
+        LogError("unable to lock pool deque");
+        result = __LINE__;
+    }
+    else
+    {
+        if (deque->count == deque->capacity)
+        {
+            BROKER_POOL_ITEM* items = (BROKER_POOL_ITEM*)malloc(2 * deque->capacity * sizeof(BROKER_POOL_ITEM));
+            if (items != NULL)
+            {
+                size_t i;
+                for (i = 0; i < deque->count; i++)
+                {
+                    items[i] = deque->items[(deque->head + i) % deque->capacity];
+                }
+                free(deque->items);
+                deque->items = items;
+                deque->capacity *= 2;
+                deque->head = 0;
+            }
+        }
+
+        if (deque->count == deque->capacity)
+        {
+            LogError("unable to grow pool deque");
+            result = __LINE__;
+        }
+        else
+        {
+            BROKER_POOL_ITEM* item = &deque->items[(deque->head + deque->count) % deque->capacity];
+            item->task = task;
+            item->context = context;
+            deque->count++;
+            result = 0;
+        }
+        (void)Unlock(deque->lock);
+    }
+    return result;
+}
+
+static bool broker_pool_deque_pop(BROKER_POOL_DEQUE* deque, BROKER_POOL_ITEM* item)
+{
+    bool result = false;
+    if (Lock(deque->lock) == LOCK_OK)
+    {
+        if (deque->count > 0)
+        {
+            *item = deque->items[deque->head];
+            deque->head = (deque->head + 1) % deque->capacity;
+            deque->count--;
+            result = true;
+        }
+        (void)Unlock(deque->lock);
+    }
+    return result;
+}
+
+static bool broker_pool_take(BROKER_POOL_WORKER* worker, BROKER_POOL_ITEM* item)
+{
+    BROKER_POOL* pool = worker->pool;
+    bool result = broker_pool_deque_pop(&worker->deque, item);
+    size_t i;
+
+    for (i = 1; !result && i < pool->worker_count; i++)
+    {
+        result = broker_pool_deque_pop(&pool->workers[(worker->index + i) % pool->worker_count].deque, item);
+    }
+    if (result)
+    {
+        (void)BROKER_ATOMIC_SUB(&pool->pending, 1);
+    }
+    return result;
+}
+
+static int broker_pool_worker(void* context)
+{
+    BROKER_POOL_WORKER* worker = (BROKER_POOL_WORKER*)context;
+    BROKER_POOL* pool = worker->pool;
+    BROKER_POOL_ITEM item;
+
+    current_worker = worker;
+    while (true)
+    {
+        if (broker_pool_take(worker, &item))
+        {
+            item.task(item.context);
+        }
+        else if (BROKER_ATOMIC_LOAD(&pool->stopping) != 0)
+        {
+            break;
+        }
+        else if (Lock(pool->idle_lock) == LOCK_OK)
+        {
+            /* pairs with the fence in BrokerPool_Submit: either the
+             * submitter sees us sleeping or we see its task */
+            (void)BROKER_ATOMIC_ADD(&pool->sleeping, 1);
+            BROKER_ATOMIC_FENCE();
+            if (BROKER_ATOMIC_LOAD(&pool->pending) == 0 && BROKER_ATOMIC_LOAD(&pool->stopping) == 0)
+            {
+                (void)Condition_Wait(pool->idle_condition, pool->idle_lock, 0);
+            }
+            (void)BROKER_ATOMIC_SUB(&pool->sleeping, 1);
+            (void)Unlock(pool->idle_lock);
+        }
+    }
+    current_worker = NULL;
+    BrokerSlab_ReleaseThreadCaches();
+    return 0;
+}
+
+BROKER_POOL_HANDLE BrokerPool_Create(size_t worker_count)
+{
+    BROKER_POOL* result = (BROKER_POOL*)malloc(sizeof(BROKER_POOL));
+    if (result == NULL)
+    {
+        LogError("malloc of BROKER_POOL failed");
+    }
+    else
+    {
+        result->worker_count = worker_count != 0 ? worker_count : broker_pool_cpu_count();
+        result->next_worker = 0;
+        result->pending = 0;
+        result->sleeping = 0;
+        result->stopping = 0;
+        result->workers = (BROKER_POOL_WORKER*)malloc(result->worker_count * sizeof(BROKER_POOL_WORKER));
+        if (result->workers == NULL)
+        {
+            LogError("malloc of %zu pool workers failed", result->worker_count);
+            free(result);
+            result = NULL;
+        }
+        else if ((result->idle_lock = Lock_Init()) == NULL)
+        {
+            LogError("Lock_Init failed");
+            free(result->workers);
+            free(result);
+            result = NULL;
+        }
+        else if ((result->idle_condition = Condition_Init()) == NULL)
+        {
+            LogError("Condition_Init failed");
+            Lock_Deinit(result->idle_lock);
+            free(result->workers);
+            free(result);
+            result = NULL;
+        }
+        else
+        {
+            size_t initialized;
+            for (initialized = 0; initialized < result->worker_count; initialized++)
+            {
+                BROKER_POOL_WORKER* worker = &result->workers[initialized];
+                worker->pool = result;
+                worker->index = initialized;
+                worker->thread = NULL;
+                if (broker_pool_deque_init(&worker->deque) != 0)
+                {
+                    break;
+                }
+            }
+
+            if (initialized < result->worker_count)
+            {
+                LogError("unable to initialize pool worker %zu", initialized);
+                result->worker_count = initialized;
+                BrokerPool_Destroy(result);
+                result = NULL;
+            }
+            else
+            {
+                size_t started;
+                for (started = 0; started < result->worker_count; started++)
+                {
+                    if (ThreadAPI_Create(&result->workers[started].thread, broker_pool_worker, &result->workers[started]) != THREADAPI_OK)
+                    {
+                        LogError("unable to start pool worker %zu", started);
+                        result->workers[started].thread = NULL;
+                        BrokerPool_Destroy(result);
+                        result = NULL;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    return result;
+}
+
+int BrokerPool_Submit(BROKER_POOL_HANDLE pool, BROKER_POOL_TASK task, void* context)
+{
+    int result;
+    if (pool == NULL || task == NULL)
+    {
+        LogError("invalid arg pool=%p, task=%p", pool, task);
+        result = __LINE__;
+    }
+    else
+    {
+        BROKER_POOL_WORKER* worker = (current_worker != NULL && current_worker->pool == pool) ?
+            current_worker :
+            &pool->workers[BROKER_ATOMIC_ADD(&pool->next_worker, 1) % pool->worker_count];
+
+        if (broker_pool_deque_push(&worker->deque, task, context) != 0)
+        {
+            result = __LINE__;
+        }
+        else
+        {
+            (void)BROKER_ATOMIC_ADD(&pool->pending, 1);
+            BROKER_ATOMIC_FENCE();
+            if (BROKER_ATOMIC_LOAD(&pool->sleeping) != 0 && Lock(pool->idle_lock) == LOCK_OK)
+            {
+                (void)Condition_Post(pool->idle_condition);
+                (void)Unlock(pool->idle_lock);
+            }
+            result = 0;
+        }
+    }
+    return result;
+}
+
+bool BrokerPool_IsWorkerThread(void)
+{
+    return current_worker != NULL;
+}
+
+void BrokerPool_Destroy(BROKER_POOL_HANDLE pool)
+{
+    if (pool != NULL)
+    {
+        size_t i;
+
+        BROKER_ATOMIC_STORE(&pool->stopping, 1);
+        BROKER_ATOMIC_FENCE();
+        if (Lock(pool->idle_lock) == LOCK_OK)
+        {
+            /* a worker checks stopping under idle_lock before it waits, so
+             * every worker is either waiting now or will not wait */
+            for (i = 0; i < pool->worker_count; i++)
+            {
+                (void)Condition_Post(pool->idle_condition);
+            }
+            (void)Unlock(pool->idle_lock);
+        }
+
+        for (i = 0; i < pool->worker_count; i++)
+        {
+            if (pool->workers[i].thread != NULL)
+            {
+                int thread_result;
+                if (ThreadAPI_Join(pool->workers[i].thread, &thread_result) != THREADAPI_OK)
+                {
+                    LogError("unable to join pool worker %zu", i);
+                }
+            }
+        }
+        for (i = 0; i < pool->worker_count; i++)
+        {
+            broker_pool_deque_deinit(&pool->workers[i].deque);
+        }
+        Condition_Deinit(pool->idle_condition);
+        Lock_Deinit(pool->idle_lock);
+        free(pool->workers);
+        free(pool);
+    }
+}
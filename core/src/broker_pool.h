@@ -0,0 +1,50 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef BROKER_POOL_H
+#define BROKER_POOL_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#if defined(_MSC_VER)
+#define BROKER_THREAD_LOCAL __declspec(thread)
+#else
+#define BROKER_THREAD_LOCAL __thread
+#endif
+
+/** @brief  Fixed set of worker threads running short tasks.
+ *
+ *  Every worker owns a FIFO deque. A task submitted from a worker goes to
+ *  that worker's deque, tasks from other threads are spread round robin, and
+ *  a worker whose deque is empty steals from the others before it sleeps.
+ *  Tasks must not block waiting for other tasks.
+ */
+typedef struct BROKER_POOL_TAG* BROKER_POOL_HANDLE;
+
+typedef void(*BROKER_POOL_TASK)(void* context);
+
+/** @brief  Starts @c worker_count workers, or one per CPU when it is 0. */
+BROKER_POOL_HANDLE BrokerPool_Create(size_t worker_count);
+
+/** @brief  Queues @c task to run once on some worker. Returns 0 on success. */
+int BrokerPool_Submit(BROKER_POOL_HANDLE pool, BROKER_POOL_TASK task, void* context);
+
+/** @brief  True when the caller runs on a worker of any pool. */
+bool BrokerPool_IsWorkerThread(void);
+
+/** @brief  Runs the tasks still queued, then joins the workers and frees the
+ *          pool. Must not be called from a worker.
+ */
+void BrokerPool_Destroy(BROKER_POOL_HANDLE pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BROKER_POOL_H
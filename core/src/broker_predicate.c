@@ -0,0 +1,473 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "azure_c_shared_utility/gballoc.h"
+#include "azure_c_shared_utility/xlogging.h"
+
+#include "broker_predicate.h"
+
+typedef enum BROKER_PREDICATE_OP_TAG
+{
+    BROKER_PREDICATE_OP_OR,
+    BROKER_PREDICATE_OP_AND,
+    BROKER_PREDICATE_OP_NOT,
+    BROKER_PREDICATE_OP_EQUAL,
+    BROKER_PREDICATE_OP_NOT_EQUAL,
+    BROKER_PREDICATE_OP_IN,
+    BROKER_PREDICATE_OP_EXISTS
+} BROKER_PREDICATE_OP;
+
+/* Nodes and strings refer to each other by index so the arrays can grow
+ * while parsing. */
+typedef struct BROKER_PREDICATE_NODE_TAG
+{
+    BROKER_PREDICATE_OP op;
+    /* operands of OR and AND, left only for NOT */
+    size_t left;
+    size_t right;
+    /* property name, then value_count values, all in strings */
+    size_t name;
+    size_t values;
+    size_t value_count;
+} BROKER_PREDICATE_NODE;
+
+typedef struct BROKER_PREDICATE_TAG
+{
+    BROKER_PREDICATE_NODE* nodes;
+    size_t node_count;
+    size_t node_capacity;
+    char** strings;
+    size_t string_count;
+    size_t string_capacity;
+    size_t root;
+} BROKER_PREDICATE;
+
+typedef enum BROKER_PREDICATE_TOKEN_TAG
+{
+    BROKER_PREDICATE_TOKEN_END,
+    BROKER_PREDICATE_TOKEN_WORD,
+    BROKER_PREDICATE_TOKEN_OR,
+    BROKER_PREDICATE_TOKEN_AND,
+    BROKER_PREDICATE_TOKEN_NOT,
+    BROKER_PREDICATE_TOKEN_EQUAL,
+    BROKER_PREDICATE_TOKEN_NOT_EQUAL,
+    BROKER_PREDICATE_TOKEN_OPEN,
+    BROKER_PREDICATE_TOKEN_CLOSE,
+    BROKER_PREDICATE_TOKEN_OPEN_LIST,
+    BROKER_PREDICATE_TOKEN_CLOSE_LIST,
+    BROKER_PREDICATE_TOKEN_COMMA,
+    BROKER_PREDICATE_TOKEN_ERROR
+} BROKER_PREDICATE_TOKEN;
+
+typedef struct BROKER_PREDICATE_PARSER_TAG
+{
+    const char* text;
+    const char* position;
+    BROKER_PREDICATE_TOKEN token;
+    /* the current word, without quotes */
+    const char* word;
+    size_t word_length;
+    bool quoted;
+    BROKER_PREDICATE* predicate;
+} BROKER_PREDICATE_PARSER;
+
+#define BROKER_PREDICATE_NO_NODE ((size_t)-1)
+
+static bool is_word_char(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+        c == '_' || c == '-' || c == '.' || c == ':';
+}
+
+static void parser_next(BROKER_PREDICATE_PARSER* parser)
+{
+    const char* p = parser->position;
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+    {
+        p++;
+    }
+    parser->quoted = false;
+    parser->word = p;
+    parser->word_length = 0;
+
+    if (*p == '\0')
+    {
+        parser->token = BROKER_PREDICATE_TOKEN_END;
+    }
+    else if (p[0] == '|' && p[1] == '|')
+    {
+        parser->token = BROKER_PREDICATE_TOKEN_OR;
+        p += 2;
+    }
+    else if (p[0] == '&' && p[1] == '&')
+    {
+        parser->token = BROKER_PREDICATE_TOKEN_AND;
+        p += 2;
+    }
+    else if (p[0] == '=' && p[1] == '=')
+    {
+        parser->token = BROKER_PREDICATE_TOKEN_EQUAL;
+        p += 2;
+    }
+    else if (p[0] == '!' && p[1] == '=')
+    {
+        parser->token = BROKER_PREDICATE_TOKEN_NOT_EQUAL;
+        p += 2;
+    }
+    else if (*p == '!' || *p == '(' || *p == ')' || *p == '[' || *p == ']' || *p == ',')
+    {
+        parser->token =
+            (*p == '!') ? BROKER_PREDICATE_TOKEN_NOT :
+            (*p == '(') ? BROKER_PREDICATE_TOKEN_OPEN :
+            (*p == ')') ? BROKER_PREDICATE_TOKEN_CLOSE :
+            (*p == '[') ? BROKER_PREDICATE_TOKEN_OPEN_LIST :
+            (*p == ']') ? BROKER_PREDICATE_TOKEN_CLOSE_LIST :
+            BROKER_PREDICATE_TOKEN_COMMA;
+        p++;
+    }
+    else if (*p == '"')
+    {
+        const char* end = strchr(p + 1, '"');
+        if (end == NULL)
+        {
+            parser->token = BROKER_PREDICATE_TOKEN_ERROR;
+        }
+        else
+        {
+            parser->token = BROKER_PREDICATE_TOKEN_WORD;
+            parser->quoted = true;
+            parser->word = p + 1;
+            parser->word_length = (size_t)(end - (p + 1));
+            p = end + 1;
+        }
+    }
+    else if (is_word_char(*p))
+    {
+        parser->token = BROKER_PREDICATE_TOKEN_WORD;
+        while (is_word_char(*p))
+        {
+            p++;
+        }
+        parser->word_length = (size_t)(p - parser->word);
+    }
+    else
+    {
+        parser->token = BROKER_PREDICATE_TOKEN_ERROR;
+    }
+    parser->position = p;
+}
+
+static bool parser_word_is(const BROKER_PREDICATE_PARSER* parser, const char* keyword)
+{
+    return parser->token == BROKER_PREDICATE_TOKEN_WORD && !parser->quoted &&
+        parser->word_length == strlen(keyword) && strncmp(parser->word, keyword, parser->word_length) == 0;
+}
+
+/* Copies the current word into the string table, returns its index or
+ * BROKER_PREDICATE_NO_NODE. */
+static size_t parser_add_string(BROKER_PREDICATE_PARSER* parser)
+{
+    size_t result = BROKER_PREDICATE_NO_NODE;
+    BROKER_PREDICATE* predicate = parser->predicate;
+    if (predicate->string_count == predicate->string_capacity)
+    {
+        size_t capacity = (predicate->string_capacity == 0) ? 8 : 2 * predicate->string_capacity;
+        char** strings = (char**)realloc(predicate->strings, capacity * sizeof(char*));
+        if (strings != NULL)
+        {
+            predicate->strings = strings;
+            predicate->string_capacity = capacity;
+        }
+    }
+    if (predicate->string_count < predicate->string_capacity)
+    {
+        char* copy = (char*)malloc(parser->word_length + 1);
+        if (copy != NULL)
+        {
+            memcpy(copy, parser->word, parser->word_length);
+            copy[parser->word_length] = '\0';
+            predicate->strings[predicate->string_count] = copy;
+            result = predicate->string_count++;
+        }
+    }
+    if (result == BROKER_PREDICATE_NO_NODE)
+    {
+        LogError("unable to allocate predicate string");
+    }
+    return result;
+}
+
+static size_t parser_add_node(BROKER_PREDICATE_PARSER* parser, BROKER_PREDICATE_OP op, size_t left, size_t right)
+{
+    size_t result = BROKER_PREDICATE_NO_NODE;
+    BROKER_PREDICATE* predicate = parser->predicate;
+    if (predicate->node_count == predicate->node_capacity)
+    {
+        size_t capacity = (predicate->node_capacity == 0) ? 8 : 2 * predicate->node_capacity;
+        BROKER_PREDICATE_NODE* nodes = (BROKER_PREDICATE_NODE*)realloc(predicate->nodes, capacity * sizeof(BROKER_PREDICATE_NODE));
+        if (nodes != NULL)
+        {
+            predicate->nodes = nodes;
+            predicate->node_capacity = capacity;
+        }
+    }
+    if (predicate->node_count < predicate->node_capacity)
+    {
+        BROKER_PREDICATE_NODE* node = &predicate->nodes[predicate->node_count];
+        node->op = op;
+        node->left = left;
+        node->right = right;
+        node->name = BROKER_PREDICATE_NO_NODE;
+        node->values = 0;
+        node->value_count = 0;
+        result = predicate->node_count++;
+    }
+    else
+    {
+        LogError("unable to allocate predicate node");
+    }
+    return result;
+}
+
+static size_t parse_or(BROKER_PREDICATE_PARSER* parser);
+
+static size_t parse_comparison(BROKER_PREDICATE_PARSER* parser)
+{
+    size_t result = BROKER_PREDICATE_NO_NODE;
+    size_t name;
+
+    if (parser->token != BROKER_PREDICATE_TOKEN_WORD)
+    {
+        LogError("property name expected");
+    }
+    else if ((name = parser_add_string(parser)) != BROKER_PREDICATE_NO_NODE)
+    {
+        parser_next(parser);
+        if (parser->token == BROKER_PREDICATE_TOKEN_EQUAL || parser->token == BROKER_PREDICATE_TOKEN_NOT_EQUAL)
+        {
+            BROKER_PREDICATE_OP op = (parser->token == BROKER_PREDICATE_TOKEN_EQUAL) ? BROKER_PREDICATE_OP_EQUAL : BROKER_PREDICATE_OP_NOT_EQUAL;
+            parser_next(parser);
+            if (parser->token != BROKER_PREDICATE_TOKEN_WORD)
+            {
+                LogError("value expected");
+            }
+            else
+            {
+                size_t value = parser_add_string(parser);
+                if (value != BROKER_PREDICATE_NO_NODE && (result = parser_add_node(parser, op, 0, 0)) != BROKER_PREDICATE_NO_NODE)
+                {
+                    parser->predicate->nodes[result].name = name;
+                    parser->predicate->nodes[result].values = value;
+                    parser->predicate->nodes[result].value_count = 1;
+                    parser_next(parser);
+                }
+            }
+        }
+        else if (parser_word_is(parser, "in"))
+        {
+            size_t values = parser->predicate->string_count;
+            size_t value_count = 0;
+            bool valid = true;
+
+            parser_next(parser);
+            if (parser->token != BROKER_PREDICATE_TOKEN_OPEN_LIST)
+            {
+                LogError("'[' expected after in");
+                valid = false;
+            }
+            else
+            {
+                do
+                {
+                    parser_next(parser);
+                    if (parser->token != BROKER_PREDICATE_TOKEN_WORD || parser_add_string(parser) == BROKER_PREDICATE_NO_NODE)
+                    {
+                        LogError("value expected in list");
+                        valid = false;
+                    }
+                    else
+                    {
+                        value_count++;
+                        parser_next(parser);
+                    }
+                } while (valid && parser->token == BROKER_PREDICATE_TOKEN_COMMA);
+
+                if (valid && parser->token != BROKER_PREDICATE_TOKEN_CLOSE_LIST)
+                {
+                    LogError("']' expected");
+                    valid = false;
+                }
+            }
+
+            if (valid && (result = parser_add_node(parser, BROKER_PREDICATE_OP_IN, 0, 0)) != BROKER_PREDICATE_NO_NODE)
+            {
+                parser->predicate->nodes[result].name = name;
+                parser->predicate->nodes[result].values = values;
+                parser->predicate->nodes[result].value_count = value_count;
+                parser_next(parser);
+            }
+        }
+        else if ((result = parser_add_node(parser, BROKER_PREDICATE_OP_EXISTS, 0, 0)) != BROKER_PREDICATE_NO_NODE)
+        {
+            parser->predicate->nodes[result].name = name;
+        }
+    }
+    return result;
+}
+
+static size_t parse_unary(BROKER_PREDICATE_PARSER* parser)
+{
+    size_t result;
+    if (parser->token == BROKER_PREDICATE_TOKEN_NOT)
+    {
+        size_t operand;
+        parser_next(parser);
+        operand = parse_unary(parser);
+        result = (operand == BROKER_PREDICATE_NO_NODE) ? BROKER_PREDICATE_NO_NODE : parser_add_node(parser, BROKER_PREDICATE_OP_NOT, operand, 0);
+    }
+    else if (parser->token == BROKER_PREDICATE_TOKEN_OPEN)
+    {
+        parser_next(parser);
+        result = parse_or(parser);
+        if (result != BROKER_PREDICATE_NO_NODE)
+        {
+            if (parser->token != BROKER_PREDICATE_TOKEN_CLOSE)
+            {
+                LogError("')' expected");
+                result = BROKER_PREDICATE_NO_NODE;
+            }
+            else
+            {
+                parser_next(parser);
+            }
+        }
+    }
+    else
+    {
+        result = parse_comparison(parser);
+    }
+    return result;
+}
+
+static size_t parse_and(BROKER_PREDICATE_PARSER* parser)
+{
+    size_t result = parse_unary(parser);
+    while (result != BROKER_PREDICATE_NO_NODE && parser->token == BROKER_PREDICATE_TOKEN_AND)
+    {
+        size_t right;
+        parser_next(parser);
+        right = parse_unary(parser);
+        result = (right == BROKER_PREDICATE_NO_NODE) ? BROKER_PREDICATE_NO_NODE : parser_add_node(parser, BROKER_PREDICATE_OP_AND, result, right);
+    }
+    return result;
+}
+
+static size_t parse_or(BROKER_PREDICATE_PARSER* parser)
+{
+    size_t result = parse_and(parser);
+    while (result != BROKER_PREDICATE_NO_NODE && parser->token == BROKER_PREDICATE_TOKEN_OR)
+    {
+        size_t right;
+        parser_next(parser);
+        right = parse_and(parser);
+        result = (right == BROKER_PREDICATE_NO_NODE) ? BROKER_PREDICATE_NO_NODE : parser_add_node(parser, BROKER_PREDICATE_OP_OR, result, right);
+    }
+    return result;
+}
+
+BROKER_PREDICATE_HANDLE BrokerPredicate_Compile(const char* text)
+{
+    BROKER_PREDICATE* result;
+    if (text == NULL)
+    {
+        LogError("predicate text is NULL");
+        result = NULL;
+    }
+    else if ((result = (BROKER_PREDICATE*)calloc(1, sizeof(BROKER_PREDICATE))) == NULL)
+    {
+        LogError("malloc of BROKER_PREDICATE failed");
+    }
+    else
+    {
+        BROKER_PREDICATE_PARSER parser;
+        parser.text = text;
+        parser.position = text;
+        parser.predicate = result;
+        parser_next(&parser);
+
+        result->root = parse_or(&parser);
+        if (result->root == BROKER_PREDICATE_NO_NODE || parser.token != BROKER_PREDICATE_TOKEN_END)
+        {
+            LogError("invalid predicate \"%s\" at offset %d", text, (int)(parser.word - text));
+            BrokerPredicate_Destroy(result);
+            result = NULL;
+        }
+    }
+    return result;
+}
+
+static bool evaluate_node(const BROKER_PREDICATE* predicate, size_t index, BROKER_PREDICATE_LOOKUP lookup, void* context)
+{
+    bool result;
+    const BROKER_PREDICATE_NODE* node = &predicate->nodes[index];
+    const char* value;
+    size_t i;
+
+    switch (node->op)
+    {
+    case BROKER_PREDICATE_OP_OR:
+        result = evaluate_node(predicate, node->left, lookup, context) || evaluate_node(predicate, node->right, lookup, context);
+        break;
+    case BROKER_PREDICATE_OP_AND:
+        result = evaluate_node(predicate, node->left, lookup, context) && evaluate_node(predicate, node->right, lookup, context);
+        break;
+    case BROKER_PREDICATE_OP_NOT:
+        result = !evaluate_node(predicate, node->left, lookup, context);
+        break;
+    case BROKER_PREDICATE_OP_EQUAL:
+        value = lookup(context, predicate->strings[node->name]);
+        result = value != NULL && strcmp(value, predicate->strings[node->values]) == 0;
+        break;
+    case BROKER_PREDICATE_OP_NOT_EQUAL:
+        value = lookup(context, predicate->strings[node->name]);
+        result = value == NULL || strcmp(value, predicate->strings[node->values]) != 0;
+        break;
+    case BROKER_PREDICATE_OP_IN:
+        value = lookup(context, predicate->strings[node->name]);
+        result = false;
+        for (i = 0; value != NULL && !result && i < node->value_count; i++)
+        {
+            result = strcmp(value, predicate->strings[node->values + i]) == 0;
+        }
+        break;
+    case BROKER_PREDICATE_OP_EXISTS:
+    default:
+        result = lookup(context, predicate->strings[node->name]) != NULL;
+        break;
+    }
+    return result;
+}
+
+bool BrokerPredicate_Evaluate(BROKER_PREDICATE_HANDLE predicate, BROKER_PREDICATE_LOOKUP lookup, void* context)
+{
+    /* no predicate lets everything through */
+    return predicate == NULL || evaluate_node(predicate, predicate->root, lookup, context);
+}
+
+void BrokerPredicate_Destroy(BROKER_PREDICATE_HANDLE predicate)
+{
+    if (predicate != NULL)
+    {
+        size_t i;
+        for (i = 0; i < predicate->string_count; i++)
+        {
+            free(predicate->strings[i]);
+        }
+        free(predicate->strings);
+        free(predicate->nodes);
+        free(predicate);
+    }
+}
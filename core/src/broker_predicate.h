@@ -0,0 +1,50 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef BROKER_PREDICATE_H
+#define BROKER_PREDICATE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** @brief  Compiled filter over message properties.
+ *
+ *  Grammar, with @c || binding weaker than @c && and @c ! binding tightest:
+ *
+ *      expr       := and ( "||" and )*
+ *      and        := unary ( "&&" unary )*
+ *      unary      := "!" unary | "(" expr ")" | comparison
+ *      comparison := name "==" value | name "!=" value
+ *                  | name "in" "[" value ( "," value )* "]"
+ *                  | name
+ *
+ *  Names and values are either bare words made of letters, digits and
+ *  @c _ @c - @c . @c : or double quoted strings. A bare name alone is true
+ *  when the property exists; @c != is true when the property is missing.
+ */
+typedef struct BROKER_PREDICATE_TAG* BROKER_PREDICATE_HANDLE;
+
+/** @brief  Returns the value of property @c name, or NULL when it is missing. */
+typedef const char*(*BROKER_PREDICATE_LOOKUP)(void* context, const char* name);
+
+/** @brief  Parses @c text. Returns NULL and logs the position of the error
+ *          when it is not a valid predicate.
+ */
+BROKER_PREDICATE_HANDLE BrokerPredicate_Compile(const char* text);
+
+/** @brief  Evaluates the predicate, reading properties through @c lookup. */
+bool BrokerPredicate_Evaluate(BROKER_PREDICATE_HANDLE predicate, BROKER_PREDICATE_LOOKUP lookup, void* context);
+
+/** @brief  Frees a compiled predicate. */
+void BrokerPredicate_Destroy(BROKER_PREDICATE_HANDLE predicate);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BROKER_PREDICATE_H
@@ -0,0 +1,205 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "azure_c_shared_utility/gballoc.h"
+#include "azure_c_shared_utility/xlogging.h"
+
+#include "broker_atomic.h"
+#include "broker_queue.h"
+
+/* Each cell carries a sequence number: it equals the ring position when the
+ * cell is free for a producer and position + 1 once the item is published.
+ * Producers claim a position with a single CAS on tail, so a push is O(1)
+ * and never waits on another producer or on the consumer. */
+typedef struct BROKER_QUEUE_CELL_TAG
+{
+    volatile size_t sequence;
+    void* item;
+} BROKER_QUEUE_CELL;
+
+typedef struct BROKER_QUEUE_TAG
+{
+    BROKER_QUEUE_CELL* cells;
+    size_t mask;
+    char pad0[BROKER_CACHE_LINE_SIZE];
+    volatile size_t tail;
+    char pad1[BROKER_CACHE_LINE_SIZE - sizeof(size_t)];
+    volatile size_t head;
+    char pad2[BROKER_CACHE_LINE_SIZE - sizeof(size_t)];
+} BROKER_QUEUE;
+
+BROKER_QUEUE_HANDLE BrokerQueue_Create(size_t capacity)
+{
+    BROKER_QUEUE* result;
+    size_t size = 2;
+
+    while (size < capacity)
+    {
+        size <<= 1;
+    }
+
+    result = (BROKER_QUEUE*)malloc(sizeof(BROKER_QUEUE));
+    if (result == NULL)
+    {
+        LogError("malloc of BROKER_QUEUE failed");
+    }
+    else
+    {
+        result->cells = (BROKER_QUEUE_CELL*)malloc(size * sizeof(BROKER_QUEUE_CELL));
+        if (result->cells == NULL)
+        {
+            LogError("malloc of %zu queue cells failed", size);
+            free(result);
+            result = NULL;
+        }
+        else
+        {
+            size_t i;
+            for (i = 0; i < size; i++)
+            {
+                result->cells[i].sequence = i;
+                result->cells[i].item = NULL;
+            }
+            result->mask = size - 1;
+            result->tail = 0;
+            result->head = 0;
+        }
+    }
+    return result;
+}
+
+void BrokerQueue_Destroy(BROKER_QUEUE_HANDLE queue)
+{
+    if (queue != NULL)
+    {
+        free(queue->cells);
+        free(queue);
+    }
+}
+
+bool BrokerQueue_TryPush(BROKER_QUEUE_HANDLE queue, void* item)
+{
+    bool result;
+    size_t position = BROKER_ATOMIC_LOAD(&queue->tail);
+
+    while (true)
+    {
+        BROKER_QUEUE_CELL* cell = &queue->cells[position & queue->mask];
+        intptr_t diff = (intptr_t)BROKER_ATOMIC_LOAD(&cell->sequence) - (intptr_t)position;
+        if (diff == 0)
+        {
+            if (BROKER_ATOMIC_CAS(&queue->tail, position, position + 1))
+            {
+                cell->item = item;
+                BROKER_ATOMIC_STORE(&cell->sequence, position + 1);
+                result = true;
+                break;
+            }
+            position = BROKER_ATOMIC_LOAD(&queue->tail);
+        }
+        else if (diff < 0)
+        {
+            /* the consumer has not released this cell yet: full */
+            result = false;
+            break;
+        }
+        else
+        {
+            /* another producer took this position, reload */
+            position = BROKER_ATOMIC_LOAD(&queue->tail);
+        }
+    }
+    return result;
+}
+
+size_t BrokerQueue_TryPushMany(BROKER_QUEUE_HANDLE queue, void* const* items, size_t count)
+{
+    size_t result = 0;
+    size_t position = BROKER_ATOMIC_LOAD(&queue->tail);
+
+    while (count > 0)
+    {
+        size_t head = BROKER_ATOMIC_LOAD(&queue->head);
+        size_t available;
+        size_t reserve;
+        intptr_t diff;
+
+        if (position < head)
+        {
+            /* the consumer moved past a stale tail, reload */
+            position = BROKER_ATOMIC_LOAD(&queue->tail);
+            continue;
+        }
+        available = queue->mask + 1 - (position - head);
+        reserve = count < available ? count : available;
+        if (reserve == 0)
+        {
+            break;
+        }
+
+        /* cells are released in order, so the last cell being free means all of them are */
+        diff = (intptr_t)BROKER_ATOMIC_LOAD(&queue->cells[(position + reserve - 1) & queue->mask].sequence) - (intptr_t)(position + reserve - 1);
+        if (diff == 0)
+        {
+            if (BROKER_ATOMIC_CAS(&queue->tail, position, position + reserve))
+            {
+                size_t i;
+                for (i = 0; i < reserve; i++)
+                {
+                    BROKER_QUEUE_CELL* cell = &queue->cells[(position + i) & queue->mask];
+                    cell->item = items[i];
+                    BROKER_ATOMIC_STORE(&cell->sequence, position + i + 1);
+                }
+                result = reserve;
+                break;
+            }
+            position = BROKER_ATOMIC_LOAD(&queue->tail);
+        }
+        else if (diff < 0)
+        {
+            break;
+        }
+        else
+        {
+            position = BROKER_ATOMIC_LOAD(&queue->tail);
+        }
+    }
+    return result;
+}
+
+void* BrokerQueue_TryPop(BROKER_QUEUE_HANDLE queue)
+{
+    void* result;
+    size_t position = queue->head;
+    BROKER_QUEUE_CELL* cell = &queue->cells[position & queue->mask];
+
+    if (BROKER_ATOMIC_LOAD(&cell->sequence) != position + 1)
+    {
+        /* empty, or the producer that owns this cell has not published yet */
+        result = NULL;
+    }
+    else
+    {
+        result = cell->item;
+        BROKER_ATOMIC_STORE(&cell->sequence, position + queue->mask + 1);
+        BROKER_ATOMIC_STORE(&queue->head, position + 1);
+    }
+    return result;
+}
+
+void* BrokerQueue_Peek(BROKER_QUEUE_HANDLE queue)
+{
+    size_t position = queue->head;
+    BROKER_QUEUE_CELL* cell = &queue->cells[position & queue->mask];
+    return (BROKER_ATOMIC_LOAD(&cell->sequence) == position + 1) ? cell->item : NULL;
+}
+
+size_t BrokerQueue_Size(BROKER_QUEUE_HANDLE queue)
+{
+    size_t head = BROKER_ATOMIC_LOAD(&queue->head);
+    size_t tail = BROKER_ATOMIC_LOAD(&queue->tail);
+    return tail > head ? tail - head : 0;
+}
@@ -0,0 +1,57 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef BROKER_QUEUE_H
+#define BROKER_QUEUE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** @brief  Bounded lock-free multi-producer/single-consumer ring of pointers.
+ *
+ *  Any number of threads may call ::BrokerQueue_TryPush concurrently. Only
+ *  one thread at a time may call ::BrokerQueue_TryPop; the broker guarantees
+ *  this by popping only under the receiver lock.
+ */
+typedef struct BROKER_QUEUE_TAG* BROKER_QUEUE_HANDLE;
+
+/** @brief  Creates a queue able to hold at least @c capacity items. The
+ *          capacity is rounded up to the next power of two.
+ */
+BROKER_QUEUE_HANDLE BrokerQueue_Create(size_t capacity);
+
+/** @brief  Frees the queue. Items still queued are not touched. */
+void BrokerQueue_Destroy(BROKER_QUEUE_HANDLE queue);
+
+/** @brief  Appends @c item. Returns false without blocking when the queue is
+ *          full.
+ */
+bool BrokerQueue_TryPush(BROKER_QUEUE_HANDLE queue, void* item);
+
+/** @brief  Appends up to @c count items from @c items with a single slot
+ *          reservation, keeping their order. Returns how many leading items
+ *          were queued; fewer than @c count means the queue is full.
+ */
+size_t BrokerQueue_TryPushMany(BROKER_QUEUE_HANDLE queue, void* const* items, size_t count);
+
+/** @brief  Removes the oldest item, or returns NULL when nothing is ready. */
+void* BrokerQueue_TryPop(BROKER_QUEUE_HANDLE queue);
+
+/** @brief  Returns the oldest item without removing it, or NULL when nothing
+ *          is ready. Same single consumer rule as ::BrokerQueue_TryPop.
+ */
+void* BrokerQueue_Peek(BROKER_QUEUE_HANDLE queue);
+
+/** @brief  Approximate number of queued items. */
+size_t BrokerQueue_Size(BROKER_QUEUE_HANDLE queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BROKER_QUEUE_H
@@ -0,0 +1,219 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "azure_c_shared_utility/gballoc.h"
+#include "azure_c_shared_utility/xlogging.h"
+#include "azure_c_shared_utility/threadapi.h"
+
+#include "broker_atomic.h"
+#include "broker_pool.h"
+#include "broker_slab.h"
+
+/* objects carved from the heap at once */
+#define BROKER_SLAB_BLOCK_OBJECTS 64
+/* objects moved between a thread cache and the depot at once */
+#define BROKER_SLAB_BATCH 32
+/* slabs a thread keeps a cache for; further slabs go to the depot every time */
+#define BROKER_SLAB_THREAD_CACHES 4
+
+/* A free object links to the next one of its chain in its first word. The
+ * first object of a depot chain also holds the next chain and its length. */
+#define SLAB_NEXT(object) (((void**)(object))[0])
+#define SLAB_NEXT_CHAIN(object) (((void**)(object))[1])
+#define SLAB_CHAIN_COUNT(object) (((size_t*)(object))[2])
+
+typedef struct BROKER_SLAB_CACHE_TAG
+{
+    BROKER_SLAB* slab;
+    void* head;
+    size_t count;
+} BROKER_SLAB_CACHE;
+
+static BROKER_THREAD_LOCAL BROKER_SLAB_CACHE slab_caches[BROKER_SLAB_THREAD_CACHES];
+
+static size_t slab_stride(const BROKER_SLAB* slab)
+{
+    size_t size = (slab->object_size < 3 * sizeof(void*)) ? 3 * sizeof(void*) : slab->object_size;
+    return (size + BROKER_CACHE_LINE_SIZE - 1) & ~(size_t)(BROKER_CACHE_LINE_SIZE - 1);
+}
+
+static void slab_lock(BROKER_SLAB* slab)
+{
+    while (!BROKER_ATOMIC_CAS(&slab->lock, 0, 1))
+    {
+        ThreadAPI_Sleep(0);
+    }
+}
+
+static void slab_unlock(BROKER_SLAB* slab)
+{
+    BROKER_ATOMIC_STORE(&slab->lock, 0);
+}
+
+/* The calling thread's cache for slab, claiming a free one on first use. NULL
+ * when the thread already caches BROKER_SLAB_THREAD_CACHES other slabs. */
+static BROKER_SLAB_CACHE* slab_cache(BROKER_SLAB* slab)
+{
+    BROKER_SLAB_CACHE* result = NULL;
+    size_t i;
+    for (i = 0; i < BROKER_SLAB_THREAD_CACHES && result == NULL; i++)
+    {
+        if (slab_caches[i].slab == slab)
+        {
+            result = &slab_caches[i];
+        }
+    }
+    for (i = 0; i < BROKER_SLAB_THREAD_CACHES && result == NULL; i++)
+    {
+        if (slab_caches[i].slab == NULL)
+        {
+            slab_caches[i].slab = slab;
+            result = &slab_caches[i];
+        }
+    }
+    return result;
+}
+
+static void slab_depot_push(BROKER_SLAB* slab, void* chain, size_t count)
+{
+    SLAB_CHAIN_COUNT(chain) = count;
+    slab_lock(slab);
+    SLAB_NEXT_CHAIN(chain) = slab->depot;
+    slab->depot = chain;
+    slab_unlock(slab);
+}
+
+/* Carves a new block into a chain of BROKER_SLAB_BLOCK_OBJECTS objects. The
+ * block starts with the link to the previous block, the objects start on the
+ * next cache line. */
+static void* slab_carve(BROKER_SLAB* slab)
+{
+    void* result;
+    size_t stride = slab_stride(slab);
+    unsigned char* block = (unsigned char*)malloc(BROKER_CACHE_LINE_SIZE + BROKER_SLAB_BLOCK_OBJECTS * stride);
+    if (block == NULL)
+    {
+        LogError("malloc of slab block failed");
+        result = NULL;
+    }
+    else
+    {
+        unsigned char* object = (unsigned char*)(((uintptr_t)block + sizeof(void*) + BROKER_CACHE_LINE_SIZE - 1) & ~(uintptr_t)(BROKER_CACHE_LINE_SIZE - 1));
+        size_t i;
+        result = object;
+        for (i = 1; i < BROKER_SLAB_BLOCK_OBJECTS; i++)
+        {
+            SLAB_NEXT(object) = object + stride;
+            object += stride;
+        }
+        SLAB_NEXT(object) = NULL;
+        SLAB_CHAIN_COUNT(result) = BROKER_SLAB_BLOCK_OBJECTS;
+
+        slab_lock(slab);
+        *(void**)block = slab->blocks;
+        slab->blocks = block;
+        slab_unlock(slab);
+    }
+    return result;
+}
+
+/* Takes a chain from the depot, or a new block when the depot is empty. */
+static void* slab_refill(BROKER_SLAB* slab)
+{
+    void* result;
+    slab_lock(slab);
+    result = slab->depot;
+    if (result != NULL)
+    {
+        slab->depot = SLAB_NEXT_CHAIN(result);
+    }
+    slab_unlock(slab);
+    if (result == NULL)
+    {
+        result = slab_carve(slab);
+    }
+    return result;
+}
+
+void* BrokerSlab_Alloc(BROKER_SLAB* slab)
+{
+    void* result;
+    BROKER_SLAB_CACHE* cache = slab_cache(slab);
+    if (cache != NULL && cache->head != NULL)
+    {
+        result = cache->head;
+        cache->head = SLAB_NEXT(result);
+        cache->count--;
+    }
+    else
+    {
+        result = slab_refill(slab);
+        if (result != NULL)
+        {
+            size_t count = SLAB_CHAIN_COUNT(result);
+            void* rest = SLAB_NEXT(result);
+            if (cache != NULL)
+            {
+                cache->head = rest;
+                cache->count = count - 1;
+            }
+            else if (rest != NULL)
+            {
+                slab_depot_push(slab, rest, count - 1);
+            }
+        }
+    }
+    return result;
+}
+
+void BrokerSlab_Free(BROKER_SLAB* slab, void* object)
+{
+    if (object != NULL)
+    {
+        BROKER_SLAB_CACHE* cache = slab_cache(slab);
+        if (cache == NULL)
+        {
+            SLAB_NEXT(object) = NULL;
+            slab_depot_push(slab, object, 1);
+        }
+        else
+        {
+            SLAB_NEXT(object) = cache->head;
+            cache->head = object;
+            cache->count++;
+            if (cache->count >= 2 * BROKER_SLAB_BATCH)
+            {
+                /* keep one batch for this thread, hand the other to the threads that allocate */
+                void* chain = cache->head;
+                void* last = chain;
+                size_t i;
+                for (i = 1; i < BROKER_SLAB_BATCH; i++)
+                {
+                    last = SLAB_NEXT(last);
+                }
+                cache->head = SLAB_NEXT(last);
+                cache->count -= BROKER_SLAB_BATCH;
+                SLAB_NEXT(last) = NULL;
+                slab_depot_push(slab, chain, BROKER_SLAB_BATCH);
+            }
+        }
+    }
+}
+
+void BrokerSlab_ReleaseThreadCaches(void)
+{
+    size_t i;
+    for (i = 0; i < BROKER_SLAB_THREAD_CACHES; i++)
+    {
+        if (slab_caches[i].head != NULL)
+        {
+            slab_depot_push(slab_caches[i].slab, slab_caches[i].head, slab_caches[i].count);
+        }
+        slab_caches[i].slab = NULL;
+        slab_caches[i].head = NULL;
+        slab_caches[i].count = 0;
+    }
+}
@@ -0,0 +1,56 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef BROKER_SLAB_H
+#define BROKER_SLAB_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** @brief  Process-wide allocator of objects of one fixed size.
+ *
+ *  Objects are carved from cache-line aligned blocks and padded to whole
+ *  cache lines, so two objects never share a line. Every thread keeps a small
+ *  cache of free objects for each slab it uses; a thread that frees more than
+ *  it allocates, such as a receiver releasing what publishers allocated,
+ *  hands batches back to a shared depot that the allocating threads refill
+ *  from. Blocks are never returned to the heap.
+ *
+ *  A slab is a static object set up with ::BROKER_SLAB_INITIALIZER and must
+ *  outlive every thread that uses it.
+ */
+typedef struct BROKER_SLAB_TAG
+{
+    size_t object_size;
+    /* spin lock over depot and blocks */
+    volatile size_t lock;
+    /* chains of free objects handed back by the threads */
+    void* depot;
+    void* blocks;
+} BROKER_SLAB;
+
+#define BROKER_SLAB_INITIALIZER(object_size) { (object_size), 0, NULL, NULL }
+
+/** @brief  Returns an object of the slab's size, or NULL when the heap is
+ *          exhausted. The content is undefined.
+ */
+void* BrokerSlab_Alloc(BROKER_SLAB* slab);
+
+/** @brief  Gives @c object back to @c slab, from any thread. NULL is ignored. */
+void BrokerSlab_Free(BROKER_SLAB* slab, void* object);
+
+/** @brief  Hands the calling thread's cached objects of every slab back to
+ *          their depots. Threads call it before they exit; objects cached
+ *          by a thread that does not are lost to the slab.
+ */
+void BrokerSlab_ReleaseThreadCaches(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BROKER_SLAB_H
@@ -0,0 +1,293 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+#include "azure_c_shared_utility/gballoc.h"
+#include "azure_c_shared_utility/xlogging.h"
+
+#include "broker_spill.h"
+
+/* smallest segment file; a larger record gets a segment of its own size */
+#define BROKER_SPILL_SEGMENT_SIZE ((size_t)16 * 1024 * 1024)
+
+/* A record is its content length followed by the content, padded so the next
+ * length stays aligned. */
+#define SPILL_RECORD_SIZE(size) (sizeof(size_t) + (((size) + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1)))
+
+typedef struct BROKER_SPILL_SEGMENT_TAG
+{
+    struct BROKER_SPILL_SEGMENT_TAG* next;
+    int fd;
+    unsigned char* base;
+    size_t size;
+    /* records are appended at write_offset and read from read_offset */
+    size_t write_offset;
+    size_t read_offset;
+} BROKER_SPILL_SEGMENT;
+
+typedef struct BROKER_SPILL_TAG
+{
+    char* directory;
+    /* oldest segment, read from */
+    BROKER_SPILL_SEGMENT* head;
+    /* newest segment, appended to */
+    BROKER_SPILL_SEGMENT* tail;
+    size_t count;
+} BROKER_SPILL;
+
+#ifdef _WIN32
+
+BROKER_SPILL_HANDLE BrokerSpill_Create(const char* directory)
+{
+    (void)directory;
+    LogError("spilling to disk is not supported on this platform");
+    return NULL;
+}
+
+void BrokerSpill_Destroy(BROKER_SPILL_HANDLE spill)
+{
+    (void)spill;
+}
+
+unsigned char* BrokerSpill_Append(BROKER_SPILL_HANDLE spill, size_t size)
+{
+    (void)spill;
+    (void)size;
+    return NULL;
+}
+
+const unsigned char* BrokerSpill_Peek(BROKER_SPILL_HANDLE spill, size_t* size)
+{
+    (void)spill;
+    (void)size;
+    return NULL;
+}
+
+void BrokerSpill_Pop(BROKER_SPILL_HANDLE spill)
+{
+    (void)spill;
+}
+
+size_t BrokerSpill_Count(BROKER_SPILL_HANDLE spill)
+{
+    (void)spill;
+    return 0;
+}
+
+#else
+
+/* Maps a new segment of at least size bytes. The file is unlinked right away,
+ * so it only lives as long as the mapping. */
+static BROKER_SPILL_SEGMENT* spill_segment_create(const char* directory, size_t size)
+{
+    BROKER_SPILL_SEGMENT* result;
+    size_t path_size = strlen(directory) + sizeof("/broker-spill-XXXXXX");
+    char* path = (char*)malloc(path_size);
+    if (path == NULL)
+    {
+        LogError("malloc of spill segment path failed");
+        result = NULL;
+    }
+    else
+    {
+        int fd;
+        (void)snprintf(path, path_size, "%s/broker-spill-XXXXXX", directory);
+        fd = mkstemp(path);
+        if (fd == -1)
+        {
+            LogError("unable to create spill segment in %s", directory);
+            result = NULL;
+        }
+        else
+        {
+            (void)unlink(path);
+            if (ftruncate(fd, (off_t)size) != 0
+#ifdef __linux__
+                /* reserve the blocks now, so a full disk fails here rather than in a page fault */
+                || posix_fallocate(fd, 0, (off_t)size) != 0
+#endif
+                )
+            {
+                LogError("unable to size spill segment to %zu bytes", size);
+                (void)close(fd);
+                result = NULL;
+            }
+            else
+            {
+                void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                if (base == MAP_FAILED)
+                {
+                    LogError("unable to map spill segment of %zu bytes", size);
+                    (void)close(fd);
+                    result = NULL;
+                }
+                else if ((result = (BROKER_SPILL_SEGMENT*)malloc(sizeof(BROKER_SPILL_SEGMENT))) == NULL)
+                {
+                    LogError("malloc of spill segment failed");
+                    (void)munmap(base, size);
+                    (void)close(fd);
+                }
+                else
+                {
+                    result->next = NULL;
+                    result->fd = fd;
+                    result->base = (unsigned char*)base;
+                    result->size = size;
+                    result->write_offset = 0;
+                    result->read_offset = 0;
+                }
+            }
+        }
+        free(path);
+    }
+    return result;
+}
+
+static void spill_segment_destroy(BROKER_SPILL_SEGMENT* segment)
+{
+    (void)munmap(segment->base, segment->size);
+    (void)close(segment->fd);
+    free(segment);
+}
+
+BROKER_SPILL_HANDLE BrokerSpill_Create(const char* directory)
+{
+    BROKER_SPILL* result;
+    if (directory == NULL)
+    {
+        directory = getenv("TMPDIR");
+        if (directory == NULL || directory[0] == '\0')
+        {
+            directory = "/tmp";
+        }
+    }
+
+    result = (BROKER_SPILL*)malloc(sizeof(BROKER_SPILL));
+    if (result == NULL)
+    {
+        LogError("malloc of spill failed");
+    }
+    else if ((result->directory = (char*)malloc(strlen(directory) + 1)) == NULL)
+    {
+        LogError("malloc of spill directory failed");
+        free(result);
+        result = NULL;
+    }
+    else
+    {
+        (void)strcpy(result->directory, directory);
+        result->head = NULL;
+        result->tail = NULL;
+        result->count = 0;
+    }
+    return result;
+}
+
+void BrokerSpill_Destroy(BROKER_SPILL_HANDLE spill)
+{
+    if (spill != NULL)
+    {
+        BROKER_SPILL_SEGMENT* segment = spill->head;
+        while (segment != NULL)
+        {
+            BROKER_SPILL_SEGMENT* next = segment->next;
+            spill_segment_destroy(segment);
+            segment = next;
+        }
+        free(spill->directory);
+        free(spill);
+    }
+}
+
+unsigned char* BrokerSpill_Append(BROKER_SPILL_HANDLE spill, size_t size)
+{
+    unsigned char* result;
+    size_t record_size = SPILL_RECORD_SIZE(size);
+    BROKER_SPILL_SEGMENT* segment = spill->tail;
+    if (segment == NULL || segment->size - segment->write_offset < record_size)
+    {
+        segment = spill_segment_create(spill->directory, (record_size > BROKER_SPILL_SEGMENT_SIZE) ? record_size : BROKER_SPILL_SEGMENT_SIZE);
+        if (segment != NULL)
+        {
+            if (spill->tail == NULL)
+            {
+                spill->head = segment;
+            }
+            else
+            {
+                spill->tail->next = segment;
+            }
+            spill->tail = segment;
+        }
+    }
+
+    if (segment == NULL)
+    {
+        result = NULL;
+    }
+    else
+    {
+        unsigned char* record = segment->base + segment->write_offset;
+        *(size_t*)record = size;
+        segment->write_offset += record_size;
+        spill->count++;
+        result = record + sizeof(size_t);
+    }
+    return result;
+}
+
+const unsigned char* BrokerSpill_Peek(BROKER_SPILL_HANDLE spill, size_t* size)
+{
+    const unsigned char* result;
+    if (spill->count == 0)
+    {
+        result = NULL;
+    }
+    else
+    {
+        const unsigned char* record = spill->head->base + spill->head->read_offset;
+        *size = *(const size_t*)record;
+        result = record + sizeof(size_t);
+    }
+    return result;
+}
+
+void BrokerSpill_Pop(BROKER_SPILL_HANDLE spill)
+{
+    if (spill->count != 0)
+    {
+        BROKER_SPILL_SEGMENT* segment = spill->head;
+        segment->read_offset += SPILL_RECORD_SIZE(*(const size_t*)(segment->base + segment->read_offset));
+        spill->count--;
+        if (segment->read_offset == segment->write_offset)
+        {
+            if (segment->next == NULL)
+            {
+                /* the only segment left is empty: append from its start again */
+                segment->read_offset = 0;
+                segment->write_offset = 0;
+            }
+            else
+            {
+                spill->head = segment->next;
+                spill_segment_destroy(segment);
+            }
+        }
+    }
+}
+
+size_t BrokerSpill_Count(BROKER_SPILL_HANDLE spill)
+{
+    return spill->count;
+}
+
+#endif
@@ -0,0 +1,61 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef BROKER_SPILL_H
+#define BROKER_SPILL_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** @brief  Append-only log of records on disk, used by a full thread-message
+ *          link to keep the messages it cannot queue in memory.
+ *
+ *  Records are appended to memory-mapped segment files of at least
+ *  BROKER_SPILL_SEGMENT_SIZE bytes and read back in the order they were
+ *  appended. A segment is unmapped and closed once it has been read through,
+ *  and the last one is rewound when it empties, so the disk only holds the
+ *  backlog. The files are unlinked as soon as they are mapped and vanish
+ *  with the process.
+ *
+ *  Not thread safe: the caller serializes every call on a spill.
+ */
+typedef struct BROKER_SPILL_TAG* BROKER_SPILL_HANDLE;
+
+/** @brief  Creates an empty spill whose segments go to @c directory, or to
+ *          @c TMPDIR or /tmp when @c directory is NULL. No file is created
+ *          before the first append. Returns NULL on failure or where memory
+ *          mapped files are not supported.
+ */
+BROKER_SPILL_HANDLE BrokerSpill_Create(const char* directory);
+
+/** @brief  Drops every record and closes the segments. */
+void BrokerSpill_Destroy(BROKER_SPILL_HANDLE spill);
+
+/** @brief  Appends a record of @c size bytes and returns where its content
+ *          goes, for the caller to fill before the next call on the spill.
+ *          Returns NULL when no segment can be mapped, such as when the disk
+ *          is full.
+ */
+unsigned char* BrokerSpill_Append(BROKER_SPILL_HANDLE spill, size_t size);
+
+/** @brief  Returns the oldest record and its size without removing it, or
+ *          NULL when the spill is empty. Valid until the next call on the
+ *          spill.
+ */
+const unsigned char* BrokerSpill_Peek(BROKER_SPILL_HANDLE spill, size_t* size);
+
+/** @brief  Removes the oldest record. */
+void BrokerSpill_Pop(BROKER_SPILL_HANDLE spill);
+
+/** @brief  Number of records in the spill. */
+size_t BrokerSpill_Count(BROKER_SPILL_HANDLE spill);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BROKER_SPILL_H
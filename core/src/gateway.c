@@ -309,6 +309,12 @@ int Gateway_RemoveModuleByName(GATEWAY_HANDLE gw, const char *module_name)
             gateway_removemodule_internal(gw, module_data);
             EventSystem_ReportEvent(gw->event_system, gw, GATEWAY_MODULE_LIST_CHANGED);
         }
+        else if (gateway_removemodule_replicas_internal(gw, module_name))
+        {
+            /* a module added with several instances goes with all its copies */
+            result = 0;
+            EventSystem_ReportEvent(gw->event_system, gw, GATEWAY_MODULE_LIST_CHANGED);
+        }
         else
         {
             /* Codes_SRS_GATEWAY_26_017: [** If module with `module_name` name is not found this function shall return non - zero and do nothing. ] */
@@ -375,6 +381,10 @@ void Gateway_RemoveLink(GATEWAY_HANDLE gw, const GATEWAY_LINK_ENTRY* entryLink)
             /*Codes_SRS_GATEWAY_26_018: [ The function shall report `GATEWAY_MODULE_LIST_CHANGED` event. ]*/
             EventSystem_ReportEvent(gw->event_system, gw, GATEWAY_MODULE_LIST_CHANGED);
         }
+        else if (gateway_removelink_replicas_internal(gateway_handle, entryLink))
+        {
+            EventSystem_ReportEvent(gw->event_system, gw, GATEWAY_MODULE_LIST_CHANGED);
+        }
         else
         {
             LogError("Gateway_RemoveLink(): Could not find link given it's source/sink.");
@@ -23,6 +23,8 @@
 #define LOADER_ENTRYPOINT_KEY "entrypoint"
 #define MODULE_PATH_KEY "module.path"
 #define ARG_KEY "args"
+#define MODULE_INSTANCES_KEY "instances"
+#define MODULE_PARTITION_KEY_KEY "partition-key"
 
 #define GATEWAY_KEY "gateway"
 #define GATEWAY_IOTHUB_CONNECTION_STRING_KEY "connection-string"
@@ -34,6 +36,24 @@
 #define SOURCE_KEY "source"
 #define SINK_KEY "sink"
 #define LINK_MSGTYPE_KEY "message.type"
+#define LINK_QUEUE_CAPACITY_KEY "queue.capacity"
+#define LINK_QUEUE_POLICY_KEY "queue.policy"
+#define LINK_PREDICATE_KEY "predicate"
+#define LINK_GROUP_KEY "group"
+#define LINK_GROUP_BALANCE_KEY "group.balance"
+#define LINK_COALESCE_KEY "coalesce"
+#define LINK_SAMPLE_KEY "sample"
+#define LINK_SAMPLE_EVERY_KEY "every"
+#define LINK_MAX_RATE_KEY "max-rate-hz"
+#define LINK_TTL_KEY "ttl-ms"
+#define LINK_SPILL_DIRECTORY_KEY "spill.directory"
+
+#define BROKER_KEY "broker"
+#define BROKER_SCHEDULER_KEY "scheduler"
+#define BROKER_WORKERS_KEY "workers"
+#define BROKER_MEMORY_BUDGET_KEY "memory-budget"
+#define BROKER_MEMORY_POLICY_KEY "memory-policy"
+#define BROKER_SLOW_RECEIVE_KEY "slow-receive-ms"
 
 #define PARSE_JSON_RESULT_VALUES \
     PARSE_JSON_SUCCESS, \
@@ -215,6 +235,11 @@ GATEWAY_HANDLE Gateway_CreateFromJson(const char* file_path)
                     properties->gateway_modules = NULL;
                     properties->gateway_links = NULL;
                     properties->deployConfig = NULL;
+                    properties->broker_scheduler = GATEWAY_BROKER_SCHEDULER_THREAD_PER_MODULE;
+                    properties->broker_workers = 0;
+                    properties->broker_memory_budget = 0;
+                    properties->broker_memory_policy = GATEWAY_BROKER_MEMORY_POLICY_DROP_NEWEST;
+                    properties->broker_slow_receive_ms = 0;
 					if ((parse_json_internal(properties, root_value) == PARSE_JSON_SUCCESS) && properties->gateway_modules != NULL && properties->gateway_links != NULL)
                     {
                         /*Codes_SRS_GATEWAY_JSON_14_007: [The function shall use the GATEWAY_PROPERTIES instance to create and return a GATEWAY_HANDLE using the lower level API.]*/
@@ -371,6 +396,11 @@ GATEWAY_UPDATE_FROM_JSON_RESULT Gateway_UpdateFromJson(GATEWAY_HANDLE gw, const
                 properties->gateway_modules = NULL;
                 properties->gateway_links = NULL;
                 properties->deployConfig = NULL;
+                properties->broker_scheduler = GATEWAY_BROKER_SCHEDULER_THREAD_PER_MODULE;
+                properties->broker_workers = 0;
+                properties->broker_memory_budget = 0;
+                properties->broker_memory_policy = GATEWAY_BROKER_MEMORY_POLICY_DROP_NEWEST;
+                properties->broker_slow_receive_ms = 0;
                 JSON_Object *json_document = json_value_get_object(root_value);
                 char* deployConfig = NULL;
                 JSON_Value* dcJsonRoot = NULL;
@@ -759,6 +789,144 @@ static PARSE_JSON_RESULT parse_loader(JSON_Object* loader_json, GATEWAY_MODULE_L
     return result;
 }
 
+/* returns a GATEWAY_LINK_ENTRY_QUEUE_POLICY value, or -1 if the name is unknown */
+static int parse_queue_policy(const char* queue_policy)
+{
+    int result;
+    if (strcmp_i(queue_policy, "block") == 0)
+    {
+        result = GATEWAY_LINK_ENTRY_QUEUE_POLICY_BLOCK;
+    }
+    else if (strcmp_i(queue_policy, "drop-oldest") == 0)
+    {
+        result = GATEWAY_LINK_ENTRY_QUEUE_POLICY_DROP_OLDEST;
+    }
+    else if (strcmp_i(queue_policy, "drop-newest") == 0)
+    {
+        result = GATEWAY_LINK_ENTRY_QUEUE_POLICY_DROP_NEWEST;
+    }
+    else if (strcmp_i(queue_policy, "fail") == 0)
+    {
+        result = GATEWAY_LINK_ENTRY_QUEUE_POLICY_FAIL;
+    }
+    else if (strcmp_i(queue_policy, "spill") == 0)
+    {
+        result = GATEWAY_LINK_ENTRY_QUEUE_POLICY_SPILL;
+    }
+    else
+    {
+        LogError("unknown queue policy \"%s\"", queue_policy);
+        result = -1;
+    }
+    return result;
+}
+
+static int parse_group_balance(const char* group_balance)
+{
+    int result;
+    if (strcmp_i(group_balance, "round-robin") == 0)
+    {
+        result = GATEWAY_LINK_ENTRY_GROUP_BALANCE_ROUND_ROBIN;
+    }
+    else if (strcmp_i(group_balance, "shortest-queue") == 0)
+    {
+        result = GATEWAY_LINK_ENTRY_GROUP_BALANCE_SHORTEST_QUEUE;
+    }
+    else
+    {
+        LogError("unknown group balance \"%s\"", group_balance);
+        result = -1;
+    }
+    return result;
+}
+
+static int parse_memory_policy(const char* memory_policy)
+{
+    int result;
+    if (strcmp_i(memory_policy, "drop-newest") == 0)
+    {
+        result = GATEWAY_BROKER_MEMORY_POLICY_DROP_NEWEST;
+    }
+    else if (strcmp_i(memory_policy, "shed-largest") == 0)
+    {
+        result = GATEWAY_BROKER_MEMORY_POLICY_SHED_LARGEST;
+    }
+    else if (strcmp_i(memory_policy, "fail") == 0)
+    {
+        result = GATEWAY_BROKER_MEMORY_POLICY_FAIL;
+    }
+    else
+    {
+        LogError("unknown memory policy \"%s\"", memory_policy);
+        result = -1;
+    }
+    return result;
+}
+
+/* the optional "broker" object: {"scheduler": "thread" | "pool", "workers": n,
+ * "memory-budget": bytes, "memory-policy": "drop-newest" | "shed-largest" | "fail",
+ * "slow-receive-ms": ms} */
+static PARSE_JSON_RESULT parse_broker(JSON_Object* json_document, GATEWAY_PROPERTIES* out_properties)
+{
+    PARSE_JSON_RESULT result;
+    JSON_Object* broker = json_object_get_object(json_document, BROKER_KEY);
+    if (broker == NULL)
+    {
+        result = PARSE_JSON_SUCCESS;
+    }
+    else
+    {
+        const char* scheduler = json_object_get_string(broker, BROKER_SCHEDULER_KEY);
+        double workers = json_object_get_number(broker, BROKER_WORKERS_KEY);
+        double memory_budget = json_object_get_number(broker, BROKER_MEMORY_BUDGET_KEY);
+        const char* memory_policy = json_object_get_string(broker, BROKER_MEMORY_POLICY_KEY);
+        int policy = (memory_policy == NULL) ? GATEWAY_BROKER_MEMORY_POLICY_DROP_NEWEST : parse_memory_policy(memory_policy);
+        double slow_receive_ms = json_object_get_number(broker, BROKER_SLOW_RECEIVE_KEY);
+        if (workers < 0)
+        {
+            LogError("\"workers\" in the broker configuration is misconfigured.");
+            result = PARSE_JSON_MISSING_OR_MISCONFIGURED_CONFIG;
+        }
+        else if (memory_budget < 0 || policy < 0)
+        {
+            LogError("\"memory-budget\" or \"memory-policy\" in the broker configuration is misconfigured.");
+            result = PARSE_JSON_MISSING_OR_MISCONFIGURED_CONFIG;
+        }
+        else if (slow_receive_ms < 0)
+        {
+            LogError("\"slow-receive-ms\" in the broker configuration is misconfigured.");
+            result = PARSE_JSON_MISSING_OR_MISCONFIGURED_CONFIG;
+        }
+        else if (scheduler == NULL || strcmp_i(scheduler, "thread") == 0)
+        {
+            out_properties->broker_scheduler = GATEWAY_BROKER_SCHEDULER_THREAD_PER_MODULE;
+            result = PARSE_JSON_SUCCESS;
+        }
+        else if (strcmp_i(scheduler, "pool") == 0)
+        {
+            out_properties->broker_scheduler = GATEWAY_BROKER_SCHEDULER_POOL;
+            /* json_object_get_number returns 0 when the key is missing: one worker per CPU */
+            out_properties->broker_workers = (size_t)workers;
+            result = PARSE_JSON_SUCCESS;
+        }
+        else
+        {
+            LogError("unknown broker scheduler \"%s\"", scheduler);
+            result = PARSE_JSON_MISSING_OR_MISCONFIGURED_CONFIG;
+        }
+
+        if (result == PARSE_JSON_SUCCESS)
+        {
+            /* a missing "memory-budget" reads as 0: no limit */
+            out_properties->broker_memory_budget = (size_t)memory_budget;
+            out_properties->broker_memory_policy = (GATEWAY_BROKER_MEMORY_POLICY)policy;
+            /* 0 when the key is missing: no watchdog */
+            out_properties->broker_slow_receive_ms = (size_t)slow_receive_ms;
+        }
+    }
+    return result;
+}
+
 static PARSE_JSON_RESULT parse_json_internal(GATEWAY_PROPERTIES* out_properties, JSON_Value *root)
 {
     PARSE_JSON_RESULT result;
@@ -802,7 +970,16 @@ static PARSE_JSON_RESULT parse_json_internal(GATEWAY_PROPERTIES* out_properties,
                             else
                             {
                                 const char* module_name = json_object_get_string(module, MODULE_NAME_KEY);
-                                if (module_name != NULL)
+                                /* json_object_get_number returns 0 when the key is missing: one instance */
+                                double instances = json_object_get_number(module, MODULE_INSTANCES_KEY);
+                                if (instances < 0 || instances != (double)(size_t)instances)
+                                {
+                                    loader_info.loader->api->FreeEntrypoint(loader_info.loader, loader_info.entrypoint);
+                                    result = PARSE_JSON_MISSING_OR_MISCONFIGURED_CONFIG;
+                                    LogError("\"instances\" in input JSON configuration is misconfigured.");
+                                    break;
+                                }
+                                else if (module_name != NULL)
                                 {
                                     /*Codes_SRS_GATEWAY_JSON_14_005: [The function shall set the value of const void* module_properties in the GATEWAY_PROPERTIES instance to a char* representing the serialized args value for the particular module.]*/
                                     JSON_Value *args = json_object_get_value(module, ARG_KEY);
@@ -817,6 +994,8 @@ static PARSE_JSON_RESULT parse_json_internal(GATEWAY_PROPERTIES* out_properties,
                                     if (version_str != NULL) {
                                         entry.module_version = version_str;
                                     }
+                                    entry.instances = (size_t)instances;
+                                    entry.partition_key = json_object_get_string(module, MODULE_PARTITION_KEY_KEY);
 
                                     /*Codes_SRS_GATEWAY_JSON_14_006: [The function shall return NULL if the JSON_Value contains incomplete information.]*/
                                     if (VECTOR_push_back(out_properties->gateway_modules, &entry, 1) == 0)
@@ -873,8 +1052,39 @@ static PARSE_JSON_RESULT parse_json_internal(GATEWAY_PROPERTIES* out_properties,
                                 const char* module_source = json_object_get_string(route, SOURCE_KEY);
                                 const char* module_sink = json_object_get_string(route, SINK_KEY);
                                 const char* message_type = json_object_get_string(route, LINK_MSGTYPE_KEY);
+                                const char* queue_policy = json_object_get_string(route, LINK_QUEUE_POLICY_KEY);
+                                double queue_capacity = json_object_get_number(route, LINK_QUEUE_CAPACITY_KEY);
+                                const char* group_balance = json_object_get_string(route, LINK_GROUP_BALANCE_KEY);
+                                /* parson reads 0 from a missing "sample" object: every message */
+                                double sample_every = json_object_get_number(json_object_get_object(route, LINK_SAMPLE_KEY), LINK_SAMPLE_EVERY_KEY);
+                                double max_rate_hz = json_object_get_number(route, LINK_MAX_RATE_KEY);
+                                double ttl_ms = json_object_get_number(route, LINK_TTL_KEY);
 
-                                if (module_source != NULL && module_sink != NULL)
+                                if (queue_capacity < 0 || (queue_policy != NULL && parse_queue_policy(queue_policy) < 0))
+                                {
+                                    result = PARSE_JSON_MISSING_OR_MISCONFIGURED_CONFIG;
+                                    LogError("\"queue.capacity\" or \"queue.policy\" in input JSON configuration is misconfigured.");
+                                    break;
+                                }
+                                else if (group_balance != NULL && parse_group_balance(group_balance) < 0)
+                                {
+                                    result = PARSE_JSON_MISSING_OR_MISCONFIGURED_CONFIG;
+                                    LogError("\"group.balance\" in input JSON configuration is misconfigured.");
+                                    break;
+                                }
+                                else if (sample_every < 0 || max_rate_hz < 0)
+                                {
+                                    result = PARSE_JSON_MISSING_OR_MISCONFIGURED_CONFIG;
+                                    LogError("\"sample\" or \"max-rate-hz\" in input JSON configuration is misconfigured.");
+                                    break;
+                                }
+                                else if (ttl_ms < 0)
+                                {
+                                    result = PARSE_JSON_MISSING_OR_MISCONFIGURED_CONFIG;
+                                    LogError("\"ttl-ms\" in input JSON configuration is misconfigured.");
+                                    break;
+                                }
+                                else if (module_source != NULL && module_sink != NULL)
                                 {
                                     GATEWAY_LINK_ENTRY entry = {
                                         module_source,
@@ -883,9 +1093,25 @@ static PARSE_JSON_RESULT parse_json_internal(GATEWAY_PROPERTIES* out_properties,
                                     if (message_type != NULL&&strcmp(message_type, "thread-message") == 0) {
                                         entry.message_type = GATEWAY_LINK_ENTRY_MESSAGE_TYPE_THREAD;
                                     }
+                                    else if (message_type != NULL&&strcmp(message_type, "direct") == 0) {
+                                        entry.message_type = GATEWAY_LINK_ENTRY_MESSAGE_TYPE_DIRECT;
+                                    }
                                     else {
                                         entry.message_type = GATEWAY_LINK_ENTRY_MESSAGE_TYPE_DEFAULT;
                                     }
+                                    /* json_object_get_number returns 0 when the key is missing: unbounded */
+                                    entry.queue_capacity = (size_t)queue_capacity;
+                                    entry.queue_policy = (queue_policy == NULL) ? GATEWAY_LINK_ENTRY_QUEUE_POLICY_BLOCK : (GATEWAY_LINK_ENTRY_QUEUE_POLICY)parse_queue_policy(queue_policy);
+                                    /* checked by the broker when the link is added */
+                                    entry.predicate = json_object_get_string(route, LINK_PREDICATE_KEY);
+                                    entry.group = json_object_get_string(route, LINK_GROUP_KEY);
+                                    entry.group_balance = (group_balance == NULL) ? GATEWAY_LINK_ENTRY_GROUP_BALANCE_ROUND_ROBIN : (GATEWAY_LINK_ENTRY_GROUP_BALANCE)parse_group_balance(group_balance);
+                                    entry.coalesce = json_object_get_string(route, LINK_COALESCE_KEY);
+                                    entry.sample_every = (size_t)sample_every;
+                                    entry.max_rate_hz = max_rate_hz;
+                                    /* 0 when the key is missing: messages only expire by their own property */
+                                    entry.ttl_ms = (size_t)ttl_ms;
+                                    entry.spill_directory = json_object_get_string(route, LINK_SPILL_DIRECTORY_KEY);
 
                                     /* Codes_SRS_GATEWAY_JSON_04_002: [ The function shall add all modules source and sink to GATEWAY_PROPERTIES inside gateway_links. ] */
                                     if (VECTOR_push_back(out_properties->gateway_links, &entry, 1) == 0)
@@ -938,6 +1164,11 @@ static PARSE_JSON_RESULT parse_json_internal(GATEWAY_PROPERTIES* out_properties,
             result = PARSE_JSON_MISCONFIGURED_OR_OTHER;
             LogError("An error occurred while parsing the loaders configuration for the gateway.");
         }
+
+        if (result == PARSE_JSON_SUCCESS)
+        {
+            result = parse_broker(json_document, out_properties);
+        }
     }
     /*Codes_SRS_GATEWAY_JSON_14_006: [The function shall return NULL if the JSON_Value contains incomplete information.]*/
     else
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <azure_c_shared_utility/gballoc.h>
 #include <azure_c_shared_utility/xlogging.h>
 #include <azure_c_shared_utility/threadapi.h>
@@ -20,6 +21,8 @@
 #include "gateway_internal.h"
 
 #define GATEWAY_ALL "*"
+/* copies of a replicated module are named "<name>#<index>" */
+#define GATEWAY_REPLICA_NAME_FORMAT "%s#%zu"
 
 static MODULE_DATA *no_module = NULL;
 
@@ -45,7 +48,8 @@ static bool check_if_link_exists(GATEWAY_HANDLE_DATA* gateway_handle, const GATE
     return link_data == NULL ? false : true;
 }
 
-static int add_one_link_to_broker(GATEWAY_HANDLE_DATA* gateway_handle, MODULE_HANDLE source, MODULE_HANDLE sink, GATEWAY_LINK_ENTRY_MESSAGE_TYPE msg_type)
+/* link_entry may be NULL for a default link with an unbounded queue */
+static int add_one_link_to_broker(GATEWAY_HANDLE_DATA* gateway_handle, MODULE_HANDLE source, MODULE_HANDLE sink, const GATEWAY_LINK_ENTRY* link_entry)
 {
     int result;
     BROKER_LINK_DATA broker_link_entry =
@@ -53,15 +57,60 @@ static int add_one_link_to_broker(GATEWAY_HANDLE_DATA* gateway_handle, MODULE_HA
         source,
         sink
     };
+    GATEWAY_LINK_ENTRY_MESSAGE_TYPE msg_type = (link_entry == NULL) ? GATEWAY_LINK_ENTRY_MESSAGE_TYPE_DEFAULT : link_entry->message_type;
     switch (msg_type) {
     case GATEWAY_LINK_ENTRY_MESSAGE_TYPE_THREAD:
         broker_link_entry.message_type = BROKER_LINK_MESSAGE_TYPE_THREAD;
         break;
+    case GATEWAY_LINK_ENTRY_MESSAGE_TYPE_DIRECT:
+        broker_link_entry.message_type = BROKER_LINK_MESSAGE_TYPE_DIRECT;
+        break;
     case GATEWAY_LINK_ENTRY_MESSAGE_TYPE_DEFAULT:
     default:
         broker_link_entry.message_type = BROKER_LINK_MESSAGE_TYPE_DEFAULT;
         break;
     }
+    if (link_entry != NULL) {
+        broker_link_entry.predicate = link_entry->predicate;
+        broker_link_entry.queue_capacity = link_entry->queue_capacity;
+        switch (link_entry->queue_policy) {
+        case GATEWAY_LINK_ENTRY_QUEUE_POLICY_DROP_OLDEST:
+            broker_link_entry.queue_policy = BROKER_LINK_QUEUE_POLICY_DROP_OLDEST;
+            break;
+        case GATEWAY_LINK_ENTRY_QUEUE_POLICY_DROP_NEWEST:
+            broker_link_entry.queue_policy = BROKER_LINK_QUEUE_POLICY_DROP_NEWEST;
+            break;
+        case GATEWAY_LINK_ENTRY_QUEUE_POLICY_FAIL:
+            broker_link_entry.queue_policy = BROKER_LINK_QUEUE_POLICY_FAIL;
+            break;
+        case GATEWAY_LINK_ENTRY_QUEUE_POLICY_SPILL:
+            broker_link_entry.queue_policy = BROKER_LINK_QUEUE_POLICY_SPILL;
+            break;
+        case GATEWAY_LINK_ENTRY_QUEUE_POLICY_BLOCK:
+        default:
+            broker_link_entry.queue_policy = BROKER_LINK_QUEUE_POLICY_BLOCK;
+            break;
+        }
+        broker_link_entry.group = link_entry->group;
+        switch (link_entry->group_balance) {
+        case GATEWAY_LINK_ENTRY_GROUP_BALANCE_SHORTEST_QUEUE:
+            broker_link_entry.group_balance = BROKER_LINK_BALANCE_SHORTEST_QUEUE;
+            break;
+        case GATEWAY_LINK_ENTRY_GROUP_BALANCE_PARTITION:
+            broker_link_entry.group_balance = BROKER_LINK_BALANCE_PARTITION;
+            break;
+        case GATEWAY_LINK_ENTRY_GROUP_BALANCE_ROUND_ROBIN:
+        default:
+            broker_link_entry.group_balance = BROKER_LINK_BALANCE_ROUND_ROBIN;
+            break;
+        }
+        broker_link_entry.partition_key = link_entry->partition_key;
+        broker_link_entry.coalesce = link_entry->coalesce;
+        broker_link_entry.sample_every = link_entry->sample_every;
+        broker_link_entry.max_rate_hz = link_entry->max_rate_hz;
+        broker_link_entry.ttl_ms = link_entry->ttl_ms;
+        broker_link_entry.spill_directory = link_entry->spill_directory;
+    }
     if (Broker_AddLink(gateway_handle->broker, &broker_link_entry) != BROKER_OK)
     {
         LogError("Could not add link to broker [%p] -> [%p]", source, sink);
@@ -117,7 +166,7 @@ static int add_regular_link(GATEWAY_HANDLE_DATA* gateway_handle, const GATEWAY_L
         }
         else
         {
-            if (add_one_link_to_broker(gateway_handle, (*module_source_handle)->module, (*module_sink_handle)->module, link_entry->message_type) != 0)
+            if (add_one_link_to_broker(gateway_handle, (*module_source_handle)->module, (*module_sink_handle)->module, link_entry) != 0)
             {
                 LogError("Unable to add link to Broker.");
                 result = __LINE__;
@@ -163,7 +212,19 @@ GATEWAY_HANDLE gateway_create_internal(const GATEWAY_PROPERTIES* properties, boo
         gateway->runtime_status = GATEWAY_RUNTIME_STATUS_INITIALIZING;
 
         /*Codes_SRS_GATEWAY_14_003: [This function shall create a new BROKER_HANDLE for the gateway representing this gateway's message broker. ]*/
-        gateway->broker = Broker_Create();
+        BROKER_CONFIG broker_config;
+        broker_config.scheduler = (properties != NULL && properties->broker_scheduler == GATEWAY_BROKER_SCHEDULER_POOL) ?
+            BROKER_SCHEDULER_POOL : BROKER_SCHEDULER_THREAD_PER_MODULE;
+        broker_config.worker_count = (properties != NULL) ? properties->broker_workers : 0;
+        broker_config.memory_budget = (properties != NULL) ? properties->broker_memory_budget : 0;
+        broker_config.memory_policy = (properties == NULL) ? BROKER_MEMORY_POLICY_DROP_NEWEST :
+            (properties->broker_memory_policy == GATEWAY_BROKER_MEMORY_POLICY_SHED_LARGEST) ? BROKER_MEMORY_POLICY_SHED_LARGEST :
+            (properties->broker_memory_policy == GATEWAY_BROKER_MEMORY_POLICY_FAIL) ? BROKER_MEMORY_POLICY_FAIL : BROKER_MEMORY_POLICY_DROP_NEWEST;
+        broker_config.slow_receive_us = (properties != NULL) ? properties->broker_slow_receive_ms * 1000 : 0;
+        broker_config.watchdog_interval_ms = 0;
+        broker_config.on_slow_module = NULL;
+        broker_config.on_slow_module_context = NULL;
+        gateway->broker = Broker_CreateWithConfig(&broker_config);
         if (gateway->broker == NULL)
         {
             /*Codes_SRS_GATEWAY_14_004: [This function shall return NULL if a BROKER_HANDLE cannot be created.]*/
@@ -346,6 +407,19 @@ void gateway_destroy_internal(GATEWAY_HANDLE gw)
             }
 
             VECTOR_destroy(gateway_handle->modules);
+            if (gateway_handle->replicas != NULL)
+            {
+                /* the copies themselves went with the other modules */
+                size_t i;
+                for (i = 0; i < VECTOR_size(gateway_handle->replicas); i++)
+                {
+                    MODULE_REPLICAS* replicas = (MODULE_REPLICAS*)VECTOR_element(gateway_handle->replicas, i);
+                    free(replicas->module_name);
+                    free(replicas->partition_key);
+                }
+                VECTOR_destroy(gateway_handle->replicas);
+                gateway_handle->replicas = NULL;
+            }
 #ifdef OUTPROCESS_ENABLED
             /*Codes_SRS_GATEWAY_27_040: [ Launch - `Gateway_Destroy` shall join any spawned threads. ]*/
             OutprocessLoader_JoinChildProcesses();
@@ -423,6 +497,140 @@ bool checkIfModuleExists(GATEWAY_HANDLE_DATA* gateway_handle, const char* module
     return module_data == NULL ? false : true;
 }
 
+/* Returns the name of copy index of a replicated module, to be freed by the caller. */
+static char* module_replica_name(const char* module_name, size_t index)
+{
+    /* room for the separator and a 64 bit index */
+    size_t size = strlen(module_name) + 22;
+    char* result = (char*)malloc(size);
+    if (result == NULL)
+    {
+        LogError("Unable to malloc the name of copy %zu of module %s.", index, module_name);
+    }
+    else
+    {
+        (void)snprintf(result, size, GATEWAY_REPLICA_NAME_FORMAT, module_name, index);
+    }
+    return result;
+}
+
+static bool module_replicas_find(const void* element, const void* module_name)
+{
+    return (strcmp(((const MODULE_REPLICAS*)element)->module_name, (const char*)module_name) == 0);
+}
+
+static MODULE_REPLICAS* find_module_replicas(GATEWAY_HANDLE_DATA* gateway_handle, const char* module_name)
+{
+    return (gateway_handle->replicas == NULL) ? NULL : (MODULE_REPLICAS*)VECTOR_find_if(gateway_handle->replicas, module_replicas_find, module_name);
+}
+
+/* Removes the first count copies of a replicated module. */
+static void remove_module_replica_copies(GATEWAY_HANDLE_DATA* gateway_handle, const char* module_name, size_t count)
+{
+    size_t index;
+    for (index = 0; index < count; index++)
+    {
+        char* replica_name = module_replica_name(module_name, index);
+        if (replica_name != NULL)
+        {
+            MODULE_DATA** module_data = (MODULE_DATA**)VECTOR_find_if(gateway_handle->modules, module_name_find, replica_name);
+            if (module_data != NULL)
+            {
+                gateway_removemodule_internal(gateway_handle, module_data);
+            }
+            free(replica_name);
+        }
+    }
+}
+
+/* Adds module_entry->instances copies of the module and records them so that
+ * links naming the module are made with every copy. Returns the handle of
+ * the first copy. */
+static MODULE_HANDLE add_module_replicas(GATEWAY_HANDLE_DATA* gateway_handle, const GATEWAY_MODULES_ENTRY* module_entry, bool use_json)
+{
+    MODULE_HANDLE module_result = NULL;
+    MODULE_REPLICAS replicas = { NULL, module_entry->instances, NULL };
+
+    if (find_module_replicas(gateway_handle, module_entry->module_name) != NULL || checkIfModuleExists(gateway_handle, module_entry->module_name))
+    {
+        LogError("Error to add module. Duplicated module name: %s", module_entry->module_name);
+    }
+    else if (gateway_handle->replicas == NULL && (gateway_handle->replicas = VECTOR_create(sizeof(MODULE_REPLICAS))) == NULL)
+    {
+        LogError("Unable to create the module replicas vector.");
+    }
+    else if (mallocAndStrcpy_s(&replicas.module_name, module_entry->module_name) != 0 ||
+        (module_entry->partition_key != NULL && mallocAndStrcpy_s(&replicas.partition_key, module_entry->partition_key) != 0))
+    {
+        LogError("Unable to malloc for module name");
+    }
+    else
+    {
+        GATEWAY_MODULES_ENTRY replica_entry = *module_entry;
+        size_t index;
+        replica_entry.instances = 1;
+        for (index = 0; index < module_entry->instances; index++)
+        {
+            char* replica_name = module_replica_name(module_entry->module_name, index);
+            MODULE_HANDLE replica = NULL;
+            if (replica_name != NULL)
+            {
+                replica_entry.module_name = replica_name;
+                replica = gateway_addmodule_internal(gateway_handle, &replica_entry, use_json);
+                free(replica_name);
+            }
+            if (replica == NULL)
+            {
+                break;
+            }
+            else if (index == 0)
+            {
+                module_result = replica;
+            }
+        }
+
+        if (index < module_entry->instances)
+        {
+            LogError("Failed to add copy %zu of module %s.", index, module_entry->module_name);
+            remove_module_replica_copies(gateway_handle, module_entry->module_name, index);
+            module_result = NULL;
+        }
+        else if (VECTOR_push_back(gateway_handle->replicas, &replicas, 1) != 0)
+        {
+            LogError("Unable to add MODULE_REPLICAS to the gateway replicas vector.");
+            remove_module_replica_copies(gateway_handle, module_entry->module_name, index);
+            module_result = NULL;
+        }
+    }
+
+    if (module_result == NULL)
+    {
+        free(replicas.module_name);
+        free(replicas.partition_key);
+    }
+    return module_result;
+}
+
+bool gateway_removemodule_replicas_internal(GATEWAY_HANDLE_DATA* gateway_handle, const char* module_name)
+{
+    bool result;
+    MODULE_REPLICAS* replicas = find_module_replicas(gateway_handle, module_name);
+    if (replicas == NULL)
+    {
+        result = false;
+    }
+    else
+    {
+        MODULE_REPLICAS removed = *replicas;
+        VECTOR_erase(gateway_handle->replicas, replicas, 1);
+        remove_module_replica_copies(gateway_handle, removed.module_name, removed.instances);
+        free(removed.module_name);
+        free(removed.partition_key);
+        result = true;
+    }
+    return result;
+}
+
 MODULE_HANDLE gateway_addmodule_internal(GATEWAY_HANDLE_DATA* gateway_handle, const GATEWAY_MODULES_ENTRY* module_entry, bool use_json)
 {
     MODULE_HANDLE module_result;
@@ -452,6 +660,10 @@ MODULE_HANDLE gateway_addmodule_internal(GATEWAY_HANDLE_DATA* gateway_handle, co
         module_result = NULL;
         LogError("Failed to add module because the module_name is invalid [%s]", module_entry->module_name);
     }
+    else if (module_entry->instances > 1)
+    {
+        module_result = add_module_replicas(gateway_handle, module_entry, use_json);
+    }
     else
     {
         //First check if a module with a given name already exists.
@@ -680,7 +892,7 @@ void gateway_removemodule_internal(GATEWAY_HANDLE_DATA* gateway_handle, MODULE_D
     free(module_data_ptr);
 }
 
-bool gateway_addlink_internal(GATEWAY_HANDLE_DATA* gateway_handle, const GATEWAY_LINK_ENTRY* link_entry)
+static bool add_link(GATEWAY_HANDLE_DATA* gateway_handle, const GATEWAY_LINK_ENTRY* link_entry)
 {
     bool result;
 
@@ -725,6 +937,127 @@ bool gateway_addlink_internal(GATEWAY_HANDLE_DATA* gateway_handle, const GATEWAY
     return result;
 }
 
+/* Makes the link of pair number pair of the copies a link naming replicated
+ * modules stands for; the names it sets are freed by the caller. */
+static int replicated_link_pair(const GATEWAY_LINK_ENTRY* link_entry, const MODULE_REPLICAS* source_replicas, const MODULE_REPLICAS* sink_replicas, size_t pair, GATEWAY_LINK_ENTRY* pair_entry, char** source_name, char** sink_name)
+{
+    int result;
+    size_t sink_count = (sink_replicas == NULL) ? 1 : sink_replicas->instances;
+    *source_name = (source_replicas == NULL) ? NULL : module_replica_name(source_replicas->module_name, pair / sink_count);
+    *sink_name = (sink_replicas == NULL) ? NULL : module_replica_name(sink_replicas->module_name, pair % sink_count);
+    if ((source_replicas != NULL && *source_name == NULL) || (sink_replicas != NULL && *sink_name == NULL))
+    {
+        result = __LINE__;
+    }
+    else
+    {
+        pair_entry->module_source = (*source_name != NULL) ? *source_name : link_entry->module_source;
+        pair_entry->module_sink = (*sink_name != NULL) ? *sink_name : link_entry->module_sink;
+        result = 0;
+    }
+    return result;
+}
+
+/* Removes the links of the first count pairs of copies. */
+static void remove_replicated_link(GATEWAY_HANDLE_DATA* gateway_handle, const GATEWAY_LINK_ENTRY* link_entry, const MODULE_REPLICAS* source_replicas, const MODULE_REPLICAS* sink_replicas, size_t count)
+{
+    size_t pair;
+    for (pair = 0; pair < count; pair++)
+    {
+        GATEWAY_LINK_ENTRY pair_entry = *link_entry;
+        char* source_name;
+        char* sink_name;
+        if (replicated_link_pair(link_entry, source_replicas, sink_replicas, pair, &pair_entry, &source_name, &sink_name) == 0)
+        {
+            LINK_DATA* link_data = (LINK_DATA*)VECTOR_find_if(gateway_handle->links, link_data_find, &pair_entry);
+            if (link_data != NULL)
+            {
+                gateway_removelink_internal(gateway_handle, link_data);
+            }
+        }
+        free(source_name);
+        free(sink_name);
+    }
+}
+
+/* A link naming a replicated module is made between every copy of the source
+ * and every copy of the sink. The copies of a sink form a group of
+ * thread-message links, so each message goes to one copy: the one of its
+ * partition key when the sink has one, in turn otherwise. */
+static bool add_replicated_link(GATEWAY_HANDLE_DATA* gateway_handle, const GATEWAY_LINK_ENTRY* link_entry, const MODULE_REPLICAS* source_replicas, const MODULE_REPLICAS* sink_replicas)
+{
+    bool result = true;
+    size_t pairs = ((source_replicas == NULL) ? 1 : source_replicas->instances) * ((sink_replicas == NULL) ? 1 : sink_replicas->instances);
+    size_t pair;
+    GATEWAY_LINK_ENTRY pair_entry = *link_entry;
+
+    if (sink_replicas != NULL)
+    {
+        pair_entry.message_type = GATEWAY_LINK_ENTRY_MESSAGE_TYPE_THREAD;
+        pair_entry.group = sink_replicas->module_name;
+        pair_entry.group_balance = (sink_replicas->partition_key != NULL) ? GATEWAY_LINK_ENTRY_GROUP_BALANCE_PARTITION : GATEWAY_LINK_ENTRY_GROUP_BALANCE_ROUND_ROBIN;
+        pair_entry.partition_key = sink_replicas->partition_key;
+    }
+    for (pair = 0; pair < pairs && result; pair++)
+    {
+        char* source_name;
+        char* sink_name;
+        if (replicated_link_pair(link_entry, source_replicas, sink_replicas, pair, &pair_entry, &source_name, &sink_name) != 0)
+        {
+            LogError("Unable to name the copies of link %s -> %s.", link_entry->module_source, link_entry->module_sink);
+            result = false;
+        }
+        else
+        {
+            result = add_link(gateway_handle, &pair_entry);
+        }
+        free(source_name);
+        free(sink_name);
+    }
+    if (!result)
+    {
+        /* pair was incremented past the pair that failed */
+        remove_replicated_link(gateway_handle, link_entry, source_replicas, sink_replicas, pair - 1);
+    }
+    return result;
+}
+
+bool gateway_addlink_internal(GATEWAY_HANDLE_DATA* gateway_handle, const GATEWAY_LINK_ENTRY* link_entry)
+{
+    bool result;
+    const MODULE_REPLICAS* source_replicas = find_module_replicas(gateway_handle, link_entry->module_source);
+    const MODULE_REPLICAS* sink_replicas = find_module_replicas(gateway_handle, link_entry->module_sink);
+
+    if (source_replicas != NULL || sink_replicas != NULL)
+    {
+        result = add_replicated_link(gateway_handle, link_entry, source_replicas, sink_replicas);
+    }
+    else
+    {
+        result = add_link(gateway_handle, link_entry);
+    }
+    return result;
+}
+
+bool gateway_removelink_replicas_internal(GATEWAY_HANDLE_DATA* gateway_handle, const GATEWAY_LINK_ENTRY* link_entry)
+{
+    bool result;
+    const MODULE_REPLICAS* source_replicas = find_module_replicas(gateway_handle, link_entry->module_source);
+    const MODULE_REPLICAS* sink_replicas = find_module_replicas(gateway_handle, link_entry->module_sink);
+
+    if (source_replicas == NULL && sink_replicas == NULL)
+    {
+        result = false;
+    }
+    else
+    {
+        size_t pairs = ((source_replicas == NULL) ? 1 : source_replicas->instances) * ((sink_replicas == NULL) ? 1 : sink_replicas->instances);
+        remove_replicated_link(gateway_handle, link_entry, source_replicas, sink_replicas, pairs);
+        result = true;
+    }
+    return result;
+}
+
 void gateway_removelink_internal(GATEWAY_HANDLE_DATA* gateway_handle, LINK_DATA* link_data)
 {
     /*Codes_SRS_GATEWAY_04_007: [The functional shall remove that LINK_DATA from GATEWAY_HANDLE_DATA's links. ]*/
@@ -767,7 +1100,7 @@ int add_module_to_any_source(GATEWAY_HANDLE_DATA* gateway_handle, MODULE_DATA* m
             }
             else
             {
-                if (add_one_link_to_broker(gateway_handle, module->module, (*module_sink)->module, GATEWAY_LINK_ENTRY_MESSAGE_TYPE_DEFAULT) != 0)
+                if (add_one_link_to_broker(gateway_handle, module->module, (*module_sink)->module, NULL) != 0)
                 {
                     result = __LINE__;
                     break;
@@ -849,7 +1182,7 @@ int add_any_source_link(GATEWAY_HANDLE_DATA* gateway_handle, const GATEWAY_LINK_
                 MODULE_DATA **source_module_data = (MODULE_DATA **)VECTOR_element(gateway_handle->modules, m);
                 /*Codes_SRS_GATEWAY_17_005: [ For this link, the sink shall receive all messages publish by other modules. ]*/
                 if ((*source_module_data)->module != (*module_sink_data)->module &&
-                    add_one_link_to_broker(gateway_handle, (*source_module_data)->module, (*module_sink_data)->module, link_entry->message_type) != 0)
+                    add_one_link_to_broker(gateway_handle, (*source_module_data)->module, (*module_sink_data)->module, link_entry) != 0)
                 {
                     result = __LINE__;
                     break;
@@ -28,6 +28,21 @@ typedef struct MODULE_DATA_TAG {
     MODULE_HANDLE module;
 } MODULE_DATA;
 
+typedef struct MODULE_REPLICAS_TAG {
+    /** @brief  The name the module was declared with. The copies are modules
+     *          of their own named "<module_name>#<index>".
+     */
+    char* module_name;
+
+    /** @brief  The number of copies. */
+    size_t instances;
+
+    /** @brief  The (possibly @c NULL) message property partitioning the
+     *          messages over the copies.
+     */
+    char* partition_key;
+} MODULE_REPLICAS;
+
 #define GATEWAY_RUNTIME_STATUS_VALUES \
 	GATEWAY_RUNTIME_STATUS_INITIALIZING, \
 	GATEWAY_RUNTIME_STATUS_UPDATING, \
@@ -61,6 +76,10 @@ typedef struct GATEWAY_HANDLE_DATA_TAG {
 	JSON_Object* deployConfig;
 
 	LOCK_HANDLE update_lock;
+
+    /** @brief  Vector of MODULE_REPLICAS of the modules added with several
+     *          instances, NULL until there is one */
+    VECTOR_HANDLE replicas;
 } GATEWAY_HANDLE_DATA;
 
 typedef struct LINK_DATA_TAG {
@@ -74,6 +93,8 @@ void gateway_destroy_internal(GATEWAY_HANDLE gw);
 MODULE_HANDLE gateway_addmodule_internal(GATEWAY_HANDLE_DATA* gateway_handle, const GATEWAY_MODULES_ENTRY* entry, bool use_json);
 void gateway_removemodule_internal(GATEWAY_HANDLE_DATA* gateway_handle, MODULE_DATA** module);
 bool gateway_addlink_internal(GATEWAY_HANDLE_DATA* gateway_handle, const GATEWAY_LINK_ENTRY* link_entry);
+bool gateway_removemodule_replicas_internal(GATEWAY_HANDLE_DATA* gateway_handle, const char* module_name);
+bool gateway_removelink_replicas_internal(GATEWAY_HANDLE_DATA* gateway_handle, const GATEWAY_LINK_ENTRY* link_entry);
 void gateway_removelink_internal(GATEWAY_HANDLE_DATA* gateway_handle, LINK_DATA* link_data);
 int add_module_to_any_source(GATEWAY_HANDLE_DATA* gateway_handle, MODULE_DATA* module);
 void remove_module_from_any_source(GATEWAY_HANDLE_DATA* gateway_handle, MODULE_DATA* module);
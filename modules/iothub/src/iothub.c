@@ -407,6 +407,12 @@ static IOTHUBMESSAGE_DISPOSITION_RESULT IotHub_ReceiveMessageCallback(IOTHUB_MES
                         LogError("Property [%s] did not add properly", GW_DEVICENAME_PROPERTY);
                         result = IOTHUBMESSAGE_ABANDONED;
                     }
+                    /* cloud-to-device commands overtake queued telemetry on thread-message links */
+                    else if (Map_AddOrUpdate(newProperties, BROKER_PRIORITY_PROPERTY, "high") != MAP_OK)
+                    {
+                        LogError("Property [%s] did not add properly", BROKER_PRIORITY_PROPERTY);
+                        result = IOTHUBMESSAGE_ABANDONED;
+                    }
                     else
                     {
                         /*Codes_SRS_IOTHUBMODULE_17_016: [ `IotHub_ReceiveMessageCallback` shall create a new message from combined properties, the size and buffer. ]*/
@@ -474,7 +480,8 @@ void IoTHub_TwinPropertiesCallback(DEVICE_TWIN_UPDATE_STATE update_state, const
             if (Map_Add(propertiesMap, GW_SOURCE_PROPERTY, GW_IOTHUB_MODULE) == MAP_OK
               && Map_AddOrUpdate(propertiesMap, "deviceName", STRING_c_str(personality->deviceName)) == MAP_OK
               && Map_AddOrUpdate(propertiesMap, "deviceKey", STRING_c_str(personality->deviceKey)) == MAP_OK
-              && Map_AddOrUpdate(propertiesMap, "udateState", state) == MAP_OK )
+              && Map_AddOrUpdate(propertiesMap, "udateState", state) == MAP_OK
+              && Map_AddOrUpdate(propertiesMap, BROKER_PRIORITY_PROPERTY, "high") == MAP_OK)
             {
                 msgConfig.size = size;
                 msgConfig.source = (unsigned char*)payload;
@@ -520,7 +527,8 @@ int IoTHub_TwinMethodCallback(const char* method_name, const unsigned char* payl
             if (Map_Add(propertiesMap, GW_SOURCE_PROPERTY, GW_IOTHUB_MODULE) == MAP_OK
               && Map_AddOrUpdate(propertiesMap, "deviceName", STRING_c_str(personality->deviceName)) == MAP_OK
               && Map_AddOrUpdate(propertiesMap, "deviceKey", STRING_c_str(personality->deviceKey)) == MAP_OK
-              && Map_AddOrUpdate(propertiesMap, "method", method_name) == MAP_OK)
+              && Map_AddOrUpdate(propertiesMap, "method", method_name) == MAP_OK
+              && Map_AddOrUpdate(propertiesMap, BROKER_PRIORITY_PROPERTY, "high") == MAP_OK)
             {
                 msgConfig.size = size;
                 msgConfig.source = (unsigned char*)payload;
@@ -0,0 +1,227 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "azure_c_shared_utility/lock.h"
+#include "azure_c_shared_utility/map.h"
+#include "azure_c_shared_utility/threadapi.h"
+#include "azure_c_shared_utility/tickcounter.h"
+
+#include "broker.h"
+#include "message.h"
+#include "module.h"
+
+/* Publishes messages from one module to another over each kind of link and
+ * prints the throughput and the publish to Receive latency of each. */
+
+#define DEFAULT_MESSAGE_COUNT 100000
+/* how long to wait for the sink to catch up once everything is published */
+#define DRAIN_TIMEOUT_MS 10000
+
+typedef struct BENCHMARK_MODULE_TAG
+{
+    LOCK_HANDLE lock;
+    size_t received;
+} BENCHMARK_MODULE;
+
+static void Benchmark_Receive(MODULE_HANDLE moduleHandle, MESSAGE_HANDLE messageHandle)
+{
+    BENCHMARK_MODULE* module = (BENCHMARK_MODULE*)moduleHandle;
+    (void)messageHandle;
+    if (Lock(module->lock) == LOCK_OK)
+    {
+        module->received++;
+        (void)Unlock(module->lock);
+    }
+}
+
+static size_t Benchmark_Received(BENCHMARK_MODULE* module)
+{
+    size_t result = 0;
+    if (Lock(module->lock) == LOCK_OK)
+    {
+        result = module->received;
+        (void)Unlock(module->lock);
+    }
+    return result;
+}
+
+static const MODULE_API_1 Benchmark_APIS_all =
+{
+    { MODULE_API_VERSION_1 },
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    Benchmark_Receive,
+    NULL
+};
+
+static const char* link_type_name(BROKER_LINK_MESSAGE_TYPE message_type)
+{
+    const char* result;
+    switch (message_type)
+    {
+    case BROKER_LINK_MESSAGE_TYPE_THREAD:
+        result = "thread-message";
+        break;
+    case BROKER_LINK_MESSAGE_TYPE_DIRECT:
+        result = "direct";
+        break;
+    case BROKER_LINK_MESSAGE_TYPE_DEFAULT:
+    default:
+        result = "default";
+        break;
+    }
+    return result;
+}
+
+static void print_result(BROKER_HANDLE broker, BENCHMARK_MODULE* sink, BROKER_LINK_MESSAGE_TYPE message_type, size_t published, tickcounter_ms_t elapsed_ms)
+{
+    BROKER_STATISTICS statistics;
+    if (Broker_GetStatistics(broker, &statistics) != BROKER_OK)
+    {
+        printf("%-15s unable to get the broker statistics\n", link_type_name(message_type));
+    }
+    else
+    {
+        size_t i;
+        for (i = 0; i < statistics.module_count; i++)
+        {
+            if (statistics.modules[i].module == (MODULE_HANDLE)sink)
+            {
+                const BROKER_LATENCY_HISTOGRAM* latency = &statistics.modules[i].receive_latency;
+                printf("%-15s %10zu/%-10zu %12.0f msg/s   latency p50 %8llu us  p99 %8llu us  max %8llu us\n",
+                    link_type_name(message_type),
+                    statistics.modules[i].delivered,
+                    published,
+                    (elapsed_ms == 0) ? 0.0 : (double)statistics.modules[i].delivered * 1000.0 / (double)elapsed_ms,
+                    (unsigned long long)Broker_LatencyHistogramPercentile(latency, 50),
+                    (unsigned long long)Broker_LatencyHistogramPercentile(latency, 99),
+                    (unsigned long long)latency->max_us);
+            }
+        }
+        Broker_FreeStatistics(&statistics);
+    }
+}
+
+static int run_benchmark(BROKER_LINK_MESSAGE_TYPE message_type, size_t message_count)
+{
+    int result;
+    BENCHMARK_MODULE source_module = { NULL, 0 };
+    BENCHMARK_MODULE sink_module = { NULL, 0 };
+    BROKER_HANDLE broker = Broker_Create();
+    TICK_COUNTER_HANDLE tick_counter = tickcounter_create();
+    MAP_HANDLE properties = Map_Create(NULL);
+    source_module.lock = Lock_Init();
+    sink_module.lock = Lock_Init();
+
+    if (broker == NULL || tick_counter == NULL || properties == NULL || source_module.lock == NULL || sink_module.lock == NULL ||
+        Map_Add(properties, "benchmark", "true") != MAP_OK)
+    {
+        printf("unable to set up the %s benchmark\n", link_type_name(message_type));
+        result = __LINE__;
+    }
+    else
+    {
+        MODULE source = { (const MODULE_API*)&Benchmark_APIS_all, (MODULE_HANDLE)&source_module, NATIVE };
+        MODULE sink = { (const MODULE_API*)&Benchmark_APIS_all, (MODULE_HANDLE)&sink_module, NATIVE };
+        BROKER_LINK_DATA link;
+        memset(&link, 0, sizeof(link));
+        link.module_source_handle = source.module_handle;
+        link.module_sink_handle = sink.module_handle;
+        link.message_type = message_type;
+        link.queue_policy = BROKER_LINK_QUEUE_POLICY_BLOCK;
+
+        if (Broker_AddModule(broker, &source) != BROKER_OK || Broker_AddModule(broker, &sink) != BROKER_OK || Broker_AddLink(broker, &link) != BROKER_OK)
+        {
+            printf("unable to link the modules of the %s benchmark\n", link_type_name(message_type));
+            result = __LINE__;
+        }
+        else
+        {
+            static const unsigned char payload[64] = { 0 };
+            MESSAGE_CONFIG message_config;
+            MESSAGE_HANDLE message;
+            message_config.size = sizeof(payload);
+            message_config.source = payload;
+            message_config.sourceProperties = properties;
+            message = Message_Create(&message_config);
+            if (message == NULL)
+            {
+                printf("unable to create the message of the %s benchmark\n", link_type_name(message_type));
+                result = __LINE__;
+            }
+            else
+            {
+                tickcounter_ms_t start_ms;
+                tickcounter_ms_t now_ms;
+                size_t published = 0;
+                size_t i;
+
+                (void)tickcounter_get_current_ms(tick_counter, &start_ms);
+                for (i = 0; i < message_count; i++)
+                {
+                    if (Broker_Publish(broker, source.module_handle, message) == BROKER_OK)
+                    {
+                        published++;
+                    }
+                }
+                /* default links may drop messages, so the wait is bounded */
+                (void)tickcounter_get_current_ms(tick_counter, &now_ms);
+                while (Benchmark_Received(&sink_module) < published && now_ms - start_ms < DRAIN_TIMEOUT_MS)
+                {
+                    ThreadAPI_Sleep(1);
+                    (void)tickcounter_get_current_ms(tick_counter, &now_ms);
+                }
+                print_result(broker, &sink_module, message_type, published, now_ms - start_ms);
+                Message_Destroy(message);
+                result = 0;
+            }
+        }
+        (void)Broker_RemoveModule(broker, &sink);
+        (void)Broker_RemoveModule(broker, &source);
+    }
+
+    if (properties != NULL)
+    {
+        Map_Destroy(properties);
+    }
+    if (tick_counter != NULL)
+    {
+        tickcounter_destroy(tick_counter);
+    }
+    if (broker != NULL)
+    {
+        Broker_Destroy(broker);
+    }
+    if (source_module.lock != NULL)
+    {
+        Lock_Deinit(source_module.lock);
+    }
+    if (sink_module.lock != NULL)
+    {
+        Lock_Deinit(sink_module.lock);
+    }
+    return result;
+}
+
+int main(int argc, char** argv)
+{
+    size_t message_count = (argc > 1) ? (size_t)strtoul(argv[1], NULL, 10) : DEFAULT_MESSAGE_COUNT;
+    if (message_count == 0)
+    {
+        printf("usage: broker_benchmark [messageCount]\n");
+    }
+    else
+    {
+        printf("%zu messages of 64 bytes from one module to another\n", message_count);
+        (void)run_benchmark(BROKER_LINK_MESSAGE_TYPE_DEFAULT, message_count);
+        (void)run_benchmark(BROKER_LINK_MESSAGE_TYPE_THREAD, message_count);
+        (void)run_benchmark(BROKER_LINK_MESSAGE_TYPE_DIRECT, message_count);
+    }
+    return 0;
+}